@@ -0,0 +1,466 @@
+// End to end throughput benchmark, "make bench".
+//
+// Runs dl on a pty with a synthetic client on the other end, through a
+// fixed set of scenarios, and prints requests/s, the time per request and
+// bytes/s for each.
+// Every scenario runs once flat out, and once with the client pacing its
+// end as if the line ran at a real baud rate (10 bits per byte, 8N1).
+// The pty itself has no baud rate, so this is the client's doing.
+//
+// The "drain" scenarios run dl with TX_DRAIN, a tcdrain() after every
+// write as it used to be, next to the same thing queued. A pty's
+// tcdrain() returns at once, so that only shows the cost of the extra
+// syscalls, and on a real port each write would wait out its wire time too.
+//
+// Responses are checked, so a protocol regression fails the run.
+//
+// Usage: dl_bench /path/to/dl [baud [seconds]]
+// seconds limits each paced scenario, since some of them would take many
+// minutes at 19200. The rates are from however far it got.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#if defined(__linux__)
+#include <pty.h>
+#elif defined(__APPLE__) || defined(__NetBSD__) || defined(OpenBSD)
+#include <util.h>
+#elif defined(__FreeBSD__)
+#include <libutil.h>
+#endif
+
+#include "constants.h"
+
+#ifndef BENCH_BAUD
+#define BENCH_BAUD 19200
+#endif
+#ifndef BENCH_SECS
+#define BENCH_SECS 3
+#endif
+#define BENCH_TIMEOUT_MS 5000
+
+typedef struct {
+	int m, s;          // pty master (the client's end), slave (dl's)
+	pid_t pid;
+	unsigned baud;     // 0 = no pacing
+	uint64_t tx_free;  // ns, when the simulated line is free again, each way
+	uint64_t rx_free;
+	uint64_t end;      // ns, stop the scenario at this time, 0 = never
+	unsigned long reqs;
+	unsigned long long bytes;
+	bool partial;      // stopped at end
+} CLIENT;
+
+static char* dl_path;
+static char work[] = "/tmp/dl_bench.XXXXXX";
+static char img1[PATH_MAX], img2[PATH_MAX];
+
+static uint64_t now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+	uint64_t n = now();
+	struct timespec d;
+	if (t<=n) return;
+	d.tv_sec = (t-n)/1000000000u;
+	d.tv_nsec = (t-n)%1000000000u;
+	while (nanosleep(&d,&d) && errno==EINTR);
+}
+
+// n bytes on the simulated line, each direction is its own wire
+static void wire(CLIENT* c, uint64_t* f, unsigned n) {
+	uint64_t t = now();
+	if (!c->baud) return;
+	if (*f<t) *f = t;
+	*f += (uint64_t)n*10*1000000000u/c->baud;
+	sleep_until(*f);
+}
+
+static int send_b(CLIENT* c, const void* b, unsigned n) {
+	const uint8_t* p = b;
+	ssize_t r;
+	wire(c,&c->tx_free,n);
+	while (n) {
+		if ((r = write(c->m,p,n))<0) { if (errno==EINTR) continue; return -1; }
+		p += r; n -= r;
+		c->bytes += r;
+	}
+	return 0;
+}
+
+static int recv_b(CLIENT* c, void* b, unsigned n) {
+	uint8_t* p = b;
+	unsigned l = n;
+	struct pollfd f = {c->m,POLLIN,0};
+	ssize_t r;
+	while (l) {
+		if (poll(&f,1,BENCH_TIMEOUT_MS)<1) return -1;
+		if ((r = read(c->m,p,l))<=0) { if (r<0 && errno==EINTR) continue; return -1; }
+		p += r; l -= r;
+	}
+	c->bytes += n;
+	wire(c,&c->rx_free,n);
+	return 0;
+}
+
+static uint8_t checksum(const uint8_t* b) {
+	unsigned s = 0;
+	for (unsigned i=0;i<2u+b[1];i++) s += b[i];
+	return ~s&0xFF;
+}
+
+// Operation-mode request, and its response into r (fmt len data chk)
+static int opr(CLIENT* c, uint8_t fmt, const void* d, uint8_t len, uint8_t* r) {
+	uint8_t b[TPDD_MSG_MAX+5] = {0x5A,0x5A,fmt,len};
+	memcpy(b+4,d,len);
+	b[4+len] = checksum(b+2);
+	if (send_b(c,b,5+len)) return -1;
+	c->reqs++;
+	if (!r) return 0;
+	if (recv_b(c,r,2) || recv_b(c,r+2,r[1]+1)) return -1;
+	return checksum(r)==r[2+r[1]] ? 0 : -1;
+}
+
+// FDC-mode command, or just the result of the data stage if cmd is NULL,
+// returns the last 4 hex digits of the 8 character result
+static int fdc(CLIENT* c, const char* cmd) {
+	char r[9] = {0};
+	if (cmd) {
+		if (send_b(c,cmd,strlen(cmd))) return -1;
+		c->reqs++;
+	}
+	if (recv_b(c,r,8)) return -1;
+	if (r[0]!='0' || (r[1]!='0' && r[1]!='4')) return -1;
+	return strtol(r+4,NULL,16);
+}
+
+static bool over(CLIENT* c) {
+	if (!c->end || now()<c->end) return false;
+	c->partial = true;
+	return true;
+}
+
+static int dirent(CLIENT* c, const char* name, uint8_t action, uint8_t* r) {
+	uint8_t b[26] = {0};
+	if (name) { memset(b,' ',24); memcpy(b,name,strlen(name)); }
+	b[24] = 'F';
+	b[25] = action;
+	return opr(c,REQ_DIRENT,b,26,r);
+}
+
+////////////////////////////////////////////////////////////////////////
+// scenarios
+
+static int sc_list(CLIENT* c, long n) {
+	uint8_t r[TPDD_MSG_MAX+3];
+	long i = 0;
+	if (dirent(c,NULL,DIRENT_GET_FIRST,r)) return -1;
+	while (r[2]) {
+		i++;
+		if (over(c)) return 0;
+		if (dirent(c,NULL,DIRENT_GET_NEXT,r)) return -1;
+	}
+	return i==n ? 0 : -1;
+}
+
+static int sc_read(CLIENT* c, long n) {
+	uint8_t r[TPDD_MSG_MAX+3], m = F_OPEN_READ;
+	long i = 0;
+	if (dirent(c,"READ  .BA",DIRENT_SET_NAME,r)) return -1;
+	if (opr(c,REQ_OPEN,&m,1,r) || r[2]) return -1;
+	do {
+		if (over(c)) return 0;
+		if (opr(c,REQ_READ,NULL,0,r) || r[0]!=RET_READ) return -1;
+		for (unsigned j=0;j<r[1];j++,i++) if (r[2+j]!=(uint8_t)i) return -1;
+	} while (r[1]==REQ_RW_DATA_MAX);
+	if (opr(c,REQ_CLOSE,NULL,0,r) || r[2]) return -1;
+	return i==n ? 0 : -1;
+}
+
+static int sc_write(CLIENT* c, long n) {
+	uint8_t r[TPDD_MSG_MAX+3], d[REQ_RW_DATA_MAX], m = F_OPEN_WRITE;
+	if (dirent(c,"WRITE .DO",DIRENT_SET_NAME,r)) return -1;
+	if (opr(c,REQ_OPEN,&m,1,r) || r[2]) return -1;
+	for (long i=0;i<n;i+=REQ_RW_DATA_MAX) {
+		if (over(c)) break;
+		memset(d,'A'+i/REQ_RW_DATA_MAX%26,sizeof(d));
+		if (opr(c,REQ_WRITE,d,sizeof(d),r) || r[2]) return -1;
+	}
+	return opr(c,REQ_CLOSE,NULL,0,r) || r[2] ? -1 : 0;
+}
+
+// FDC read and write back every sector of a TPDD1 disk
+static int sc_fdc_rw(CLIENT* c, long n) {
+	uint8_t d[SECTOR_DATA_LEN];
+	char cmd[32];
+	int l;
+	if (opr(c,REQ_FDC,NULL,0,NULL)) return -1;
+	for (long i=0;i<n;i++) {
+		if (over(c)) return 0;
+		snprintf(cmd,sizeof(cmd),"R%ld,1\r",i);
+		if ((l = fdc(c,cmd))<1 || l>SECTOR_DATA_LEN) return -1;
+		if (send_b(c,"\r",1) || recv_b(c,d,l)) return -1;
+		snprintf(cmd,sizeof(cmd),"W%ld,1\r",i);
+		if (fdc(c,cmd)!=l) return -1;
+		if (send_b(c,d,l) || fdc(c,NULL)<0) return -1;
+	}
+	return 0;
+}
+
+// one short request at a time, for the round trip per packet
+static int sc_turnaround(CLIENT* c, long n) {
+	uint8_t r[TPDD_MSG_MAX+3];
+	for (long i=0;i<n;i++) {
+		if (over(c)) break;
+		if (opr(c,REQ_STATUS,NULL,0,r) || r[0]!=RET_STD[0] || r[2]) return -1;
+	}
+	return 0;
+}
+
+static int sc_search_id(CLIENT* c, long n) {
+	uint8_t b[SECTOR_LEN];
+	int f = open(img1,O_RDONLY);
+	if (f<0) return -1;
+	if (opr(c,REQ_FDC,NULL,0,NULL)) { close(f); return -1; }
+	for (long i=0;i<n;i++) {
+		if (over(c)) break;
+		if (pread(f,b,SECTOR_LEN,i*SECTOR_LEN)!=SECTOR_LEN
+			|| fdc(c,"S\r")<0 || send_b(c,b+1,SECTOR_ID_LEN) || fdc(c,NULL)<0) { close(f); return -1; }
+	}
+	close(f);
+	return 0;
+}
+
+// TPDD2 cache load and mem_read of every sector
+static int sc_cache(CLIENT* c, long n) {
+	uint8_t r[TPDD_MSG_MAX+3], b[SECTOR_LEN], q[5] = {0};
+	int f = open(img2,O_RDONLY);
+	if (f<0) return -1;
+	for (long i=0;i<n;i++) {
+		if (over(c)) break;
+		if (pread(f,b,SECTOR_LEN,i*SECTOR_LEN)!=SECTOR_LEN) goto fail;
+		q[2] = i/PDD2_SECTORS;
+		q[4] = i%PDD2_SECTORS;
+		if (opr(c,REQ_CACHE,q,5,r) || r[2]) goto fail;
+		for (unsigned o=0;o<SECTOR_DATA_LEN;o+=252) {
+			uint8_t m[4] = {0,o>>8,o&0xFF,SECTOR_DATA_LEN-o<252?SECTOR_DATA_LEN-o:252};
+			if (opr(c,REQ_MEM_READ,m,4,r) || r[0]!=RET_MEM_READ || memcmp(r+5,b+SECTOR_HEADER_LEN+o,m[3])) goto fail;
+		}
+	}
+	close(f);
+	return 0;
+fail:
+	close(f);
+	return -1;
+}
+
+typedef struct {
+	const char* name;
+	const char* share;     // subdirectory of work
+	const char* args[6];   // more dl args
+	int (*f)(CLIENT*,long);
+	long n;
+	char* env;             // NAME=value for dl
+} SCENARIO;
+
+static SCENARIO scenarios[] = {
+	{"list 40",        "s40",   {0},                        sc_list,      40},
+	{"list 1k",        "s1k",   {0},                        sc_list,      1000},
+	{"list 10k",       "s10k",  {0},                        sc_list,      10000},
+	{"read 64k",       "rw",    {0},                        sc_read,      65536},
+	{"read 64k drain", "rw",    {0},                        sc_read,      65536, "TX_DRAIN=1"},
+	{"write 64k",      "rw",    {0},                        sc_write,     65536},
+	{"fdc r/w 80",     "rw",    {"-e","off","-i",img1},     sc_fdc_rw,    PDD1_TRACKS*PDD1_SECTORS},
+	{"fdc search_id",  "rw",    {"-e","off","-i",img1},     sc_search_id, PDD1_TRACKS*PDD1_SECTORS},
+	{"tpdd2 cache 160","rw",    {"-m","2","-i",img2},       sc_cache,     PDD2_TRACKS*PDD2_SECTORS},
+	// responses queued, and the old tcdrain() after every write
+	{"turnaround",     "rw",    {0},                        sc_turnaround,10000},
+	{"turnaround drain","rw",   {0},                        sc_turnaround,10000, "TX_DRAIN=1"},
+};
+
+////////////////////////////////////////////////////////////////////////
+// setup
+
+static void rm_r(const char* p) {
+	char f[PATH_MAX];
+	struct dirent* e;
+	DIR* d = opendir(p);
+	if (d) {
+		while ((e = readdir(d))) {
+			if (!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) continue;
+			snprintf(f,sizeof(f),"%s/%s",p,e->d_name);
+			rm_r(f);
+		}
+		closedir(d);
+	}
+	remove(p);
+}
+
+static int make_file(const char* dir, const char* name, long n, bool ramp) {
+	char p[PATH_MAX];
+	uint8_t b[4096];
+	FILE* f;
+	snprintf(p,sizeof(p),"%s/%s",dir,name);
+	if (!(f = fopen(p,"wb"))) return -1;
+	for (long i=0;i<n;i+=sizeof(b)) {
+		long l = n-i<(long)sizeof(b) ? n-i : (long)sizeof(b);
+		for (long j=0;j<l;j++) b[j] = ramp ? (uint8_t)(i+j) : 'x';
+		fwrite(b,1,l,f);
+	}
+	return fclose(f);
+}
+
+static int copy_file(const char* from, const char* to) {
+	char b[65536];
+	ssize_t n;
+	int i = open(from,O_RDONLY), o = open(to,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if (i<0 || o<0) return -1;
+	while ((n = read(i,b,sizeof(b)))>0) if (write(o,b,n)!=n) n = -1;
+	close(i); close(o);
+	return n<0 ? -1 : 0;
+}
+
+static int setup(void) {
+	char p[PATH_MAX], d[PATH_MAX], n[16];
+	char* lib = strdup(dl_path);
+	char* s = strrchr(lib,'/');
+	if (s) *s = 0x00; else strcpy(lib,".");
+
+	if (!mkdtemp(work)) return -1;
+	for (unsigned i=0;i<3;i++) {
+		long c = i==0 ? 40 : i==1 ? 1000 : 10000;
+		snprintf(d,sizeof(d),"%s/%s",work,scenarios[i].share);
+		if (mkdir(d,0755)) return -1;
+		for (long j=0;j<c;j++) {
+			snprintf(n,sizeof(n),"F%05ld.DO",j);
+			if (make_file(d,n,16,false)) return -1;
+		}
+	}
+	snprintf(d,sizeof(d),"%s/rw",work);
+	if (mkdir(d,0755) || make_file(d,"READ.BA",65536,true)) return -1;
+	// the utility disks next to dl, as in the source tree
+	snprintf(p,sizeof(p),"%s/TPDD1_26-3808_Utility_Disk.pdd1",lib);
+	snprintf(img1,sizeof(img1),"%s/rw/u.pdd1",work);
+	if (copy_file(p,img1)) { fprintf(stderr,"%s: %s\n",p,strerror(errno)); return -1; }
+	snprintf(p,sizeof(p),"%s/TPDD2_26-3814_Utility_Disk.pdd2",lib);
+	snprintf(img2,sizeof(img2),"%s/rw/u.pdd2",work);
+	if (copy_file(p,img2)) { fprintf(stderr,"%s: %s\n",p,strerror(errno)); return -1; }
+	free(lib);
+	return 0;
+}
+
+static void stop_dl(CLIENT* c) {
+	if (c->pid>0) {
+		kill(c->pid,SIGTERM);
+		waitpid(c->pid,NULL,0);
+	}
+	close(c->m);
+	close(c->s);
+}
+
+static int start_dl(CLIENT* c, SCENARIO* sc) {
+	char share[PATH_MAX], log[PATH_MAX];
+	char* av[16];
+	struct termios t;
+	uint8_t r[TPDD_MSG_MAX+3];
+	int i = 0;
+
+	memset(c,0,sizeof(*c));
+	c->pid = -1;
+	if (openpty(&c->m,&c->s,NULL,NULL,NULL)) return -1;
+	tcgetattr(c->m,&t);
+	cfmakeraw(&t);
+	tcsetattr(c->m,TCSANOW,&t);
+	snprintf(share,sizeof(share),"%s/%s",work,sc->share);
+	snprintf(log,sizeof(log),"%s/dl.log",work);
+
+	av[i++] = dl_path;
+	for (int j=0;j<6 && sc->args[j];j++) av[i++] = (char*)sc->args[j];
+	av[i++] = "-d"; av[i++] = ttyname(c->s);
+	av[i++] = "-p"; av[i++] = share;
+	av[i] = NULL;
+	if (!(c->pid = fork())) {
+		int f = open(log,O_WRONLY|O_CREAT|O_APPEND,0644);
+		dup2(f,2);
+		f = open("/dev/null",O_RDWR);
+		dup2(f,0); dup2(f,1);
+		if (sc->env) putenv(sc->env);
+		execv(dl_path,av);
+		_exit(127);
+	}
+	if (c->pid<0) return -1;
+
+	// dl flushes the tty when it opens it, so poke it until it answers
+	for (i=0;i<50;i++) {
+		struct pollfd f = {c->m,POLLIN,0};
+		uint8_t q[5] = {0x5A,0x5A,REQ_STATUS,0x00,0x00};
+		q[4] = checksum(q+2);
+		if (write(c->m,q,5)!=5) return -1;
+		if (poll(&f,1,100)==1) {
+			usleep(20000);
+			while (poll(&f,1,0)==1 && read(c->m,r,sizeof(r))>0);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int run(SCENARIO* sc, unsigned baud, unsigned secs) {
+	CLIENT c;
+	uint64_t t;
+	int e;
+	char p[PATH_MAX];
+
+	snprintf(p,sizeof(p),"%s/%s/WRITE.DO",work,sc->share);
+	unlink(p);
+	if (start_dl(&c,sc)) { stop_dl(&c); fprintf(stderr,"%s: dl didn't start, see %s/dl.log\n",sc->name,work); return -1; }
+	c.baud = baud;
+	t = now();
+	if (baud) c.end = t+(uint64_t)secs*1000000000u;
+	e = sc->f(&c,sc->n);
+	t = now()-t;
+	stop_dl(&c);
+
+	printf("%-16s %6u %9lu %11llu %8.3f %10.0f %8.1f %11.0f%s\n",
+		sc->name,baud,c.reqs,c.bytes,t/1e9,c.reqs/(t/1e9),t/1e3/(c.reqs?c.reqs:1),c.bytes/(t/1e9),
+		e ? "  FAILED" : c.partial ? "  (time limit)" : "");
+	fflush(stdout);
+	return e;
+}
+
+int main(int argc, char** argv) {
+	unsigned baud = BENCH_BAUD, secs = BENCH_SECS;
+	int e = 0;
+
+	if (argc<2) { fprintf(stderr,"Usage: %s /path/to/dl [baud [seconds]]\n",argv[0]); return 2; }
+	if (!(dl_path = realpath(argv[1],NULL))) { fprintf(stderr,"%s: %s\n",argv[1],strerror(errno)); return 2; }
+	if (argc>2) baud = atoi(argv[2]);
+	if (argc>3) secs = atoi(argv[3]);
+	signal(SIGPIPE,SIG_IGN);
+
+	if (setup()) { fprintf(stderr,"setup: %s\n",strerror(errno)); return 1; }
+	printf("%-16s %6s %9s %11s %8s %10s %8s %11s\n","scenario","baud","requests","bytes","seconds","req/s","us/req","bytes/s");
+	for (unsigned i=0;i<sizeof(scenarios)/sizeof(scenarios[0]);i++) {
+		if (run(scenarios+i,0,secs)) e = 1;
+		if (baud && run(scenarios+i,baud,secs)) e = 1;
+	}
+	if (e) printf("Failed, dl's stderr is in %s/dl.log\n",work);
+	else rm_r(work);
+	return e;
+}
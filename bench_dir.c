@@ -0,0 +1,238 @@
+// Directory listing benchmark, "make bench-dir".
+//
+// Times find_file() on lists of 40 to 100000 entries, against the linear
+// search it replaced, which is kept here for comparison.
+//
+// Then counts the syscalls for one listing of a share of SCAN_FILES files
+// and SCAN_DIRS directories (not DME, so the directories aren't listed),
+// the way it used to be read, readdir() and fstatat() for every entry,
+// and through dir_scan. getdents64() fstatat() and statx() are counted by
+// wrapping them at link time (Linux only). readdir() calls getdents64()
+// from inside libc where that can't see it, so the old way is done here
+// the way glibc does it, with a 32K buffer.
+//
+// Usage: dl_bench_dir
+
+#if defined(__linux__)
+#define _GNU_SOURCE // statx()
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "constants.h"
+#include "dir_list.h"
+
+static const unsigned sizes[] = { 40, 1000, 10000, 100000 };
+
+#ifndef SCAN_FILES
+#define SCAN_FILES 10000
+#endif
+#ifndef SCAN_DIRS
+#define SCAN_DIRS 20
+#endif
+#define SCAN_RUNS 20 // for the time
+
+// dir_list.c logs through main.c's dbg()
+void dbg(const int v, const char* format, ...) {
+	va_list a;
+	va_start(a,format);
+	vfprintf(stderr,format,a);
+	va_end(a);
+}
+
+static uint64_t now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+// find_file() before the hash index
+static FILE_ENTRY* find_linear(FILE_LIST* fl, char* client_fname, uint8_t attr) {
+	for (unsigned i=0;i<fl->ndx;i++)
+		if (!strcmp(client_fname,fl->tbl[i].client_fname) && fl->tbl[i].attr==attr) return fl->tbl+i;
+	return 0;
+}
+
+// ns per lookup of n names in random order, -1 if one wasn't found
+static double lookup(FILE_LIST* fl, char (*names)[TPDD_FILENAME_LEN+1], unsigned n, bool linear) {
+	unsigned k = linear ? 20000000/n+100 : 2000000; // about the same number of strcmp()s each
+	unsigned r = 1;
+	uint64_t t = now();
+	for (unsigned i=0;i<k;i++) {
+		char* name = names[(r=r*1103515245+12345)%n];
+		FILE_ENTRY* e = linear ? find_linear(fl,name,'F') : find_file(fl,name,'F');
+		if (!e || strcmp(e->client_fname,name)) return -1;
+	}
+	return (double)(now()-t)/k;
+}
+
+static int bench_lookup(void) {
+	FILE_CURSOR fc = {0};
+	FILE_ENTRY fe = {0};
+	char (*names)[TPDD_FILENAME_LEN+1];
+	int e = 0;
+
+	printf("%-8s %10s %10s\n","entries","linear ns","hash ns");
+	for (unsigned i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		unsigned n = sizes[i];
+		if (!(names = malloc(n*sizeof(*names)))) return 1;
+		if (!(fc.fl = file_list_get("/bench",FL_FLAGS_NONE))) return 1;
+		file_list_clear_all(&fc);
+		fe.attr = 'F';
+		for (unsigned j=0;j<n;j++) {
+			snprintf(names[j],sizeof(names[j]),"%06u.BA",j);
+			strcpy(fe.client_fname,names[j]);
+			strcpy(fe.local_fname,names[j]);
+			if (add_file(&fc,&fe)) { printf("add_file(%s) failed\n",names[j]); return 1; }
+		}
+		double l = lookup(fc.fl,names,n,true);
+		double h = lookup(fc.fl,names,n,false);
+		if (l<0 || h<0) { printf("%u: lookup failed\n",n); e = 1; }
+		printf("%-8u %10.0f %10.0f\n",n,l,h);
+		file_list_put(fc.fl);
+		free(names);
+	}
+	return e;
+}
+
+#if defined(__linux__)
+static unsigned n_getdents, n_fstatat, n_statx;
+
+long __real_syscall(long n, ...);
+int __real_fstatat(int dirfd, const char* name, struct stat* st, int fl);
+int __real_statx(int dirfd, const char* name, int fl, unsigned mask, struct statx* stx);
+
+long __wrap_syscall(long n, ...) {
+	va_list a;
+	long x[6];
+	va_start(a,n);
+	for (int i=0;i<6;i++) x[i] = va_arg(a,long);
+	va_end(a);
+	if (n==SYS_getdents64) n_getdents++;
+	return __real_syscall(n,x[0],x[1],x[2],x[3],x[4],x[5]);
+}
+
+int __wrap_fstatat(int dirfd, const char* name, struct stat* st, int fl) {
+	n_fstatat++;
+	return __real_fstatat(dirfd,name,st,fl);
+}
+
+int __wrap_statx(int dirfd, const char* name, int fl, unsigned mask, struct statx* stx) {
+	n_statx++;
+	return __real_statx(dirfd,name,fl,mask,stx);
+}
+
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+// the old read_next_dirent(), files listed
+static int scan_before(int dirfd) {
+	static char b[32768];
+	struct stat st;
+	int n = 0, fd = openat(dirfd,".",O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd<0) return -1;
+	for (long len;(len=syscall(SYS_getdents64,fd,b,sizeof(b)))>0;) {
+		for (long p=0;p<len;) {
+			struct linux_dirent64* e = (struct linux_dirent64*)(b+p);
+			p += e->d_reclen;
+			if (fstatat(dirfd,e->d_name,&st,0)) { n = -1; goto done; }
+			if (S_ISDIR(st.st_mode) || !S_ISREG(st.st_mode)) continue;
+			if (e->d_name[0]=='.' || strlen(e->d_name)>LOCAL_FILENAME_MAX) continue;
+			n++;
+		}
+	}
+done:
+	close(fd);
+	return n;
+}
+
+// read_next_dirent() now
+static int scan_after(int dirfd) {
+	DIR_SCAN* ds = dir_scan_open(dirfd);
+	const char* name;
+	uint8_t type;
+	off_t size;
+	int n = 0;
+	if (!ds) return -1;
+	while ((name=dir_scan_next(ds,&type))) {
+		if (name[0]=='.' || strlen(name)>LOCAL_FILENAME_MAX) continue;
+		if (type==DS_TYPE_OTHER || type==DS_TYPE_DIR) continue;
+		if (dir_scan_stat(dirfd,name,&type,&size)) { n = -1; break; }
+		if (type==DS_TYPE_FILE) n++;
+	}
+	dir_scan_close(ds);
+	return n;
+}
+
+static int bench_scan(void) {
+	static const struct { const char* name; int (*f)(int); } ways[] = {
+		{ "before", scan_before },
+		{ "after", scan_after },
+	};
+	char work[] = "/tmp/dl_bench_dir.XXXXXX";
+	char p[64];
+	int dirfd, fd, e = 0;
+
+	if (!mkdtemp(work) || (dirfd = open(work,O_RDONLY|O_DIRECTORY))<0) { perror(work); return 1; }
+	for (unsigned i=0;i<SCAN_FILES;i++) {
+		snprintf(p,sizeof(p),"F%05u.BA",i);
+		if ((fd = openat(dirfd,p,O_WRONLY|O_CREAT,0644))<0) { perror(p); e = 1; goto done; }
+		close(fd);
+	}
+	for (unsigned i=0;i<SCAN_DIRS;i++) {
+		snprintf(p,sizeof(p),"D%02u",i);
+		if (mkdirat(dirfd,p,0755)) { perror(p); e = 1; goto done; }
+	}
+
+	printf("\nlisting %u files + %u directories\n",SCAN_FILES,SCAN_DIRS);
+	printf("%-8s %10s %10s %10s %10s\n","","getdents64","fstatat","statx","us");
+	for (unsigned i=0;i<sizeof(ways)/sizeof(ways[0]);i++) {
+		uint64_t t;
+		int n;
+		n_getdents = n_fstatat = n_statx = 0;
+		n = ways[i].f(dirfd);
+		unsigned g = n_getdents, f = n_fstatat, x = n_statx;
+		t = now();
+		for (unsigned r=0;r<SCAN_RUNS;r++) ways[i].f(dirfd);
+		t = (now()-t)/SCAN_RUNS;
+		if (n!=SCAN_FILES) { printf("%s: listed %d files\n",ways[i].name,n); e = 1; }
+		printf("%-8s %10u %10u %10u %10llu\n",ways[i].name,g,f,x,(unsigned long long)t/1000);
+	}
+
+done:
+	for (unsigned i=0;i<SCAN_FILES;i++) { snprintf(p,sizeof(p),"F%05u.BA",i); unlinkat(dirfd,p,0); }
+	for (unsigned i=0;i<SCAN_DIRS;i++) { snprintf(p,sizeof(p),"D%02u",i); unlinkat(dirfd,p,AT_REMOVEDIR); }
+	close(dirfd);
+	rmdir(work);
+	return e;
+}
+#endif
+
+int main(void) {
+	int e;
+	file_list_init();
+	e = bench_lookup();
+	file_list_cleanup();
+#if defined(__linux__)
+	if (bench_scan()) e = 1;
+#endif
+	return e;
+}
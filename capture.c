@@ -0,0 +1,216 @@
+// Binary capture of the client tty traffic, see capture.h.
+//
+// One producer (the main loop) and one consumer (the writer thread).
+// The producer only copies into the ring and moves head, the consumer only
+// writes out of the ring and moves tail, so neither takes a lock. The
+// writer wakes every CAPTURE_MS, or sooner when the ring is half full.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "stats.h"
+
+#ifndef CAPTURE_RING
+#define CAPTURE_RING (1<<20) // bytes, power of 2
+#endif
+
+#ifndef CAPTURE_MS
+#define CAPTURE_MS 100
+#endif
+
+bool capturing = false;
+
+static int fd = -1;
+static uint8_t* ring = NULL;
+static uint64_t head, tail; // bytes ever put in, and ever written out
+static unsigned long dropped;
+static pthread_t writer;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static bool started, stopping;
+
+static void put_le(uint8_t* b, uint64_t v, int n) {
+	for (int i=0;i<n;i++) { b[i] = v&0xFF; v >>= 8; }
+}
+
+static uint64_t get_le(const uint8_t* b, int n) {
+	uint64_t v = 0;
+	while (n--) v = v<<8 | b[n];
+	return v;
+}
+
+// write out everything up to the current head
+static int drain(void) {
+	uint64_t h = __atomic_load_n(&head,__ATOMIC_ACQUIRE), t = tail;
+	ssize_t n;
+	while (t<h) {
+		size_t o = t&(CAPTURE_RING-1), l = h-t;
+		if (o+l>CAPTURE_RING) l = CAPTURE_RING-o;
+		if ((n = write(fd,ring+o,l))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		t += n;
+		__atomic_store_n(&tail,t,__ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static void* writer_main(void* arg) {
+	struct timespec ts;
+	bool e = false;
+	(void)arg;
+	pthread_mutex_lock(&mtx);
+	while (!stopping) {
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_nsec += CAPTURE_MS*1000000L;
+		ts.tv_sec += ts.tv_nsec/1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&cv,&mtx,&ts);
+		pthread_mutex_unlock(&mtx);
+		if (!e && drain()) e = true;
+		// keep the ring moving after a write error, the records are lost
+		if (e) __atomic_store_n(&tail,__atomic_load_n(&head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+		pthread_mutex_lock(&mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+	if (!e) drain();
+	return NULL;
+}
+
+int capture_open(const char* path) {
+	uint8_t h[CAP_HDR_LEN];
+	if (capturing) return 0;
+	if ((fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644))<0) return -1;
+	if (!(ring = malloc(CAPTURE_RING))) { close(fd); fd = -1; return -1; }
+	memcpy(h,CAP_MAGIC,6);
+	put_le(h+6,CAP_VERSION,2);
+	if (write(fd,h,CAP_HDR_LEN)!=CAP_HDR_LEN) {
+		close(fd); fd = -1;
+		free(ring); ring = NULL;
+		return -1;
+	}
+	capturing = true;
+	atexit(capture_close);
+	return 0;
+}
+
+void capture_close(void) {
+	if (!capturing) return;
+	capturing = false;
+	if (started) {
+		pthread_mutex_lock(&mtx);
+		stopping = true;
+		pthread_cond_signal(&cv);
+		pthread_mutex_unlock(&mtx);
+		pthread_join(writer,NULL);
+	} else drain();
+	if (dropped) fprintf(stderr,"Capture: %lu records dropped\n",dropped);
+	close(fd);
+	fd = -1;
+	free(ring);
+	ring = NULL;
+}
+
+static void ring_copy(uint64_t at, const void* p, unsigned n) {
+	size_t o = at&(CAPTURE_RING-1), l = n;
+	if (!n) return;
+	if (o+l>CAPTURE_RING) l = CAPTURE_RING-o;
+	memcpy(ring+o,p,l);
+	memcpy(ring,(const uint8_t*)p+l,n-l);
+}
+
+// one record, an+bn <= CAP_REC_MAX
+static void put(unsigned type, unsigned sess, uint64_t ns, const uint8_t* a, unsigned an, const uint8_t* b, unsigned bn) {
+	uint64_t h = head, used = h-__atomic_load_n(&tail,__ATOMIC_ACQUIRE);
+	unsigned n = CAP_REC_HDR+an+bn;
+	uint8_t r[CAP_REC_HDR];
+
+	if (used+n>CAPTURE_RING) { dropped++; return; }
+	r[0] = type;
+	r[1] = sess;
+	put_le(r+2,an+bn,2);
+	put_le(r+4,ns,8);
+	ring_copy(h,r,CAP_REC_HDR);
+	ring_copy(h+CAP_REC_HDR,a,an);
+	ring_copy(h+CAP_REC_HDR+an,b,bn);
+	__atomic_store_n(&head,h+n,__ATOMIC_RELEASE);
+	// no lock, a missed wakeup only waits for the next CAPTURE_MS
+	if (used+n>CAPTURE_RING/2) pthread_cond_signal(&cv);
+}
+
+void capture_put(unsigned type, unsigned sess, const void* a, unsigned an, const void* b, unsigned bn) {
+	const uint8_t* pa = a;
+	const uint8_t* pb = b;
+	uint64_t ns;
+	unsigned l;
+	if (!capturing) return;
+	ns = stats_now();
+	// Started here rather than in capture_open() so that it's still there
+	// after daemon() in getty mode.
+	if (!started) {
+		if (pthread_create(&writer,NULL,writer_main,NULL)) { dropped++; return; }
+		started = true;
+	}
+	while (an+bn>CAP_REC_MAX) {
+		if (an) {
+			l = an>CAP_REC_MAX ? CAP_REC_MAX : an;
+			put(type,sess,ns,pa,l,NULL,0);
+			pa += l; an -= l;
+		} else {
+			l = CAP_REC_MAX;
+			put(type,sess,ns,pb,l,NULL,0);
+			pb += l; bn -= l;
+		}
+	}
+	put(type,sess,ns,pa,an,pb,bn);
+}
+
+void capture_note(unsigned sess, const char* fmt, ...) {
+	char b[256];
+	va_list args;
+	int n;
+	if (!capturing) return;
+	va_start(args,fmt);
+	n = vsnprintf(b,sizeof(b),fmt,args);
+	va_end(args);
+	if (n<0) return;
+	if (n>=(int)sizeof(b)) n = sizeof(b)-1;
+	capture_put(CAP_NOTE,sess,b,n,NULL,0);
+}
+
+FILE* capture_read_open(const char* path) {
+	uint8_t h[CAP_HDR_LEN];
+	FILE* f = fopen(path,"rb");
+	if (!f) return NULL;
+	if (fread(h,1,CAP_HDR_LEN,f)!=CAP_HDR_LEN || memcmp(h,CAP_MAGIC,6) || get_le(h+6,2)!=CAP_VERSION) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+int capture_read(FILE* f, CAP_REC* r) {
+	uint8_t h[CAP_REC_HDR];
+	size_t n = fread(h,1,CAP_REC_HDR,f);
+	if (!n) return 0;
+	if (n!=CAP_REC_HDR) return -1;
+	r->type = h[0];
+	r->sess = h[1];
+	r->len = get_le(h+2,2);
+	r->ns = get_le(h+4,8);
+	if (fread(r->data,1,r->len,f)!=r->len) return -1;
+	r->data[r->len] = 0x00;
+	return 1;
+}
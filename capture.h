@@ -0,0 +1,62 @@
+#ifndef PDD_CAPTURE_H
+#define PDD_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Binary capture of everything that crosses the client tty, CAPTURE=file.
+//
+// Records are copied into an in-memory ring by the main loop, and a
+// background thread writes the ring out to the file, so the main loop
+// never waits on the capture file. If the ring fills up, records are
+// dropped (and counted) rather than slow down the client.
+//
+// File:
+//  0  "DL2CAP"
+//  6  version, 2 bytes LSB first
+//  8  records...
+//
+// Record:
+//  0  type, CAP_RX CAP_TX or CAP_NOTE
+//  1  session
+//  2  data length, 2 bytes LSB first
+//  4  time, ns, CLOCK_MONOTONIC, 8 bytes LSB first
+// 12  data
+//
+// RX is what the client sent, TX is what it was sent, NOTE is a line of
+// text about the session, like "open /dev/ttyUSB0 19200" or "mode fdc".
+
+#define CAP_MAGIC   "DL2CAP"
+#define CAP_VERSION 1
+#define CAP_HDR_LEN 8
+#define CAP_REC_HDR 12
+#define CAP_REC_MAX 0xFFFF
+
+enum { CAP_RX, CAP_TX, CAP_NOTE };
+
+typedef struct {
+	uint8_t  type;
+	uint8_t  sess;
+	uint16_t len;
+	uint64_t ns;
+	uint8_t  data[CAP_REC_MAX+1]; // +1 so a NOTE can be terminated
+} CAP_REC;
+
+extern bool capturing;
+
+// Start capturing to path. The writer thread starts with the first record.
+int  capture_open (const char* path);
+// Write out whatever is still in the ring and close. Runs at exit too.
+void capture_close (void);
+
+// Add a record of a+b, which may be in two pieces like a ring buffer.
+void capture_put (unsigned type, unsigned sess, const void* a, unsigned an, const void* b, unsigned bn);
+void capture_note (unsigned sess, const char* fmt, ...);
+
+// Reading a capture file.
+FILE* capture_read_open (const char* path);
+// 1 = got a record, 0 = end of file, -1 = short or bad record
+int   capture_read (FILE* f, CAP_REC* r);
+
+#endif // PDD_CAPTURE_H
@@ -0,0 +1,355 @@
+// Disk image checks, "make check".
+//
+// Reads every file on the bundled disk images through disk_fs and checks
+// the sectors against what's known about each disk, then writes files on
+// overlays of them and reads them back. Nothing is written to the images.
+//
+// Then, on copies in a temp directory, makes the disk fail under the image
+// and journal code to see that nothing is lost. The msync() fsync() pwrite() and mmap()
+// here take the place of libc's, and fail on demand (Linux only).
+//
+// Usage: dl_check [dir]
+// dir is where the images are, default the current directory.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "constants.h"
+#include "disk_img.h"
+#include "disk_fs.h"
+#include "disk_jnl.h"
+
+#define REC_MAX (PDD2_TRACKS*PDD2_SECTORS)
+
+typedef struct {
+	const char* name;
+	uint8_t     rns[12]; // the sectors in order, 0 ends
+} KNOWN;
+
+typedef struct {
+	const char* path;
+	unsigned    records;
+	KNOWN       files[4];
+} DISK;
+
+static DISK disks[] = {
+	{ "TPDD1_26-3808_Utility_Disk.pdd1", PDD1_TRACKS*PDD1_SECTORS, {
+		{ "Floppy_SYS", {1,2,3,4,5,6,7,8,9} },
+		{ "SETRAM.BA", {10} },
+	} },
+	// byte 1 of the header is part of the ID here, and isn't 0xFF in
+	// records 3, 4 and 11, so a TPDD1 style chain would go astray
+	{ "TPDD2_26-3814_Utility_Disk.pdd2", PDD2_TRACKS*PDD2_SECTORS, {
+		{ "\x01" "FLOPY2.SYS", {2,3,4,5,6,7,8,9,10} },
+		{ "BACKUP.BA", {11,12} },
+		{ "FREMEM.BA", {13} },
+	} },
+	// real links, 1>2>3>4>FF and 6>7>8>FF
+	{ "clients/disk_power/Disk_Power.K85.pdd1", PDD1_TRACKS*PDD1_SECTORS, {
+		{ "INSTAL.CO", {1,2,3,4} },
+		{ "SP-DOS.SY", {6,7,8} },
+	} },
+};
+
+static const char* dir = ".";
+static unsigned fails;
+
+#define fail(...) do { printf("FAIL: " __VA_ARGS__); printf("\n"); fails++; } while (0)
+
+#if defined(__linux__)
+static bool fail_io;  // msync() fsync() pwrite() fail with EIO
+static bool fail_map; // mmap() fails, so images are read into the heap
+
+int msync(void* a, size_t n, int fl) {
+	if (fail_io) { errno = EIO; return -1; }
+	return syscall(SYS_msync,a,n,fl);
+}
+
+int fsync(int fd) {
+	if (fail_io) { errno = EIO; return -1; }
+	return syscall(SYS_fsync,fd);
+}
+
+ssize_t pwrite(int fd, const void* b, size_t n, off_t o) {
+	if (fail_io) { errno = EIO; return -1; }
+	return syscall(SYS_pwrite64,fd,b,n,o);
+}
+
+void* mmap(void* a, size_t n, int prot, int fl, int fd, off_t o) {
+	if (fail_map) { errno = ENODEV; return MAP_FAILED; }
+	return (void*)syscall(SYS_mmap,a,n,prot,fl,fd,o);
+}
+#endif
+
+static DISK_IMG* open_img(DISK* k) {
+	char p[PATH_MAX];
+	DISK_IMG* d;
+	snprintf(p,sizeof(p),"%s/%s",dir,k->path);
+	if (!(d = img_open(p,k->records,false,true))) fail("%s: can't open",p);
+	return d;
+}
+
+// every file: the sectors add up to the size, go from head to tail,
+// are in use, aren't shared, and read back as size bytes
+static void check_files(DISK* k, DISK_FS* f) {
+	uint8_t rns[REC_MAX], b[FS_FILE_MAX];
+	bool seen[REC_MAX] = {false};
+	unsigned i, j, c;
+
+	for (i=0;i<f->n;i++) {
+		FS_ENTRY* e = f->ent+i;
+		c = fs_sectors(f,i,rns);
+		if (c!=(e->size+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN) fail("%s: %s: %u sectors for %u bytes",k->path,e->name,c,e->size);
+		else if (c && (rns[0]!=e->head || rns[c-1]!=e->tail)) fail("%s: %s: %u..%u, not %u..%u",k->path,e->name,rns[0],rns[c-1],e->head,e->tail);
+		for (j=0;j<c;j++) {
+			if (!f->used[rns[j]]) fail("%s: %s: sector %u not in use",k->path,e->name,rns[j]);
+			if (seen[rns[j]]) fail("%s: %s: sector %u shared",k->path,e->name,rns[j]);
+			seen[rns[j]] = true;
+		}
+		if (fs_read(f,i,b,sizeof(b))!=e->size) fail("%s: %s: short read",k->path,e->name);
+	}
+
+	for (i=0;i<4 && k->files[i].name;i++) {
+		KNOWN* w = k->files+i;
+		int x = -1;
+		for (j=0;j<f->n;j++) if (!strcmp(f->ent[j].name,w->name)) x = j;
+		if (x<0) { fail("%s: %s: not found",k->path,w->name); continue; }
+		c = fs_sectors(f,x,rns);
+		for (j=0;j<c && w->rns[j]==rns[j];j++);
+		if (j!=c || (j<sizeof(w->rns) && w->rns[j])) fail("%s: %s: wrong sectors",k->path,w->name);
+	}
+}
+
+static void fill(uint8_t* b, unsigned n, unsigned seed) {
+	for (unsigned i=0;i<n;i++) b[i] = (i*7+seed)&0xFF;
+}
+
+// Write files that have to grow past each other, then check that they
+// read back, and on TPDD2 that no sector ID changed.
+static void check_write(DISK* k, DISK_FS* f) {
+	static uint8_t ids[REC_MAX][SECTOR_HEADER_LEN];
+	uint8_t a[3*SECTOR_DATA_LEN], b[SECTOR_DATA_LEN], r[FS_FILE_MAX];
+	unsigned rn;
+	uint8_t* p;
+	int i;
+
+	for (rn=0;rn<f->d->records;rn++) if ((p = img_rec(f->d,rn,false))) memcpy(ids[rn],p,SECTOR_HEADER_LEN);
+	fill(a,sizeof(a),1);
+	fill(b,sizeof(b),2);
+
+	if (fs_create(f,"CHECKA.DO",'F') || fs_create(f,"CHECKB.DO",'F')) { fail("%s: create",k->path); return; }
+	if (fs_write(f,fs_find(f,"CHECKA.DO",'F'),a,SECTOR_DATA_LEN)
+		|| fs_write(f,fs_find(f,"CHECKB.DO",'F'),b,sizeof(b))
+		|| fs_write(f,fs_find(f,"CHECKA.DO",'F'),a+SECTOR_DATA_LEN,sizeof(a)-SECTOR_DATA_LEN)) {
+		fail("%s: write",k->path);
+		return;
+	}
+	check_files(k,f);
+
+	i = fs_find(f,"CHECKA.DO",'F');
+	if (fs_read(f,i,r,sizeof(r))!=sizeof(a) || memcmp(r,a,sizeof(a))) fail("%s: CHECKA.DO reads back wrong",k->path);
+	i = fs_find(f,"CHECKB.DO",'F');
+	if (fs_read(f,i,r,sizeof(r))!=sizeof(b) || memcmp(r,b,sizeof(b))) fail("%s: CHECKB.DO reads back wrong",k->path);
+
+	if (f->dirs==2)
+		for (rn=0;rn<f->d->records;rn++)
+			if ((p = img_rec(f->d,rn,false)) && memcmp(ids[rn],p,SECTOR_HEADER_LEN)) fail("%s: sector %u ID changed",k->path,rn);
+
+	// and the same from a fresh mount
+	DISK_IMG* d = f->d;
+	f->d = NULL;
+	if (fs_mount(f,d)) fail("%s: remount",k->path);
+	else check_files(k,f);
+}
+
+#if defined(__linux__)
+static char work[] = "/tmp/dl_check.XXXXXX";
+
+static int copy_img(DISK* k, const char* to) {
+	char p[PATH_MAX];
+	uint8_t b[PDD2_IMG_LEN];
+	ssize_t n;
+	int fd;
+	snprintf(p,sizeof(p),"%s/%s",dir,k->path);
+	if ((fd = open(p,O_RDONLY))<0) return -1;
+	n = read(fd,b,sizeof(b));
+	close(fd);
+	if (n<=0 || (fd = open(to,O_WRONLY|O_CREAT|O_TRUNC,0644))<0) return -1;
+	if (write(fd,b,n)!=n) n = -1;
+	close(fd);
+	return n<0 ? -1 : 0;
+}
+
+// record rn in the file at path starts with c, over the data area
+static bool on_disk(const char* path, unsigned rn, uint8_t c) {
+	uint8_t b[SECTOR_LEN];
+	int fd = open(path,O_RDONLY);
+	bool r = fd>=0 && pread(fd,b,SECTOR_LEN,(off_t)rn*SECTOR_LEN)==SECTOR_LEN;
+	if (fd>=0) close(fd);
+	for (unsigned i=SECTOR_HEADER_LEN;r && i<SECTOR_LEN;i++) r = b[i]==c;
+	return r;
+}
+
+// img_sync() on a failing disk keeps the records dirty, and gets them
+// out on the next try once the disk works again
+static void check_sync(DISK* k, const char* how, bool heap, bool packed) {
+	char p[PATH_MAX];
+	DISK_IMG* d = NULL;
+	unsigned rn;
+	uint8_t* r;
+
+	snprintf(p,sizeof(p),"%s/sync%s",work,packed?IMG_PACK_SUFFIX:"");
+	unlink(p);
+	if (packed) {
+		DISK_IMG* o = open_img(k);
+		if (!o || img_save(o,p,true)) fail("%s: can't make %s",how,p);
+		img_close(o);
+	} else if (copy_img(k,p)) fail("%s: can't copy to %s",how,p);
+	fail_map = heap;
+	d = img_open(p,k->records,false,false);
+	fail_map = false;
+	if (!d) { fail("%s: can't open %s",how,p); return; }
+	if ((!packed && d->mapped==heap) || d->packed!=packed) fail("%s: opened the wrong way",how);
+
+	for (rn=20;rn<23;rn++) {
+		if (!(r = img_rec(d,rn,true))) { fail("%s: record %u",how,rn); break; }
+		memset(r+SECTOR_HEADER_LEN,0xA5,SECTOR_DATA_LEN);
+		img_wrote(d,rn,SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
+	}
+
+	fail_io = true;
+	if (!img_sync(d)) fail("%s: img_sync() didn't fail",how);
+	fail_io = false;
+	if (d->ndirty!=3) fail("%s: %u dirty after a failed img_sync(), not 3",how,d->ndirty);
+	for (rn=20;rn<23;rn++) if (!d->dirty[rn]) fail("%s: record %u clean after a failed img_sync()",how,rn);
+
+	if (img_sync(d)) fail("%s: img_sync() failed",how);
+	if (d->ndirty) fail("%s: %u dirty after img_sync()",how,d->ndirty);
+	img_close(d);
+
+	if (packed) {
+		// read it back through the image code, it's not raw on disk
+		if (!(d = img_open(p,k->records,false,true))) fail("%s: can't reopen",how);
+		for (rn=20;d && rn<23;rn++)
+			if (!(r = img_rec(d,rn,false)) || r[SECTOR_HEADER_LEN]!=0xA5 || r[SECTOR_LEN-1]!=0xA5) fail("%s: record %u lost",how,rn);
+		img_close(d);
+	} else for (rn=20;rn<23;rn++) if (!on_disk(p,rn,0xA5)) fail("%s: record %u lost",how,rn);
+	unlink(p);
+}
+
+static off_t file_len(const char* path) {
+	struct stat st;
+	return stat(path,&st) ? -1 : st.st_size;
+}
+
+// A commit is journaled, the checkpoint fails, and then either the next
+// checkpoint works, or dl dies and the journal is replayed on the next
+// open. Either way the commit ends up in the image file. The image is a
+// heap copy, so it's only changed on the disk by img_sync().
+static void check_journal(DISK* k, bool crash) {
+	const char* how = crash ? "journal crash" : "journal retry";
+	char p[PATH_MAX], jp[PATH_MAX+4];
+	DISK_IMG* d;
+	DISK_JNL j;
+	uint8_t* r;
+	int c;
+
+	snprintf(p,sizeof(p),"%s/jnl.pdd2",work);
+	snprintf(jp,sizeof(jp),"%s.jnl",p);
+	unlink(jp);
+	if (copy_img(k,p)) { fail("%s: can't copy to %s",how,p); return; }
+	fail_map = true;
+	d = img_open(p,k->records,false,false);
+	fail_map = false;
+	if (!d) { fail("%s: can't open %s",how,p); return; }
+	if (jnl_open(&j,d)) { fail("%s: jnl_open",how); img_close(d); return; }
+
+	if (!(r = img_rec(d,30,true))) { fail("%s: record 30",how); return; }
+	memset(r+SECTOR_HEADER_LEN,0x5A,SECTOR_DATA_LEN);
+	img_wrote(d,30,0,SECTOR_LEN);
+	if (jnl_append(&j,30) || jnl_flush(&j)) fail("%s: journal write",how);
+
+	fail_io = true;
+	if (!jnl_checkpoint(&j)) fail("%s: checkpoint didn't fail",how);
+	fail_io = false;
+	if (file_len(jp)!=JNL_ENTRY_LEN) fail("%s: journal is %ld bytes after a failed checkpoint",how,(long)file_len(jp));
+	if (on_disk(p,30,0x5A)) fail("%s: image written in spite of the failure",how);
+
+	if (!crash) {
+		if (jnl_checkpoint(&j)) fail("%s: checkpoint failed",how);
+		if (!on_disk(p,30,0x5A)) fail("%s: commit lost",how);
+		if (file_len(jp)) fail("%s: journal not emptied",how);
+		jnl_close(&j);
+		img_close(d);
+		unlink(p);
+		return;
+	}
+
+	// dies here, nothing else is written
+	close(j.fd);
+	close(d->fd);
+	d->fd = -1;
+	d->ndirty = 0;
+	img_close(d);
+	free(j.path); free(j.rec); free(j.has);
+
+	if (!(d = img_open(p,k->records,false,false))) { fail("%s: can't reopen",how); return; }
+	if ((c = jnl_open(&j,d))!=1) fail("%s: %d records replayed, not 1",how,c);
+	if (!on_disk(p,30,0x5A)) fail("%s: commit lost",how);
+	if (file_len(jp)) fail("%s: journal not emptied",how);
+	if (c>=0) jnl_close(&j);
+	img_close(d);
+	unlink(jp);
+	unlink(p);
+}
+
+static void check_faults(void) {
+	DISK* k = disks+1;
+	if (!mkdtemp(work)) { fail("mkdtemp"); return; }
+	check_sync(k,"sync mapped",false,false);
+	check_sync(k,"sync heap",true,false);
+	check_sync(k,"sync packed",false,true);
+	check_journal(k,false);
+	check_journal(k,true);
+	rmdir(work);
+}
+#endif
+
+int main(int argc, char** argv) {
+	static DISK_FS f;
+	unsigned i;
+
+	if (argc>1) dir = argv[1];
+
+	for (i=0;i<sizeof(disks)/sizeof(disks[0]);i++) {
+		DISK* k = disks+i;
+		DISK_IMG* d = open_img(k);
+		if (!d) continue;
+		memset(&f,0x00,sizeof(f));
+		if (fs_mount(&f,d)) fail("%s: not formatted",k->path);
+		else {
+			check_files(k,&f);
+			check_write(k,&f);
+		}
+		img_close(d);
+	}
+
+#if defined(__linux__)
+	check_faults();
+#endif
+
+	printf("%s\n",fails ? "FAILED" : "ok");
+	return !!fails;
+}
@@ -230,6 +230,7 @@ static const uint16_t FDC_LOGICAL_SECTOR_SIZE[7] = {64,80,128,256,512,1024,1280}
 // flags
 #define FE_FLAGS_NONE          0
 #define FE_FLAGS_DIR           1
+#define FE_FLAGS_IMG           2 // in the disk image, not the share
 #define NO_RET                 0
 #define ALLOW_RET              1
 #define CACHE_LOAD             0
@@ -18,96 +18,447 @@ Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
 MA 02111, USA.
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE // statx()
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <strings.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 
 #include "dir_list.h"
 
-static uint16_t allocated;
-static uint16_t ndx;
-static uint16_t cur;
-static FILE_ENTRY* tblp = 0;
+void dbg(const int v, const char* format, ...); // main.c
+
+static FILE_LIST* lists = NULL;
+static FILE_DATA* datas = NULL;
+
+#if defined(__linux__)
+#define WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF)
+static int ino_fd = -2; // -2 = not tried yet
+#endif
 
-static FILE_ENTRY* current_record(void);
+static FILE_ENTRY* current_record(FILE_CURSOR* fc);
 
 int file_list_init() {
-	tblp = malloc(sizeof(FILE_ENTRY)*DIRENTS);
-	if (!tblp) return -1;
-	allocated = DIRENTS;
-	ndx = 0;
-	cur = 0;
+	lists = NULL;
+	datas = NULL;
 	return 0;
 }
 
 int file_list_cleanup() {
-	allocated = 0;
-	ndx = 0;
-	cur = 0;
-	if (tblp) free(tblp);
-	tblp = NULL;
+	FILE_LIST* fl;
+	FILE_DATA* d;
+	while ((fl = lists)) {
+		lists = fl->next;
+		free(fl->hash);
+		free(fl->tbl);
+		free(fl->path);
+		free(fl);
+	}
+	while ((d = datas)) {
+		datas = d->next;
+		free(d->buf);
+		free(d);
+	}
 	return 0;
 }
 
-void file_list_clear_all() {
-	cur = ndx = 0;
+// Find the list for path+flags, or make a new empty one.
+FILE_LIST* file_list_get(const char* path, uint8_t flags) {
+	FILE_LIST* fl;
+	for (fl=lists;fl;fl=fl->next) if (fl->flags==flags && !strcmp(fl->path,path)) break;
+	if (!fl) {
+		if (!(fl = calloc(1,sizeof(FILE_LIST)))) return NULL;
+		fl->tbl = malloc(sizeof(FILE_ENTRY)*DIRENTS);
+		fl->path = strdup(path);
+		if (!fl->tbl || !fl->path) { free(fl->tbl); free(fl->path); free(fl); return NULL; }
+		fl->allocated = DIRENTS;
+		fl->flags = flags;
+		fl->wd = -1;
+		fl->next = lists;
+		lists = fl;
+	}
+	fl->refs++;
+	return fl;
+}
+
+// Drop a reference, and free the list when nobody is using it.
+void file_list_put(FILE_LIST* fl) {
+	FILE_LIST** pp;
+	if (!fl || --fl->refs) return;
+	for (pp=&lists;*pp;pp=&(*pp)->next) if (*pp==fl) { *pp = fl->next; break; }
+#if defined(__linux__)
+	// other lists of the same directory share the watch
+	if (fl->wd>=0) {
+		FILE_LIST* l;
+		for (l=lists;l;l=l->next) if (l->wd==fl->wd) break;
+		if (!l) inotify_rm_watch(ino_fd,fl->wd);
+	}
+#endif
+	free(fl->hash);
+	free(fl->tbl);
+	free(fl->path);
+	free(fl);
+}
+
+#if defined(__linux__)
+// Read whatever inotify has queued and mark the affected lists stale.
+// Done on demand rather than from the event loop, so a listing is never
+// trusted while a change to it is still sitting in the queue.
+static void file_list_poll() {
+	char b[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* e;
+	FILE_LIST* fl;
+	ssize_t n;
+	while ((n = read(ino_fd,b,sizeof(b)))>0) {
+		for (char* p=b;p<b+n;p+=sizeof(struct inotify_event)+e->len) {
+			e = (const struct inotify_event*)p;
+			for (fl=lists;fl;fl=fl->next) {
+				if (e->mask&IN_Q_OVERFLOW) fl->valid = false;
+				else if (fl->wd==e->wd) {
+					fl->valid = false;
+					if (e->mask&IN_IGNORED) fl->wd = -1;
+				}
+			}
+		}
+	}
+}
+#endif
+
+// Is the list still a true picture of the directory (open as dirfd)?
+// If not, the caller has to rescan it. Either way it counts as valid from
+// here on, and any change that lands during the rescan is caught next time.
+//
+// With inotify, any change in the directory invalidates the list.
+// Without, it's the directory mtime, which doesn't see a file changing
+// size in place, and only has 1 second resolution, so a list scanned
+// in the same second the directory was changed is never trusted.
+bool file_list_fresh(FILE_LIST* fl, int dirfd) {
+	struct stat st;
+#if defined(__linux__)
+	if (ino_fd==-2) ino_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (ino_fd>=0) {
+		file_list_poll();
+		if (fl->valid && fl->wd>=0) return true;
+		fl->wd = inotify_add_watch(ino_fd,fl->path,WATCH_MASK);
+		if (fl->wd>=0) { fl->valid = true; return false; }
+	}
+#endif
+	if (fstat(dirfd,&st)) { fl->valid = false; return false; }
+	if (fl->valid && st.st_mtime==fl->mtime) return true;
+	fl->mtime = st.st_mtime;
+	fl->valid = st.st_mtime<time(NULL);
+	return false;
+}
+
+// We changed something in path ourselves. Don't wait for inotify.
+// NULL means everything.
+void file_list_invalidate(const char* path) {
+	for (FILE_LIST* fl=lists;fl;fl=fl->next)
+		if (!path || !strcmp(fl->path,path)) fl->valid = false;
 }
 
-int add_file(FILE_ENTRY* fe) {
+void file_list_clear_all(FILE_CURSOR* fc) {
+	fc->cur = fc->fl->ndx = 0;
+	if (fc->fl->hash) memset(fc->fl->hash,0,fc->fl->hash_len*sizeof(unsigned));
+}
+
+/*
+ * The hash index is open addressing with linear probing. Each slot holds
+ * a tbl[] index +1, 0 = empty. It's kept at most half full, and rebuilt
+ * at twice the size when it gets past that.
+ */
+static unsigned hash_name(const char* client_fname, uint8_t attr) {
+	uint32_t h = 2166136261u; // FNV-1a
+	while (*client_fname) { h ^= (uint8_t)*client_fname++; h *= 16777619u; }
+	h ^= attr; h *= 16777619u;
+	return h;
+}
+
+// slot for client_fname+attr, either the one holding it or the empty one
+// where it would go
+static unsigned* hash_slot(FILE_LIST* fl, const char* client_fname, uint8_t attr) {
+	unsigned m = fl->hash_len-1;
+	unsigned i = hash_name(client_fname,attr) & m;
+	for (;fl->hash[i];i=(i+1)&m) {
+		FILE_ENTRY* e = fl->tbl+fl->hash[i]-1;
+		if (e->attr==attr && !strcmp(e->client_fname,client_fname)) break;
+	}
+	return fl->hash+i;
+}
+
+static int hash_grow(FILE_LIST* fl) {
+	unsigned n = fl->hash_len ? fl->hash_len*2 : 128; // must be a power of 2
+	unsigned* h = calloc(n,sizeof(unsigned));
+	if (!h) return -1;
+	free(fl->hash);
+	fl->hash = h;
+	fl->hash_len = n;
+	for (unsigned i=0;i<fl->ndx;i++) {
+		unsigned* p = hash_slot(fl,fl->tbl[i].client_fname,fl->tbl[i].attr);
+		if (!*p) *p = i+1;
+	}
+	return 0;
+}
+
+int add_file(FILE_CURSOR* fc, FILE_ENTRY* fe) {
+	FILE_LIST* fl = fc->fl;
+	unsigned* p;
 	/* allocate DIRENTS more records if out of space */
-	if (ndx >= allocated) {
+	if (fl->ndx >= fl->allocated) {
 		/* resize the array */
-		tblp = realloc(tblp, (allocated+DIRENTS)*sizeof(FILE_ENTRY));
-		if (!tblp) return -1;
-		allocated += DIRENTS;
+		FILE_ENTRY* t = realloc(fl->tbl, (fl->allocated+DIRENTS)*sizeof(FILE_ENTRY));
+		if (!t) return -1;
+		fl->tbl = t;
+		fl->allocated += DIRENTS;
 	}
+	if ((fl->ndx+1)*2>fl->hash_len && hash_grow(fl)) return -1;
 
-	/* reference the entry */
-	if (!tblp) return -1;
-
-	memcpy(tblp+ndx, fe, sizeof(FILE_ENTRY));
+	memcpy(fl->tbl+fl->ndx, fe, sizeof(FILE_ENTRY));
 	/* adjust cur to address this record, ndx to next avail */
-	cur = ndx;
-	ndx++;
+	fc->cur = fl->ndx;
+	fl->ndx++;
+
+	// Two local names that translate to the same client name both stay in
+	// the list, but only the first one can be found by name.
+	p = hash_slot(fl,fe->client_fname,fe->attr);
+	if (*p) return 1;
+	*p = fl->ndx;
 
 	return 0;
 }
 
-FILE_ENTRY* find_file(char* client_fname, uint8_t attr) {
-	int i;
-	for (i=0;i<ndx;i++) {
-		if (
-				!strcmp(client_fname,tblp[i].client_fname)
-				&&
-				tblp[i].attr==attr
-			) return &tblp[i];
+FILE_ENTRY* find_file(FILE_LIST* fl, char* client_fname, uint8_t attr) {
+	unsigned* p;
+	if (!fl->hash) return 0;
+	p = hash_slot(fl,client_fname,attr);
+	return *p ? fl->tbl+*p-1 : 0;
+}
+
+FILE_ENTRY* get_first_file(FILE_CURSOR* fc) {
+	fc->cur = 0;
+	return current_record(fc);
+}
+
+FILE_ENTRY* get_next_file(FILE_CURSOR* fc) {
+	if (fc->cur + 1 > fc->fl->ndx) return NULL;
+	fc->cur++;
+	return current_record(fc);
+}
+   
+FILE_ENTRY* get_prev_file(FILE_CURSOR* fc) {
+	if (fc->cur==0) return NULL;
+	fc->cur--;
+	return current_record(fc);
+}
+
+static FILE_ENTRY* current_record(FILE_CURSOR* fc) {
+	if (!fc->fl) return NULL;
+	if (fc->cur >= fc->fl->ndx) return NULL;
+	return fc->fl->tbl + fc->cur;
+}
+
+/*
+ * Directory scanning
+ *
+ * Entry type comes from d_type when the filesystem fills it in, so
+ * most entries that aren't going to be listed never get stat'ed.
+ * Linux reads the entries with getdents64() in one big buffer instead
+ * of readdir()'s 32K, and gets the size with statx(), asking for only
+ * the fields we use and telling network filesystems not to go to the
+ * server for them if they're already cached.
+ */
+#if defined(__linux__)
+struct DIR_SCAN {
+	int   fd;
+	int   len;
+	int   pos;
+	char* buf;
+};
+
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+#else
+struct DIR_SCAN {
+	DIR* dir;
+};
+#endif
+
+static uint8_t ds_type(unsigned char d_type) {
+#if defined(DT_UNKNOWN)
+	switch (d_type) {
+		case DT_REG:     return DS_TYPE_FILE;
+		case DT_DIR:     return DS_TYPE_DIR;
+		case DT_LNK:     // need to stat to see what it points to
+		case DT_UNKNOWN: return DS_TYPE_UNKNOWN;
+		default:         return DS_TYPE_OTHER;
+	}
+#else
+	(void)d_type;
+	return DS_TYPE_UNKNOWN;
+#endif
+}
+
+DIR_SCAN* dir_scan_open(int dirfd) {
+	DIR_SCAN* ds = calloc(1,sizeof(DIR_SCAN));
+	int fd = openat(dirfd,".",O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (!ds || fd<0) goto fail;
+#if defined(__linux__)
+	if (!(ds->buf = malloc(DIR_SCAN_BUF))) goto fail;
+	ds->fd = fd;
+#else
+	if (!(ds->dir = fdopendir(fd))) goto fail;
+#endif
+	return ds;
+fail:
+	if (fd>=0) close(fd);
+	free(ds);
+	return NULL;
+}
+
+// Name of the next entry, NULL at the end. type gets one of DS_TYPE_*.
+const char* dir_scan_next(DIR_SCAN* ds, uint8_t* type) {
+#if defined(__linux__)
+	struct linux_dirent64* e;
+	if (ds->pos>=ds->len) {
+		ds->pos = 0;
+		ds->len = syscall(SYS_getdents64,ds->fd,ds->buf,DIR_SCAN_BUF);
+		if (ds->len<0) dbg(0,"getdents64: %s, listing is incomplete\n",strerror(errno));
+		if (ds->len<=0) { ds->len = 0; return NULL; }
 	}
+	e = (struct linux_dirent64*)(ds->buf+ds->pos);
+	ds->pos += e->d_reclen;
+	*type = ds_type(e->d_type);
+	return e->d_name;
+#else
+	struct dirent* e;
+	errno = 0;
+	if (!(e = readdir(ds->dir))) {
+		if (errno) dbg(0,"readdir: %s, listing is incomplete\n",strerror(errno));
+		return NULL;
+	}
+#if defined(DT_UNKNOWN)
+	*type = ds_type(e->d_type);
+#else
+	*type = DS_TYPE_UNKNOWN;
+#endif
+	return e->d_name;
+#endif
+}
+
+void dir_scan_close(DIR_SCAN* ds) {
+	if (!ds) return;
+#if defined(__linux__)
+	close(ds->fd);
+	free(ds->buf);
+#else
+	closedir(ds->dir);
+#endif
+	free(ds);
+}
+
+// type and size of name in dirfd, following symlinks
+int dir_scan_stat(int dirfd, const char* name, uint8_t* type, off_t* size) {
+#if defined(__linux__) && defined(STATX_SIZE)
+	struct statx stx;
+	if (statx(dirfd,name,AT_STATX_DONT_SYNC,STATX_TYPE|STATX_SIZE,&stx)) return -1;
+	*size = stx.stx_size;
+	*type = S_ISREG(stx.stx_mode) ? DS_TYPE_FILE : S_ISDIR(stx.stx_mode) ? DS_TYPE_DIR : DS_TYPE_OTHER;
+#else
+	struct stat st;
+	if (fstatat(dirfd,name,&st,0)) return -1;
+	*size = st.st_size;
+	*type = S_ISREG(st.st_mode) ? DS_TYPE_FILE : S_ISDIR(st.st_mode) ? DS_TYPE_DIR : DS_TYPE_OTHER;
+#endif
 	return 0;
 }
 
-FILE_ENTRY* get_first_file(void) {
-	cur = 0;
-	return current_record();
+#if defined(__APPLE__)
+#define ST_MTIM(st) (st).st_mtimespec
+#define ST_CTIM(st) (st).st_ctimespec
+#else
+#define ST_MTIM(st) (st).st_mtim
+#define ST_CTIM(st) (st).st_ctim
+#endif
+
+static bool ts_eq(struct timespec a, struct timespec b) {
+	return a.tv_sec==b.tv_sec && a.tv_nsec==b.tv_nsec;
 }
 
-FILE_ENTRY* get_next_file(void) {
-	if (cur + 1 > ndx) return NULL;
-	cur++;
-	return current_record();
+// d still matches the file st is from
+static bool file_data_same(FILE_DATA* d, struct stat* st) {
+	return d->size==st->st_size && ts_eq(d->mtime,ST_MTIM(*st)) && ts_eq(d->ctime,ST_CTIM(*st));
 }
-   
-FILE_ENTRY* get_prev_file(void) {
-	if (cur==0) return NULL;
-	cur--;
-	return current_record();
-}
-
-static FILE_ENTRY* current_record(void) {
-	FILE_ENTRY* ep;
-	if (cur >= ndx) return NULL;
-	if (!tblp) return NULL;
-	ep = tblp + cur;
-	return ep;
+
+// Contents of the open file fd, from the cache if it's already there and
+// still matches the file, else read in and added.
+// Returns NULL if the file is too big to cache or can't be read, and the
+// caller should just read from fd.
+FILE_DATA* file_data_get(int fd) {
+	struct stat st;
+	FILE_DATA *d, **pp;
+	unsigned n = 0;
+
+	if (fstat(fd,&st) || st.st_size>FILE_DATA_MAX) return NULL;
+
+	for (d=datas;d;d=d->next) {
+		if (d->stale || d->dev!=st.st_dev || d->ino!=st.st_ino) continue;
+		if (file_data_same(d,&st)) { d->refs++; return d; }
+		d->stale = true; // changed since it was cached
+	}
+
+	// make room, dropping unused entries past FILE_DATA_KEEP
+	for (pp=&datas;(d=*pp);) {
+		if (!d->refs && (d->stale || ++n>FILE_DATA_KEEP)) {
+			*pp = d->next;
+			free(d->buf);
+			free(d);
+		} else pp = &d->next;
+	}
+
+	if (!(d = calloc(1,sizeof(FILE_DATA)))) return NULL;
+	if (!(d->buf = malloc(st.st_size?st.st_size:1))) { free(d); return NULL; }
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->mtime = ST_MTIM(st);
+	d->ctime = ST_CTIM(st);
+	d->size = st.st_size;
+	for (off_t t=0,r;t<st.st_size;t+=r) {
+		r = pread(fd,d->buf+t,st.st_size-t,t);
+		if (r<=0) { free(d->buf); free(d); return NULL; }
+	}
+	// changed while it was being read
+	if (fstat(fd,&st) || !file_data_same(d,&st)) { free(d->buf); free(d); return NULL; }
+	d->refs = 1;
+	d->next = datas;
+	datas = d;
+	return d;
+}
+
+void file_data_put(FILE_DATA* d) {
+	if (d && d->refs) d->refs--;
+}
+
+// A file was written, renamed, or deleted. Anyone already reading it keeps
+// their copy, but nobody new gets it.
+void file_data_forget(const struct stat* st) {
+	for (FILE_DATA* d=datas;d;d=d->next)
+		if (d->dev==st->st_dev && d->ino==st->st_ino) d->stale = true;
 }
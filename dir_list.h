@@ -22,6 +22,10 @@ MA 02111, USA.
 #define DIR_LIST
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "constants.h"
 
 typedef struct {
@@ -32,15 +36,95 @@ typedef struct {
 	uint8_t  flags;
 } FILE_ENTRY;
 
+// FILE_LIST.flags - anything besides the directory itself that changes
+// what ends up in the list
+#define FL_FLAGS_NONE    0
+#define FL_FLAGS_PARENT  1 // includes ".."
+#define FL_FLAGS_DIRS    2 // includes sub-directories
+
+// One directory listing, shared by every session looking at the same
+// directory the same way. It's kept between requests and only rescanned
+// after something in the directory changes, see file_list_fresh().
+typedef struct FILE_LIST {
+	char*       path;
+	uint8_t     flags;
+	FILE_ENTRY* tbl;
+	unsigned    allocated;
+	unsigned    ndx;
+	unsigned*   hash;   // index of tbl[] by client_fname+attr, see find_file()
+	unsigned    hash_len;
+	unsigned    refs;
+	bool        valid;  // tbl[] matches the directory
+	int         wd;     // inotify watch, or -1
+	time_t      mtime;  // else directory mtime when scanned
+	struct FILE_LIST* next;
+} FILE_LIST;
+
+// A session's position in a FILE_LIST
+typedef struct {
+	FILE_LIST* fl;
+	unsigned   cur;
+} FILE_CURSOR;
+
 int file_list_init ();
 int file_list_cleanup ();
 
-void file_list_clear_all ();
-int  add_file (FILE_ENTRY* fe);
+FILE_LIST* file_list_get (const char* path, uint8_t flags);
+void file_list_put (FILE_LIST* fl);
+bool file_list_fresh (FILE_LIST* fl, int dirfd);
+void file_list_invalidate (const char* path);
+
+void file_list_clear_all (FILE_CURSOR* fc);
+int  add_file (FILE_CURSOR* fc, FILE_ENTRY* fe);  // 1 = client name already taken
+
+FILE_ENTRY* find_file (FILE_LIST* fl, char* client_fname, uint8_t attr);
+FILE_ENTRY* get_first_file (FILE_CURSOR* fc);
+FILE_ENTRY* get_next_file (FILE_CURSOR* fc);
+FILE_ENTRY* get_prev_file (FILE_CURSOR* fc);
+
+// Reading a directory's entries for a listing, with as few syscalls per
+// entry as the platform allows.
+#ifndef DIR_SCAN_BUF
+#define DIR_SCAN_BUF 131072 // getdents64 buffer, linux
+#endif
+
+#define DS_TYPE_UNKNOWN 0
+#define DS_TYPE_FILE    1
+#define DS_TYPE_DIR     2
+#define DS_TYPE_OTHER   3
+
+typedef struct DIR_SCAN DIR_SCAN;
+
+DIR_SCAN*   dir_scan_open (int dirfd);
+const char* dir_scan_next (DIR_SCAN* ds, uint8_t* type);
+void        dir_scan_close (DIR_SCAN* ds);
+int         dir_scan_stat (int dirfd, const char* name, uint8_t* type, off_t* size);
+
+// Contents of files opened for reading, shared by every session reading
+// the same file. Files larger than FILE_DATA_MAX are not cached.
+#ifndef FILE_DATA_MAX
+#define FILE_DATA_MAX 65536
+#endif
+#ifndef FILE_DATA_KEEP
+#define FILE_DATA_KEEP 16 // unreferenced files to keep around
+#endif
+
+// A cached copy is only used while the file's mtime, ctime (both to the
+// nanosecond) and size are all unchanged.
+typedef struct FILE_DATA {
+	dev_t    dev;
+	ino_t    ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t    size;
+	uint8_t* buf;
+	unsigned refs;
+	bool     stale;
+	struct FILE_DATA* next;
+} FILE_DATA;
 
-FILE_ENTRY* find_file (char* client_fname, uint8_t attr);
-FILE_ENTRY* get_first_file (void);
-FILE_ENTRY* get_next_file (void);
-FILE_ENTRY* get_prev_file (void);
+FILE_DATA* file_data_get (int fd);
+void file_data_put (FILE_DATA* fd);
+void file_data_forget (const struct stat* st);
 
 #endif
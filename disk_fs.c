@@ -0,0 +1,315 @@
+// Disk image filesystem.
+//
+// The layout, as far as it's known from real disks:
+//
+// Record 0 holds the directory, 40 entries of 31 bytes, sorted by name,
+// with no empty entries in between. TPDD2 has the same thing again in
+// record 1.
+//   0-23  name, space padded
+//   24    attribute
+//   25-26 size, MSB first
+//   27-28 ?
+//   29    first sector
+//   30    last sector
+//
+// At SMT_OFFSET is the Space Management Table, a bitmap of the sectors in
+// use, MSB first. TPDD2 has a bit per sector, and TPDD1 uses every other
+// bit, so 0x80 is sector 0 on both. After 20 bytes of bits comes a count
+// of the sectors in use, not counting the directory.
+//
+// On TPDD1 a file's sectors are chained by the second header byte, the
+// first ID byte. It holds the next sector, or 0xFF in the last one. Disks
+// made on a duplicator have 0xFF in every sector and contiguous files, so
+// wherever the link doesn't make sense, the next sector is the one after.
+// A chain is only believed if it gets from head to tail in as many
+// sectors as the size needs, else the file is taken as contiguous.
+//
+// On TPDD2 the second header byte is part of the 12 byte sector ID, not a
+// link, and files are contiguous from head to tail.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "disk_fs.h"
+
+#define REC_MAX (PDD2_TRACKS*PDD2_SECTORS)
+
+static void pad_name(uint8_t* p, const char* name) {
+	size_t l = strlen(name);
+	if (l>TPDD_FILENAME_LEN) l = TPDD_FILENAME_LEN;
+	memset(p,' ',TPDD_FILENAME_LEN);
+	memcpy(p,name,l);
+}
+
+static int name_cmp(const char* a, const char* b) {
+	uint8_t x[TPDD_FILENAME_LEN], y[TPDD_FILENAME_LEN];
+	pad_name(x,a);
+	pad_name(y,b);
+	return memcmp(x,y,TPDD_FILENAME_LEN);
+}
+
+// SMT bit for sector rn
+static unsigned smt_bit(DISK_FS* f, unsigned rn) {
+	return rn*(REC_MAX/f->d->records);
+}
+
+static void get_dir(DISK_FS* f, const uint8_t* r) {
+	const uint8_t* p = r+SECTOR_HEADER_LEN;
+	const uint8_t* smt = p+SMT_OFFSET;
+	unsigned i, b;
+	int j;
+
+	f->n = 0;
+	for (i=0;i<FS_DIRENTS;i++,p+=FS_DIRENT_LEN) {
+		if (!p[0]) continue;
+		FS_ENTRY* e = f->ent+f->n++;
+		memcpy(e->name,p,TPDD_FILENAME_LEN);
+		e->name[TPDD_FILENAME_LEN] = 0x00;
+		for (j=TPDD_FILENAME_LEN-1;j>=0 && (e->name[j]==' ' || !e->name[j]);j--) e->name[j] = 0x00;
+		e->attr = p[24];
+		e->size = p[25]<<8 | p[26];
+		e->x[0] = p[27];
+		e->x[1] = p[28];
+		e->head = p[29];
+		e->tail = p[30];
+	}
+
+	for (i=0;i<f->d->records;i++) {
+		b = smt_bit(f,i);
+		f->used[i] = i<f->dirs || (smt[b/8] & (0x80>>(b%8)));
+	}
+}
+
+// Write the directory and SMT back into the image.
+static void put_dir(DISK_FS* f) {
+	unsigned rn, i, b, c;
+	for (rn=0;rn<f->dirs;rn++) {
+		uint8_t* r = img_rec(f->d,rn,true);
+		if (!r) continue;
+		uint8_t* p = r+SECTOR_HEADER_LEN;
+		uint8_t* smt = p+SMT_OFFSET;
+
+		memset(p,0x00,FS_DIRENTS*FS_DIRENT_LEN);
+		for (i=0;i<f->n;i++,p+=FS_DIRENT_LEN) {
+			FS_ENTRY* e = f->ent+i;
+			pad_name(p,e->name);
+			p[24] = e->attr;
+			p[25] = e->size>>8;
+			p[26] = e->size&0xFF;
+			p[27] = e->x[0];
+			p[28] = e->x[1];
+			p[29] = e->head;
+			p[30] = e->tail;
+		}
+
+		memset(smt,0x00,FS_USED_OFFSET-SMT_OFFSET);
+		for (i=c=0;i<f->d->records;i++) {
+			if (!f->used[i]) continue;
+			b = smt_bit(f,i);
+			smt[b/8] |= 0x80>>(b%8);
+			if (i>=f->dirs) c++;
+		}
+		smt[FS_USED_OFFSET-SMT_OFFSET] = c;
+
+		img_wrote(f->d,rn,SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
+	}
+	f->gen = f->d->gen;
+	f->ver++;
+}
+
+// The sectors of file e, in order. Returns how many.
+static unsigned chain(DISK_FS* f, FS_ENTRY* e, uint8_t* rns) {
+	unsigned c = (e->size+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN;
+	unsigned rn, k, l;
+	uint8_t* r;
+
+	if (f->dirs==1) {
+		bool seen[REC_MAX] = {false};
+		for (k=0,rn=e->head;k<c;k++) {
+			if (rn<f->dirs || rn>=f->d->records || seen[rn]) break;
+			if (!(r = img_rec(f->d,rn,false))) break;
+			rns[k] = rn;
+			seen[rn] = true;
+			l = r[1];
+			rn = (l>=f->dirs && l<f->d->records && !seen[l] && f->used[l]) ? l : rn+1;
+		}
+		if (k==c && (!c || rns[c-1]==e->tail)) return c;
+	}
+
+	for (k=0;k<c && e->head+k<f->d->records;k++) rns[k] = e->head+k;
+	return k;
+}
+
+// Another sector on the end of file e, which has c full sectors so far.
+// Returns the sector, now the tail, or -1 if there's no room.
+// TPDD1 takes the first free sector and links it on. TPDD2 has no links,
+// so the file has to stay contiguous, and moves to the first free run
+// that fits if the sector after it is taken.
+static int grow(DISK_FS* f, FS_ENTRY* e, unsigned c) {
+	uint8_t t[SECTOR_DATA_LEN];
+	unsigned a, k, run;
+	uint8_t* r;
+
+	if (f->dirs==1 || !c) {
+		for (a=f->dirs;a<f->d->records && f->used[a];a++);
+		if (a>=f->d->records) return -1;
+		if (f->dirs==1) {
+			if (!(r = img_rec(f->d,a,true))) return -1;
+			r[1] = 0xFF;
+			img_wrote(f->d,a,1,1);
+			if (c && (r = img_rec(f->d,e->tail,true))) {
+				r[1] = a;
+				img_wrote(f->d,e->tail,1,1);
+			}
+		}
+		if (!c) e->head = a;
+	} else if (e->tail+1<f->d->records && !f->used[e->tail+1]) {
+		a = e->tail+1;
+	} else {
+		for (a=f->dirs,run=0;a<f->d->records && run<=c;a++) run = f->used[a] ? 0 : run+1;
+		if (run<=c) return -1;
+		a -= run;
+		// only the data moves, the sector IDs stay where they are
+		for (k=0;k<c;k++) {
+			if (!(r = img_rec(f->d,e->head+k,false))) return -1;
+			memcpy(t,r+SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
+			if (!(r = img_rec(f->d,a+k,true))) return -1;
+			memcpy(r+SECTOR_HEADER_LEN,t,SECTOR_DATA_LEN);
+			img_wrote(f->d,a+k,SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
+			f->used[e->head+k] = false;
+			f->used[a+k] = true;
+		}
+		e->head = a;
+		a += c;
+	}
+	f->used[a] = true;
+	e->tail = a;
+	return a;
+}
+
+uint8_t fs_mount(DISK_FS* f, DISK_IMG* d) {
+	if (f->d==d && f->gen==d->gen) return f->ok ? 0 : ERR_DISK_NOINIT;
+
+	f->d = d;
+	f->gen = d->gen;
+	f->ver++;
+	f->dirs = d->records>PDD1_TRACKS*PDD1_SECTORS ? 2 : 1;
+	uint8_t m = f->dirs==2 ? PDD2_SMT : PDD1_SMT;
+	uint8_t* r = img_rec(d,0,false);
+	f->ok = r && (r[SECTOR_HEADER_LEN+SMT_OFFSET]&m)==m;
+	f->n = 0;
+	if (!f->ok) return ERR_DISK_NOINIT;
+	get_dir(f,r);
+	return 0;
+}
+
+int fs_find(DISK_FS* f, const char* name, uint8_t attr) {
+	for (unsigned i=0;i<f->n;i++)
+		if (f->ent[i].attr==attr && !strcmp(f->ent[i].name,name)) return i;
+	return -1;
+}
+
+unsigned fs_free(DISK_FS* f) {
+	unsigned i, c = 0;
+	for (i=f->dirs;i<f->d->records;i++) if (!f->used[i]) c++;
+	return c;
+}
+
+// put entry e in its place by name, returns the index
+static int insert(DISK_FS* f, FS_ENTRY* e) {
+	unsigned i;
+	for (i=0;i<f->n && name_cmp(f->ent[i].name,e->name)<=0;i++);
+	memmove(f->ent+i+1,f->ent+i,(f->n-i)*sizeof(FS_ENTRY));
+	f->ent[i] = *e;
+	f->n++;
+	return i;
+}
+
+static void remove_ent(DISK_FS* f, int i) {
+	memmove(f->ent+i,f->ent+i+1,(f->n-i-1)*sizeof(FS_ENTRY));
+	f->n--;
+}
+
+uint8_t fs_create(DISK_FS* f, const char* name, uint8_t attr) {
+	FS_ENTRY e;
+	if (fs_find(f,name,attr)>=0) return ERR_EXISTS;
+	if (f->n>=FS_DIRENTS) return ERR_DIR_FULL;
+	memset(&e,0x00,sizeof(e));
+	strncpy(e.name,name,TPDD_FILENAME_LEN);
+	e.attr = attr;
+	insert(f,&e);
+	put_dir(f);
+	return 0;
+}
+
+uint8_t fs_write(DISK_FS* f, int i, const uint8_t* b, unsigned n) {
+	FS_ENTRY* e = f->ent+i;
+	uint8_t* r;
+	unsigned a, k;
+
+	if (e->size+n>FS_FILE_MAX) return ERR_FILE_LEN;
+
+	// space left in the last sector
+	unsigned room = e->size ? SECTOR_DATA_LEN-1-(e->size-1)%SECTOR_DATA_LEN : 0;
+	if (n>room && (n-room+SECTOR_DATA_LEN-1)/SECTOR_DATA_LEN>fs_free(f)) return ERR_DISK_FULL;
+
+	while (n) {
+		if (!room) {
+			if (grow(f,e,e->size/SECTOR_DATA_LEN)<0) return ERR_DISK_FULL;
+			room = SECTOR_DATA_LEN;
+		}
+		if (!(r = img_rec(f->d,e->tail,true))) return ERR_DISK_FULL;
+		k = n<room ? n : room;
+		a = SECTOR_HEADER_LEN+SECTOR_DATA_LEN-room;
+		memcpy(r+a,b,k);
+		img_wrote(f->d,e->tail,a,k);
+		e->size += k;
+		room -= k;
+		b += k;
+		n -= k;
+	}
+
+	put_dir(f);
+	return 0;
+}
+
+uint8_t fs_delete(DISK_FS* f, int i) {
+	uint8_t rns[REC_MAX];
+	unsigned k, c = chain(f,f->ent+i,rns);
+	for (k=0;k<c;k++) f->used[rns[k]] = false;
+	remove_ent(f,i);
+	put_dir(f);
+	return 0;
+}
+
+uint8_t fs_rename(DISK_FS* f, int i, const char* name) {
+	FS_ENTRY e = f->ent[i];
+	if (fs_find(f,name,e.attr)>=0) return ERR_EXISTS;
+	memset(e.name,0x00,sizeof(e.name));
+	strncpy(e.name,name,TPDD_FILENAME_LEN);
+	remove_ent(f,i);
+	insert(f,&e);
+	put_dir(f);
+	return 0;
+}
+
+unsigned fs_sectors(DISK_FS* f, int i, uint8_t* rns) {
+	return chain(f,f->ent+i,rns);
+}
+
+unsigned fs_read(DISK_FS* f, int i, uint8_t* b, unsigned max) {
+	uint8_t rns[REC_MAX];
+	FS_ENTRY* e = f->ent+i;
+	unsigned c = chain(f,e,rns), k, n, t = 0;
+	for (k=0;k<c && t<e->size && t<max;k++) {
+		uint8_t* r = img_rec(f->d,rns[k],false);
+		if (!r) break;
+		n = e->size-t;
+		if (n>SECTOR_DATA_LEN) n = SECTOR_DATA_LEN;
+		if (n>max-t) n = max-t;
+		memcpy(b+t,r+SECTOR_HEADER_LEN,n);
+		t += n;
+	}
+	return t;
+}
@@ -0,0 +1,60 @@
+#ifndef PDD_DISK_FS_H
+#define PDD_DISK_FS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "constants.h"
+#include "disk_img.h"
+
+// The Operation-mode filesystem on a disk image.
+// The directory and space map are parsed into memory once, and only parsed
+// again after something else (FDC or cache commands, another process)
+// changes the image. Every change made here is written straight back to
+// the directory record(s) in the image, so the two never disagree.
+
+#define FS_DIRENTS    40 // entries in the directory
+#define FS_DIRENT_LEN 31 // bytes per entry
+#define FS_USED_OFFSET (SMT_OFFSET+20) // used sector count, after the SMT bits
+#define FS_FILE_MAX   65534 // what a real drive allows
+
+typedef struct {
+	char     name[TPDD_FILENAME_LEN+1]; // as the client sent it, trailing spaces removed
+	uint8_t  attr;
+	uint16_t size;
+	uint8_t  x[2];     // unknown, kept as found
+	uint8_t  head;     // first sector
+	uint8_t  tail;     // last sector
+} FS_ENTRY;
+
+typedef struct {
+	DISK_IMG*     d;
+	unsigned long gen;     // d->gen when the tables below were made
+	unsigned long ver;     // changes whenever the directory does
+	bool          ok;      // formatted
+	unsigned      dirs;    // directory records at the start of the disk, 1 or 2
+	unsigned      n;       // entries in use
+	FS_ENTRY      ent[FS_DIRENTS]; // in the order on the disk
+	bool          used[PDD2_TRACKS*PDD2_SECTORS]; // from the SMT
+} DISK_FS;
+
+// Bring f up to date with d. 0 = ok, else ERR_DISK_NOINIT.
+uint8_t fs_mount (DISK_FS* f, DISK_IMG* d);
+
+int     fs_find (DISK_FS* f, const char* name, uint8_t attr); // index or -1
+unsigned fs_free (DISK_FS* f); // free sectors
+
+// These return 0 or an Operation-mode error code.
+uint8_t fs_create (DISK_FS* f, const char* name, uint8_t attr);
+uint8_t fs_write (DISK_FS* f, int i, const uint8_t* b, unsigned n); // append
+uint8_t fs_delete (DISK_FS* f, int i);
+uint8_t fs_rename (DISK_FS* f, int i, const char* name);
+
+// The sectors of the file in order, rns has room for every record.
+// Returns how many.
+unsigned fs_sectors (DISK_FS* f, int i, uint8_t* rns);
+
+// Copy the whole file into b, at most max bytes. Returns the length.
+unsigned fs_read (DISK_FS* f, int i, uint8_t* b, unsigned max);
+
+#endif // PDD_DISK_FS_H
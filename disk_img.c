@@ -0,0 +1,589 @@
+// Disk image engine.
+//
+// The FDC sector commands and the TPDD2 cache commands used to open,
+// seek, read or write, and close the image file for every logical sector.
+// Now the image is opened the first time it's needed and stays open, and
+// a sector is just an offset into memory.
+//
+// mmap MAP_SHARED is the normal case, so writes land in the page cache
+// right away, and img_sync() (msync) is only needed to say when they must
+// be on the disk. If the image can't be mapped, it's read into the heap,
+// and img_sync() writes the changes back with pwrite().
+//
+// Either way, img_wrote() only marks the record dirty, and img_sync()
+// handles each run of adjacent dirty records with one msync() or pwrite(),
+// so a client filling in all 20 logical sectors of a physical sector, or
+// a whole-disk copy, costs a handful of host writes instead of hundreds.
+// The caller decides when: mode switch, idle, disk change, exit.
+//
+// An overlay leaves the file alone. The first write to a record copies it
+// into ov[], and from then on img_rec() returns the copy. A reset just
+// drops ov[], and a commit writes the copies to the file, so a scribbled-on
+// disk goes back to the original without copying the whole image.
+//
+// A packed image is for archives, where most records are blank or repeat
+// the same header. Each distinct record is stored once, run-length coded,
+// behind a table of offsets. Opening one only reads the header and the
+// table into a heap buffer the size of the image, and a record is
+// unpacked into its place in the buffer the first time it's asked for.
+// Writes are marked dirty as usual, and img_sync() writes a new packed
+// file and renames it over the old one.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "constants.h"
+#include "disk_img.h"
+
+#define ID_SLOTS 512 // power of 2, > 2x the most records in an image
+
+static unsigned long gens = 0;
+
+#define OV_HAS(d,rn) ((d)->ov_map[(rn)/8] & (1<<((rn)%8)))
+#define LOADED(d,rn) ((d)->loaded[(rn)/8] & (1<<((rn)%8)))
+#define PACK_MAX (SECTOR_LEN+SECTOR_LEN/128+1) // worst case packed record
+
+static int read_at(int fd, void* b, size_t n, off_t o) {
+	while (n) {
+		ssize_t r = pread(fd,b,n,o);
+		if (r<0 && errno==EINTR) continue;
+		if (r<=0) { if (!r) errno = EINVAL; return -1; }
+		b = (uint8_t*)b+r;
+		o += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int write_at(int fd, const void* b, size_t n, off_t o) {
+	while (n) {
+		ssize_t r = pwrite(fd,b,n,o);
+		if (r<0 && errno==EINTR) continue;
+		if (r<=0) return -1;
+		b = (const uint8_t*)b+r;
+		o += r;
+		n -= r;
+	}
+	return 0;
+}
+
+// PackBits: 0-127 = that many+1 literal bytes follow,
+// 128-255 = the next byte repeated (c&0x7F)+3 times
+static size_t pack(const uint8_t* s, size_t n, uint8_t* o) {
+	size_t i = 0, k = 0, l;
+	while (i<n) {
+		for (l=1;i+l<n && l<130 && s[i+l]==s[i];l++);
+		if (l>=3) {
+			o[k++] = 0x80|(l-3);
+			o[k++] = s[i];
+			i += l;
+			continue;
+		}
+		// literals, up to where the next run of 3 starts
+		for (l=1;i+l<n && l<128;l++)
+			if (i+l+2<n && s[i+l]==s[i+l+1] && s[i+l]==s[i+l+2]) break;
+		o[k++] = l-1;
+		memcpy(o+k,s+i,l);
+		k += l;
+		i += l;
+	}
+	return k;
+}
+
+static int unpack(const uint8_t* s, size_t n, uint8_t* o) {
+	size_t i = 0, k = 0, l;
+	while (i<n) {
+		uint8_t c = s[i++];
+		if (c&0x80) {
+			l = (c&0x7F)+3;
+			if (i>=n || k+l>SECTOR_LEN) return -1;
+			memset(o+k,s[i++],l);
+		} else {
+			l = c+1;
+			if (i+l>n || k+l>SECTOR_LEN) return -1;
+			memcpy(o+k,s+i,l);
+			i += l;
+		}
+		k += l;
+	}
+	return k==SECTOR_LEN ? 0 : -1;
+}
+
+// Record rn in buf, unpacked from the file first if it hasn't been.
+static uint8_t* base_rec(DISK_IMG* d, unsigned rn) {
+	uint8_t* r = d->buf+(size_t)rn*SECTOR_LEN;
+	uint8_t b[PACK_MAX], h[2];
+	unsigned n;
+	if (!d->packed || LOADED(d,rn)) return r;
+	if (read_at(d->fd,h,2,d->tbl[rn])) return NULL;
+	n = h[0] | h[1]<<8;
+	if (n>PACK_MAX || read_at(d->fd,b,n,d->tbl[rn]+2) || unpack(b,n,r)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	d->loaded[rn/8] |= 1<<(rn%8);
+	return r;
+}
+
+// Just the header and offset table. The heap buffer is a whole image,
+// so growing a short one is free.
+static int img_load_packed(DISK_IMG* d) {
+	uint8_t h[IMG_PACK_HDR_LEN];
+	unsigned n, i;
+	d->mapped = false;
+	memset(d->loaded,0x00,(d->records+7)/8);
+	if (!(d->buf = calloc(d->records,SECTOR_LEN))) return -1;
+	if (!d->size) return 0; // new
+	if (read_at(d->fd,h,IMG_PACK_HDR_LEN,0)) return -1;
+	n = h[6] | h[7]<<8;
+	if (memcmp(h,IMG_PACK_MAGIC,4) || h[4]!=IMG_PACK_VERSION || n>d->records
+		|| (h[5]==2 ? PDD2_TRACKS*PDD2_SECTORS : PDD1_TRACKS*PDD1_SECTORS)!=d->records) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint8_t t[4*n];
+	free(d->tbl);
+	if (!(d->tbl = malloc((n+1)*sizeof(uint32_t))) || read_at(d->fd,t,4*n,IMG_PACK_HDR_LEN)) return -1;
+	for (i=0;i<n;i++) d->tbl[i] = t[4*i] | t[4*i+1]<<8 | t[4*i+2]<<16 | (uint32_t)t[4*i+3]<<24;
+	d->len = (size_t)n*SECTOR_LEN;
+	return 0;
+}
+
+static void img_unmap(DISK_IMG* d) {
+	if (!d->buf) return;
+	if (d->mapped) munmap(d->buf,d->len);
+	else free(d->buf);
+	d->buf = NULL;
+	d->len = 0;
+	d->ids_ok = false;
+}
+
+// (re)load buf from the file as it is now
+static int img_map(DISK_IMG* d) {
+	struct stat st;
+	img_unmap(d);
+	if (fstat(d->fd,&st)) return -1;
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->size = st.st_size;
+	d->mode = st.st_mode;
+	d->mtime = st.st_mtime;
+	d->gen = ++gens;
+	if (d->packed) return img_load_packed(d);
+	d->len = st.st_size;
+	if (d->len>(size_t)d->records*SECTOR_LEN) d->len = (size_t)d->records*SECTOR_LEN;
+	if (!d->len) return 0;
+
+	d->buf = mmap(NULL,d->len,PROT_READ|(d->ro||d->overlay?0:PROT_WRITE),MAP_SHARED,d->fd,0);
+	if (d->buf!=MAP_FAILED) { d->mapped = true; return 0; }
+
+	d->mapped = false;
+	if (!(d->buf = malloc(d->len))) { d->len = 0; return -1; }
+	for (size_t t=0;t<d->len;) {
+		ssize_t r = pread(d->fd,d->buf+t,d->len-t,t);
+		if (r<0 && errno==EINTR) continue;
+		if (r<=0) { img_unmap(d); return -1; }
+		t += r;
+	}
+	return 0;
+}
+
+DISK_IMG* img_open(const char* path, unsigned records, bool create, bool overlay) {
+	DISK_IMG* d = calloc(1,sizeof(DISK_IMG));
+	if (!d || !(d->path = strdup(path))) { free(d); return NULL; }
+	d->records = records;
+	d->overlay = overlay;
+	if (!(d->dirty = calloc(records,1)) || !(d->ov_map = calloc((records+7)/8,1))
+		|| !(d->loaded = calloc((records+7)/8,1))) {
+		free(d->dirty); free(d->ov_map); free(d->path); free(d);
+		return NULL;
+	}
+	d->fd = open(path,(overlay?O_RDONLY:O_RDWR)|O_CLOEXEC|(create?O_CREAT:0),0666);
+	if (d->fd<0 && !overlay && (errno==EACCES || errno==EROFS || errno==EPERM)) {
+		d->ro = true;
+		d->fd = open(path,O_RDONLY|O_CLOEXEC);
+	}
+	if (d->fd>=0) {
+		struct stat st;
+		uint8_t m[4] = {0};
+		size_t l = strlen(path), sl = strlen(IMG_PACK_SUFFIX);
+		d->packed = pread(d->fd,m,4,0)==4 && !memcmp(m,IMG_PACK_MAGIC,4);
+		if (!d->packed && !fstat(d->fd,&st) && !st.st_size && l>=sl)
+			d->packed = !strcasecmp(path+l-sl,IMG_PACK_SUFFIX);
+	}
+	if (d->fd<0 || img_map(d)) {
+		int e = errno;
+		img_close(d);
+		errno = e;
+		return NULL;
+	}
+	return d;
+}
+
+void img_close(DISK_IMG* d) {
+	if (!d) return;
+	if (d->fd>=0) img_sync(d);
+	img_unmap(d);
+	if (d->fd>=0) close(d->fd);
+	free(d->dirty);
+	free(d->ov);
+	free(d->ov_map);
+	free(d->ids);
+	free(d->tbl);
+	free(d->loaded);
+	free(d->path);
+	free(d);
+}
+
+// Someone else's changes to the contents show up by themselves in a
+// mapping, but a different file, a different size, or a chmod, means open
+// it again. A heap copy also has to be reloaded when the mtime changes.
+bool img_changed(DISK_IMG* d) {
+	struct stat st;
+	if (stat(d->path,&st)) return true;
+	d->seen = st.st_mtime;
+	// the overlay is on top of this file, keep it
+	if (d->ov_n) return false;
+	// a heap copy with unsaved changes has the newest data, so keep it
+	if (!d->mapped && d->ndirty) return false;
+	if (!d->mapped && st.st_mtime!=d->mtime) return true;
+	return st.st_dev!=d->dev || st.st_ino!=d->ino || st.st_size!=d->size || st.st_mode!=d->mode;
+}
+
+uint8_t* img_rec(DISK_IMG* d, unsigned rn, bool w) {
+	size_t e = ((size_t)rn+1)*SECTOR_LEN;
+	if (rn>=d->records) return NULL;
+	if (d->overlay) {
+		uint8_t* r;
+		if (OV_HAS(d,rn)) return d->ov+(size_t)rn*SECTOR_LEN;
+		if (!w) return e>d->len ? NULL : base_rec(d,rn);
+		if (!d->ov && !(d->ov = malloc((size_t)d->records*SECTOR_LEN))) return NULL;
+		r = d->ov+(size_t)rn*SECTOR_LEN;
+		if (e>d->len) memset(r,0x00,SECTOR_LEN);
+		else {
+			const uint8_t* b = base_rec(d,rn);
+			if (!b) return NULL;
+			memcpy(r,b,SECTOR_LEN);
+		}
+		d->ov_map[rn/8] |= 1<<(rn%8);
+		d->ov_n++;
+		return r;
+	}
+	if (e>d->len) {
+		if (!w || d->ro) return NULL;
+		if (d->packed) {
+			// the rest of buf is already zeros
+			for (unsigned i=d->len/SECTOR_LEN;i<d->records;i++) d->loaded[i/8] |= 1<<(i%8);
+			d->len = (size_t)d->records*SECTOR_LEN;
+			return base_rec(d,rn);
+		}
+		// a new or short image gets filled out to full size
+		// (a heap copy is about to be reloaded, so save it first)
+		if (!d->mapped) img_sync(d);
+		if (ftruncate(d->fd,(off_t)d->records*SECTOR_LEN) || img_map(d) || e>d->len) return NULL;
+	}
+	return base_rec(d,rn);
+}
+
+void img_wrote(DISK_IMG* d, unsigned rn, unsigned off, unsigned len) {
+	(void)len;
+	d->wrote++;
+	d->gen = ++gens;
+	if (off<SECTOR_HEADER_LEN) d->ids_ok = false;
+	if (d->overlay || rn>=d->records || d->dirty[rn]) return;
+	d->dirty[rn] = 1;
+	d->ndirty++;
+}
+
+// one memcpy, and one run of dirty records for img_sync()
+int img_fill(DISK_IMG* d, const uint8_t* src) {
+	if (d->overlay) {
+		if (!d->ov && !(d->ov = malloc((size_t)d->records*SECTOR_LEN))) return -1;
+		memcpy(d->ov,src,(size_t)d->records*SECTOR_LEN);
+		memset(d->ov_map,0xFF,(d->records+7)/8);
+		d->ov_n = d->records;
+	} else {
+		if (!img_rec(d,d->records-1,true)) return -1;
+		memcpy(d->buf,src,(size_t)d->records*SECTOR_LEN);
+		if (d->packed) memset(d->loaded,0xFF,(d->records+7)/8);
+		memset(d->dirty,1,d->records);
+		d->ndirty = d->records;
+	}
+	d->wrote += d->records;
+	d->gen = ++gens;
+	d->ids_ok = false;
+	return 0;
+}
+
+// A packed record is unpacked now instead of on the next img_rec(). A
+// mapped one gets the kernel reading it in, if it isn't in the page cache
+// already, without waiting for it. A heap copy is all in memory anyway.
+void img_prefetch(DISK_IMG* d, unsigned rn, unsigned n) {
+	if (rn>=d->records) return;
+	if (rn+n>d->records) n = d->records-rn;
+	if (d->packed) {
+		for (;n && ((size_t)rn+1)*SECTOR_LEN<=d->len;rn++,n--) base_rec(d,rn);
+		return;
+	}
+	if (!d->mapped) return;
+	size_t o = (size_t)rn*SECTOR_LEN, l = (size_t)n*SECTOR_LEN;
+	if (o>=d->len) return;
+	if (o+l>d->len) l = d->len-o;
+	size_t p = o & ~((size_t)sysconf(_SC_PAGESIZE)-1);
+	posix_madvise(d->buf+p,l+o-p,POSIX_MADV_WILLNEED);
+}
+
+/*
+ * Sector ID index
+ *
+ * FDC search-id used to read the whole image looking for the ID.
+ * Now there's a hash of ID to record number, built by scanning the
+ * headers in memory the first time it's needed. Any write that touches a
+ * header (write-id, format, cache commit), or a new mtime on the file
+ * (someone else wrote it), just marks the index stale, and the next
+ * search rebuilds it. That's only 80 or 160 headers, and searches
+ * normally come in runs between writes.
+ *
+ * The key is the ID up to its first 0x00, since the search has always
+ * compared with strncmp(). Several records can have the same ID (a fresh
+ * format has all blank IDs), and the lowest record number wins, same as
+ * the sequential search did.
+ */
+static unsigned id_len(const uint8_t* id) {
+	unsigned n = 0;
+	while (n<SECTOR_ID_LEN && id[n]) n++;
+	return n;
+}
+
+static unsigned id_hash(const uint8_t* id, unsigned n) {
+	uint32_t h = 2166136261u; // FNV-1a
+	while (n--) { h ^= *id++; h *= 16777619u; }
+	return h & (ID_SLOTS-1);
+}
+
+static int16_t* id_slot(DISK_IMG* d, const uint8_t* id) {
+	unsigned n = id_len(id);
+	unsigned i = id_hash(id,n);
+	for (;d->ids[i]>=0;i=(i+1)&(ID_SLOTS-1)) {
+		const uint8_t* r = img_rec(d,d->ids[i],false)+1;
+		if (id_len(r)==n && !memcmp(r,id,n)) break;
+	}
+	return d->ids+i;
+}
+
+static int ids_build(DISK_IMG* d) {
+	if (!d->ids && !(d->ids = malloc(ID_SLOTS*sizeof(int16_t)))) return -1;
+	for (unsigned i=0;i<ID_SLOTS;i++) d->ids[i] = -1;
+	uint8_t* r;
+	for (unsigned rn=0;rn<d->records && (r = img_rec(d,rn,false));rn++) {
+		int16_t* p = id_slot(d,r+1);
+		if (*p<0) *p = rn;
+	}
+	d->ids_mtime = d->seen;
+	d->ids_ok = true;
+	return 0;
+}
+
+int img_find_id(DISK_IMG* d, const uint8_t* id) {
+	if ((!d->ids_ok || d->ids_mtime!=d->seen) && ids_build(d)) return -1;
+	return *id_slot(d,id);
+}
+
+int img_probe(const char* path) {
+	uint8_t h[IMG_PACK_HDR_LEN];
+	int fd = open(path,O_RDONLY|O_CLOEXEC), e;
+	if (fd<0) return 0;
+	e = read_at(fd,h,IMG_PACK_HDR_LEN,0);
+	close(fd);
+	if (e || memcmp(h,IMG_PACK_MAGIC,4) || h[4]!=IMG_PACK_VERSION || h[5]<1 || h[5]>2) return 0;
+	return h[5];
+}
+
+// Identical records share a block, found by hash then memcmp.
+static size_t pack_image(DISK_IMG* d, unsigned n, uint8_t* o) {
+	uint32_t h[n];
+	unsigned i, j;
+	size_t k = IMG_PACK_HDR_LEN+4*n, t;
+	memcpy(o,IMG_PACK_MAGIC,4);
+	o[4] = IMG_PACK_VERSION;
+	o[5] = d->records>PDD1_TRACKS*PDD1_SECTORS ? 2 : 1;
+	o[6] = n&0xFF;
+	o[7] = n>>8;
+	for (i=0;i<n;i++) {
+		const uint8_t* r = img_rec(d,i,false);
+		uint8_t* p = o+IMG_PACK_HDR_LEN+4*i;
+		h[i] = 2166136261u; // FNV-1a
+		for (j=0;j<SECTOR_LEN;j++) { h[i] ^= r[j]; h[i] *= 16777619u; }
+		for (j=0;j<i;j++) if (h[j]==h[i] && !memcmp(img_rec(d,j,false),r,SECTOR_LEN)) break;
+		if (j<i) t = o[IMG_PACK_HDR_LEN+4*j] | o[IMG_PACK_HDR_LEN+4*j+1]<<8 | o[IMG_PACK_HDR_LEN+4*j+2]<<16 | (size_t)o[IMG_PACK_HDR_LEN+4*j+3]<<24;
+		else {
+			t = k;
+			size_t l = pack(r,SECTOR_LEN,o+k+2);
+			o[k] = l&0xFF;
+			o[k+1] = l>>8;
+			k += 2+l;
+		}
+		p[0] = t&0xFF;
+		p[1] = (t>>8)&0xFF;
+		p[2] = (t>>16)&0xFF;
+		p[3] = t>>24;
+	}
+	return k;
+}
+
+int img_save(DISK_IMG* d, const char* path, bool packed) {
+	char t[PATH_MAX+1];
+	struct stat st;
+	unsigned n, i;
+	size_t l;
+	uint8_t* o;
+	int fd, e = 0;
+
+	// a short image stays short
+	for (n=0;n<d->records && img_rec(d,n,false);n++);
+	if ((size_t)n*SECTOR_LEN<d->len) return -1; // one that can't be unpacked
+	if (packed) l = IMG_PACK_HDR_LEN+(size_t)n*(4+2+PACK_MAX);
+	else l = (size_t)n*SECTOR_LEN;
+	if (!(o = malloc(l+1))) return -1;
+	if (packed) l = pack_image(d,n,o);
+	else for (i=0;i<n;i++) memcpy(o+(size_t)i*SECTOR_LEN,img_rec(d,i,false),SECTOR_LEN);
+
+	// same permissions as the file being replaced, or a new file's
+	mode_t m = umask(0);
+	umask(m);
+	m = stat(path,&st) ? 0666&~m : st.st_mode&07777;
+
+	snprintf(t,sizeof(t),"%s.XXXXXX",path);
+	if ((fd = mkstemp(t))<0) { free(o); return -1; }
+	if (fchmod(fd,m) || write_at(fd,o,l,0) || fsync(fd)) e = -1;
+	free(o);
+	if (close(fd)) e = -1;
+	if (!e && rename(t,path)) e = -1;
+	if (e) { int x = errno; unlink(t); errno = x; }
+	else d->writes++;
+	return e;
+}
+
+// After img_save() replaced the file, get a handle on the new one.
+static int img_reopen(DISK_IMG* d) {
+	struct stat st;
+	int fd = open(d->path,(d->ro||d->overlay?O_RDONLY:O_RDWR)|O_CLOEXEC);
+	if (fd<0) return -1;
+	close(d->fd);
+	d->fd = fd;
+	if (fstat(fd,&st)) return -1;
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->size = st.st_size;
+	d->mode = st.st_mode;
+	d->mtime = st.st_mtime;
+	return 0;
+}
+
+unsigned img_reset(DISK_IMG* d) {
+	unsigned n = d->ov_n;
+	free(d->ov);
+	d->ov = NULL;
+	memset(d->ov_map,0x00,(d->records+7)/8);
+	d->ov_n = 0;
+	d->gen = ++gens;
+	d->ids_ok = false;
+	return n;
+}
+
+// Each run of adjacent changed records in one pwrite(), on a separate
+// writable fd, then reload the file and drop the overlay.
+int img_commit(DISK_IMG* d) {
+	unsigned a, b;
+	int e = 0, fd;
+	if (!d->ov_n) return 0;
+	if (d->packed) {
+		if (img_save(d,d->path,true) || img_reopen(d)) return -1;
+		e = img_reset(d);
+		if (img_map(d)) return -1;
+		return e;
+	}
+	if ((fd = open(d->path,O_RDWR|O_CLOEXEC))<0) return -1;
+	for (a=0;a<d->records && !e;a=b) {
+		if (!OV_HAS(d,a)) { b = a+1; continue; }
+		for (b=a;b<d->records && OV_HAS(d,b);b++);
+		size_t o = (size_t)a*SECTOR_LEN, n = (size_t)(b-a)*SECTOR_LEN;
+		while (n) {
+			ssize_t r = pwrite(fd,d->ov+o,n,o);
+			if (r<0 && errno==EINTR) continue;
+			if (r<=0) { e = -1; break; }
+			d->writes++;
+			o += r;
+			n -= r;
+		}
+	}
+	if (fsync(fd)) e = -1;
+	close(fd);
+	if (e) return -1;
+	e = img_reset(d);
+	if (img_map(d)) return -1;
+	return e;
+}
+
+// A record is only clean once it's known to be on the disk. Records that
+// couldn't be written, or weren't fsync'ed, stay dirty for the next try.
+int img_sync(DISK_IMG* d) {
+	struct stat st;
+	unsigned a, b;
+	int e = 0;
+	bool synced = true;
+	if (!d || d->ro || d->overlay || !d->ndirty) return 0;
+
+	if (d->packed) {
+		if (img_save(d,d->path,true) || img_reopen(d)) return -1;
+		memset(d->dirty,0,d->records);
+		d->ndirty = 0;
+		return 0;
+	}
+
+	// 2 = written, clean once it's synced
+	for (a=0;a<d->records;a=b) {
+		if (!d->dirty[a]) { b = a+1; continue; }
+		for (b=a;b<d->records && d->dirty[b];b++);
+		size_t o = (size_t)a*SECTOR_LEN, n = (size_t)(b-a)*SECTOR_LEN;
+		if (o+n>d->len) n = d->len-o;
+		d->writes++;
+		if (d->mapped) {
+			// msync wants a page aligned address
+			size_t p = o & ~((size_t)sysconf(_SC_PAGESIZE)-1);
+			if (msync(d->buf+p,n+o-p,MS_SYNC)) { e = -1; continue; }
+			n = 0;
+		}
+		while (n) {
+			ssize_t r = pwrite(d->fd,d->buf+o,n,o);
+			if (r<0 && errno==EINTR) continue;
+			if (r<=0) { e = -1; break; }
+			o += r;
+			n -= r;
+		}
+		if (!n) memset(d->dirty+a,2,b-a);
+	}
+
+	if (!d->mapped) {
+		if (fsync(d->fd)) { e = -1; synced = false; }
+		// our own write isn't a reason to reload
+		if (!fstat(d->fd,&st)) d->mtime = st.st_mtime;
+	}
+
+	for (a=0;a<d->records;a++) {
+		if (d->dirty[a]!=2) continue;
+		if (synced) { d->dirty[a] = 0; d->ndirty--; }
+		else d->dirty[a] = 1;
+	}
+	return e;
+}
@@ -0,0 +1,110 @@
+#ifndef PDD_DISK_IMG_H
+#define PDD_DISK_IMG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A .pdd1/.pdd2 disk image, opened once and kept in memory.
+// Records are reached by pointer into buf, which is the image file
+// mmap'ed shared, or if mmap isn't possible, a copy on the heap.
+// Changed records are marked dirty, and written back by img_sync().
+// Or with an overlay, changed records are copies in memory, and the file
+// is only ever written by img_commit().
+// A packed image (.pddz) is read into the heap a record at a time, the first
+// time each one is used, and img_sync() writes the whole thing out again.
+
+// Packed image file
+//  0  "PDDZ"
+//  4  version, 1
+//  5  model, 1 or 2
+//  6  records stored, 2 bytes LSB first
+//  8  offset of each record's block from the start of the file, 4 bytes
+//     LSB first, records with the same contents share one block
+//  .. blocks, 2 bytes length LSB first, then the record in PackBits
+#define IMG_PACK_MAGIC   "PDDZ"
+#define IMG_PACK_VERSION 1
+#define IMG_PACK_HDR_LEN 8
+#define IMG_PACK_SUFFIX  ".pddz"
+
+typedef struct DISK_IMG {
+	char*    path;
+	int      fd;
+	uint8_t* buf;      // the image
+	size_t   len;      // bytes in buf, may be short of a full image
+	unsigned records;  // records in a full image
+	bool     ro;       // write-protected
+	bool     mapped;   // buf is mmap'ed, else heap
+	bool     packed;   // the file is a packed image
+	uint32_t* tbl;     // packed: file offset of each record's block
+	uint8_t* loaded;   // packed: bitmap of the records unpacked into buf
+	// the file as opened, see img_changed()
+	dev_t    dev;
+	ino_t    ino;
+	off_t    size;
+	mode_t   mode;
+	time_t   mtime;
+	uint8_t* dirty;    // per record, changed since the last img_sync()
+	unsigned ndirty;
+	time_t   seen;     // mtime at the last img_changed()
+	unsigned long gen; // changes with every load or img_wrote(), unique across images
+	// copy-on-write overlay
+	bool     overlay;
+	uint8_t* ov;       // records*SECTOR_LEN, allocated on the first write
+	uint8_t* ov_map;   // bitmap of the records that are in ov
+	unsigned ov_n;     // records in ov
+	// sector ID index, see img_find_id()
+	int16_t* ids;      // ID_SLOTS slots, record number or -1
+	bool     ids_ok;
+	time_t   ids_mtime;
+	// stats
+	unsigned long wrote;   // img_wrote() calls, each used to be a write()
+	unsigned long writes;  // writes actually done by img_sync()
+} DISK_IMG;
+
+// create = make the file if it doesn't exist
+// A file that starts with IMG_PACK_MAGIC, or a new one whose name ends in
+// IMG_PACK_SUFFIX, is a packed image.
+// overlay = open the file read-only, and keep all changes in memory
+DISK_IMG* img_open (const char* path, unsigned records, bool create, bool overlay);
+void      img_close (DISK_IMG* d);
+
+// the file was replaced, resized, had its permissions changed,
+// or for a heap copy, was modified
+bool      img_changed (DISK_IMG* d);
+
+// Pointer to record rn, or NULL if it's not in the image.
+// w = about to write, so extend a short image to full size if needed.
+uint8_t*  img_rec (DISK_IMG* d, unsigned rn, bool w);
+
+// len bytes at off in record rn were changed through img_rec()
+void      img_wrote (DISK_IMG* d, unsigned rn, unsigned off, unsigned len);
+
+// Replace the whole image with records*SECTOR_LEN bytes from src,
+// extending a short image, and mark it all dirty.
+int       img_fill (DISK_IMG* d, const uint8_t* src);
+
+// Overlay: forget all changes, or write them to the file.
+// Both return the number of records that were changed.
+unsigned  img_reset (DISK_IMG* d);
+int       img_commit (DISK_IMG* d);
+
+// Get n records from rn on ready ahead of being asked for.
+void      img_prefetch (DISK_IMG* d, unsigned rn, unsigned n);
+
+// Lowest record whose sector ID matches id, compared like strncmp(),
+// or -1 if none.
+int       img_find_id (DISK_IMG* d, const uint8_t* id);
+
+// Model 1 or 2 from the header of a packed image, or 0 if it isn't one.
+int       img_probe (const char* path);
+
+// Write the image as it is now (overlay included) to path, packed or raw,
+// through a temp file and rename().
+int       img_save (DISK_IMG* d, const char* path, bool packed);
+
+// Write out the dirty records, each run of adjacent ones in one go,
+// and make sure they're on the disk. Whatever fails stays dirty, -1.
+int       img_sync (DISK_IMG* d);
+
+#endif // PDD_DISK_IMG_H
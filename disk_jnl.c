@@ -0,0 +1,162 @@
+// Journal for TPDD2 cache commits.
+//
+// A cache commit goes into the image in memory right away, as before,
+// so everything that reads the disk sees it. It's also appended to the
+// journal, which is just sequential writes to one file. Nothing waits on
+// the disk for each commit. jnl_flush() does one fsync for however many
+// entries piled up since the last one, and the caller runs it after a
+// short delay or every so many entries. So a client committing all 160
+// sectors (BACKUP.BA) costs a handful of fsyncs on one file, instead of
+// every commit being a random write to the image.
+//
+// The image itself is only brought up to date at a checkpoint, on idle
+// or when the journal gets long, and then the journal is emptied. After
+// a crash, the entries still in the journal are replayed on the next
+// open. A torn entry at the end fails its checksum and is where the
+// replay stops.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "disk_jnl.h"
+
+#define HAS(j,rn) ((j)->has[(rn)/8] & (1<<((rn)%8)))
+
+static uint32_t entry_sum(const uint8_t* e) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (unsigned i=2;i<JNL_ENTRY_LEN;i++) {
+		if (i==4) i = JNL_ENTRY_HDR;
+		h ^= e[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void keep(DISK_JNL* j, unsigned rn, const uint8_t* r) {
+	memcpy(j->rec+(size_t)rn*SECTOR_LEN,r,SECTOR_LEN);
+	j->has[rn/8] |= 1<<(rn%8);
+}
+
+static int replay(DISK_JNL* j) {
+	uint8_t e[JNL_ENTRY_LEN];
+	unsigned rn, c = 0;
+	uint8_t* r;
+	off_t o;
+	for (o=0;pread(j->fd,e,JNL_ENTRY_LEN,o)==JNL_ENTRY_LEN;o+=JNL_ENTRY_LEN) {
+		uint32_t s = e[4] | e[5]<<8 | e[6]<<16 | (uint32_t)e[7]<<24;
+		rn = e[2] | e[3]<<8;
+		if (e[0]!='D' || e[1]!='J' || s!=entry_sum(e) || rn>=j->d->records) break;
+		if (!(r = img_rec(j->d,rn,true))) return -1;
+		memcpy(r,e+JNL_ENTRY_HDR,SECTOR_LEN);
+		img_wrote(j->d,rn,0,SECTOR_LEN);
+		keep(j,rn,r);
+		c++;
+	}
+	return c;
+}
+
+int jnl_open(DISK_JNL* j, DISK_IMG* d) {
+	size_t l = strlen(d->path)+5;
+	int c;
+	memset(j,0x00,sizeof(DISK_JNL));
+	j->fd = -1;
+	if (!(j->path = malloc(l))
+		|| !(j->rec = malloc((size_t)d->records*SECTOR_LEN))
+		|| !(j->has = calloc((d->records+7)/8,1))) goto fail;
+	snprintf(j->path,l,"%s.jnl",d->path);
+	if ((j->fd = open(j->path,O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,0666))<0) goto fail;
+	j->d = d;
+	// a torn entry at the end is done with, the rest stays until the
+	// image has it, which may be a later checkpoint if this one fails
+	if ((c = replay(j))<0 || ftruncate(j->fd,(off_t)c*JNL_ENTRY_LEN)) goto fail;
+	j->n = c;
+	jnl_checkpoint(j);
+	return c;
+fail:
+	c = errno;
+	if (j->fd>=0) close(j->fd);
+	free(j->path);
+	free(j->rec);
+	free(j->has);
+	memset(j,0x00,sizeof(DISK_JNL));
+	j->fd = -1;
+	errno = c;
+	return -1;
+}
+
+void jnl_close(DISK_JNL* j) {
+	if (!j->d) return;
+	// all in the image, so the file isn't needed
+	if (!jnl_checkpoint(j)) unlink(j->path);
+	close(j->fd);
+	free(j->path);
+	free(j->rec);
+	free(j->has);
+	memset(j,0x00,sizeof(DISK_JNL));
+	j->fd = -1;
+}
+
+int jnl_append(DISK_JNL* j, unsigned rn) {
+	uint8_t e[JNL_ENTRY_LEN];
+	const uint8_t* r;
+	if (!j->d || rn>=j->d->records || !(r = img_rec(j->d,rn,false))) return -1;
+	e[0] = 'D';
+	e[1] = 'J';
+	e[2] = rn&0xFF;
+	e[3] = rn>>8;
+	memcpy(e+JNL_ENTRY_HDR,r,SECTOR_LEN);
+	uint32_t s = entry_sum(e);
+	e[4] = s&0xFF;
+	e[5] = (s>>8)&0xFF;
+	e[6] = (s>>16)&0xFF;
+	e[7] = s>>24;
+	// O_APPEND, so one write() is one whole entry
+	for (;;) {
+		ssize_t w = write(j->fd,e,JNL_ENTRY_LEN);
+		if (w<0 && errno==EINTR) continue;
+		if (w!=JNL_ENTRY_LEN) return -1;
+		break;
+	}
+	keep(j,rn,r);
+	j->n++;
+	j->pending++;
+	j->appends++;
+	return 0;
+}
+
+int jnl_flush(DISK_JNL* j) {
+	if (!j->d || !j->pending) return 0;
+	j->syncs++;
+	if (fsync(j->fd)) return -1;
+	j->pending = 0;
+	return 0;
+}
+
+int jnl_checkpoint(DISK_JNL* j) {
+	if (!j->d) return 0;
+	if (!j->n) return jnl_flush(j);
+	// the journal has to stay, and be on the disk, until the image has it all
+	if (img_sync(j->d)) {
+		int e = errno;
+		jnl_flush(j);
+		errno = e;
+		return -1;
+	}
+	// if this doesn't make it to the disk, the replay just does it again
+	if (ftruncate(j->fd,0)) return -1;
+	j->n = 0;
+	j->pending = 0;
+	return 0;
+}
+
+const uint8_t* jnl_rec(DISK_JNL* j, unsigned rn) {
+	if (!j->d || rn>=j->d->records || !HAS(j,rn)) return NULL;
+	return j->rec+(size_t)rn*SECTOR_LEN;
+}
@@ -0,0 +1,58 @@
+#ifndef PDD_DISK_JNL_H
+#define PDD_DISK_JNL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "constants.h"
+#include "disk_img.h"
+
+// Journal for TPDD2 cache commits, "<image>.jnl".
+// Each commit is appended as a whole record, and fsync'ed in groups.
+// A checkpoint syncs the image and empties the journal, and whatever is
+// still in the journal at startup gets replayed into the image.
+//
+// Entry:
+//  0  "DJ"
+//  2  record number, 2 bytes LSB first
+//  4  FNV-1a of the record number bytes and the record, 4 bytes LSB first
+//  8  the record, SECTOR_LEN bytes
+
+#define JNL_ENTRY_HDR 8
+#define JNL_ENTRY_LEN (JNL_ENTRY_HDR+SECTOR_LEN)
+
+typedef struct {
+	DISK_IMG* d;       // the image this is the journal for, or NULL
+	char*     path;
+	int       fd;
+	unsigned  n;       // entries since the last checkpoint
+	unsigned  pending; // entries not fsync'ed yet
+	uint8_t*  rec;     // the last copy journaled of each record
+	uint8_t*  has;     // bitmap, rec[] is valid
+	unsigned long appends;
+	unsigned long syncs;
+} DISK_JNL;
+
+// Open the journal for d, replay anything in it into d, and checkpoint.
+// Returns the number of records replayed, or -1. If the checkpoint fails,
+// the replayed entries stay in the journal for the next one.
+int  jnl_open (DISK_JNL* j, DISK_IMG* d);
+
+// Checkpoint, close, and remove the file. Safe on a journal that isn't open.
+void jnl_close (DISK_JNL* j);
+
+// Append record rn as it is in d. Doesn't wait for the disk.
+int  jnl_append (DISK_JNL* j, unsigned rn);
+
+// fsync whatever was appended since the last time.
+int  jnl_flush (DISK_JNL* j);
+
+// img_sync() the image, then empty the journal.
+// If the image can't be synced, the journal is kept, and fsync'ed.
+int  jnl_checkpoint (DISK_JNL* j);
+
+// The last copy of record rn that went into the journal, or NULL if none
+// since it was opened.
+const uint8_t* jnl_rec (DISK_JNL* j, unsigned rn);
+
+#endif // PDD_DISK_JNL_H
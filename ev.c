@@ -0,0 +1,190 @@
+// Event loop for the tpdd server.
+//
+// Everything the server waits on goes through ev_wait(): the client tty,
+// any extra fds (pipes, sockets, inotify), timers, and signals.
+// Signals are turned into bytes on a self-pipe so their handlers run in
+// the loop like everything else, not in signal context.
+//
+// poll() rather than epoll/kqueue, because there are only ever a few fds
+// and it's the same on every platform.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "ev.h"
+
+// The fd and timer tables start at EV_GROW and double when they fill up,
+// since every session adds a tty (two fds in a replay) and a couple of
+// timers. Callbacks may add to them while ev_wait() walks them, so they're
+// always indexed, never held by pointer across a callback.
+#define EV_GROW       16
+#define EV_SIGS_MAX   32
+
+typedef struct {
+	ev_fd_cb cb;
+	void*    arg;
+} EV_FD;
+
+typedef struct {
+	ev_timer_cb cb;
+	void*       arg;
+	uint64_t    due;
+} EV_TIMER;
+
+static struct pollfd* pfd = NULL;
+static EV_FD* fdh = NULL;
+static int nfds = 0;
+static int fds_len = 0;
+
+static EV_TIMER* tmr = NULL;
+static int tmrs_len = 0;
+
+static int sig_pipe[2] = {-1,-1};
+static ev_sig_cb sigh[EV_SIGS_MAX];
+
+// monotonic milliseconds
+uint64_t ev_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000 + t.tv_nsec/1000000;
+}
+
+static int fds_grow(void) {
+	int n = fds_len ? fds_len*2 : EV_GROW;
+	struct pollfd* p = realloc(pfd,n*sizeof(*pfd));
+	if (!p) return -1;
+	pfd = p;
+	EV_FD* h = realloc(fdh,n*sizeof(*fdh));
+	if (!h) return -1;
+	fdh = h;
+	fds_len = n;
+	return 0;
+}
+
+// Add fd, or change the events and callback if it's already there.
+int ev_add_fd(int fd, short events, ev_fd_cb cb, void* arg) {
+	int i, f = -1;
+	for (i=0;i<nfds;i++) {
+		if (pfd[i].fd==fd) break;
+		if (pfd[i].fd<0 && f<0) f = i;
+	}
+	if (i==nfds) {
+		if (f>=0) i = f;
+		else if (nfds>=fds_len && fds_grow()) return -1;
+		else nfds++;
+	}
+	pfd[i].fd = fd;
+	pfd[i].events = events;
+	pfd[i].revents = 0;
+	fdh[i].cb = cb;
+	fdh[i].arg = arg;
+	return 0;
+}
+
+// Only marks the slot unused, so it's safe to call from inside a callback
+// while ev_wait() is walking the list.
+void ev_del_fd(int fd) {
+	for (int i=0;i<nfds;i++) if (pfd[i].fd==fd) pfd[i].fd = -1;
+}
+
+int ev_timer(ev_timer_cb cb, void* arg, int ms) {
+	int i, f = -1;
+	for (i=0;i<tmrs_len;i++) {
+		if (tmr[i].cb==cb && tmr[i].arg==arg) break;
+		if (!tmr[i].cb && f<0) f = i;
+	}
+	if (i==tmrs_len) i = f;
+	if (i<0) {
+		int n = tmrs_len ? tmrs_len*2 : EV_GROW;
+		EV_TIMER* t = realloc(tmr,n*sizeof(*tmr));
+		if (!t) return -1;
+		memset(t+tmrs_len,0,(n-tmrs_len)*sizeof(*tmr));
+		tmr = t;
+		i = tmrs_len;
+		tmrs_len = n;
+	}
+	tmr[i].cb = cb;
+	tmr[i].arg = arg;
+	tmr[i].due = ev_now() + ms;
+	return 0;
+}
+
+void ev_timer_cancel(ev_timer_cb cb, void* arg) {
+	for (int i=0;i<tmrs_len;i++) if (tmr[i].cb==cb && tmr[i].arg==arg) tmr[i].cb = NULL;
+}
+
+static void sig_write(int sig) {
+	int e = errno;
+	uint8_t b = sig;
+	(void)!write(sig_pipe[1],&b,1);
+	errno = e;
+}
+
+static void sig_read(int fd, short revents, void* arg) {
+	uint8_t b[16];
+	int i, n;
+	(void)revents; (void)arg;
+	while ((n = read(fd,b,sizeof(b)))>0)
+		for (i=0;i<n;i++) if (b[i]<EV_SIGS_MAX && sigh[b[i]]) sigh[b[i]](b[i]);
+}
+
+int ev_signal(int sig, ev_sig_cb cb) {
+	struct sigaction sa;
+	if (sig<1 || sig>=EV_SIGS_MAX) return -1;
+	if (sig_pipe[0]<0) {
+		if (pipe(sig_pipe)) return -1;
+		for (int i=0;i<2;i++) {
+			fcntl(sig_pipe[i],F_SETFL,fcntl(sig_pipe[i],F_GETFL)|O_NONBLOCK);
+			fcntl(sig_pipe[i],F_SETFD,FD_CLOEXEC);
+		}
+		if (ev_add_fd(sig_pipe[0],POLLIN,sig_read,NULL)) return -1;
+	}
+	sigh[sig] = cb;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = sig_write;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	return sigaction(sig,&sa,NULL);
+}
+
+void ev_wait(void) {
+	int i, n, t = -1;
+	uint64_t now = ev_now();
+
+	// sleep no longer than the nearest timer
+	for (i=0;i<tmrs_len;i++) {
+		if (!tmr[i].cb) continue;
+		if (tmr[i].due<=now) { t = 0; break; }
+		if (t<0 || tmr[i].due-now<(uint64_t)t) t = tmr[i].due-now;
+	}
+
+	n = poll(pfd,nfds,t);
+	if (n<0 && errno!=EINTR) return;
+
+	// expired timers
+	now = ev_now();
+	for (i=0;i<tmrs_len;i++) {
+		if (!tmr[i].cb || tmr[i].due>now) continue;
+		ev_timer_cb cb = tmr[i].cb;
+		void* arg = tmr[i].arg;
+		tmr[i].cb = NULL;
+		cb(arg);
+	}
+
+	// ready fds
+	if (n>0) for (i=0;i<nfds;i++) {
+		if (pfd[i].fd<0 || !pfd[i].revents) continue;
+		fdh[i].cb(pfd[i].fd,pfd[i].revents,fdh[i].arg);
+	}
+
+	// reclaim slots freed by ev_del_fd()
+	while (nfds && pfd[nfds-1].fd<0) nfds--;
+}
@@ -0,0 +1,31 @@
+#ifndef PDD_EV_H
+#define PDD_EV_H
+
+#include <stdint.h>
+#include <poll.h>
+
+// Minimal event loop: file descriptors, one-shot timers, and signals,
+// all serviced from a single poll().
+
+typedef void (*ev_fd_cb)(int fd, short revents, void* arg);
+typedef void (*ev_timer_cb)(void* arg);
+typedef void (*ev_sig_cb)(int sig);
+
+uint64_t ev_now (void);
+
+// The adds return 0, or -1 if they're out of memory.
+
+int  ev_add_fd (int fd, short events, ev_fd_cb cb, void* arg);
+void ev_del_fd (int fd);
+
+// (re)arm a one-shot timer, identified by the cb+arg pair
+int  ev_timer (ev_timer_cb cb, void* arg, int ms);
+void ev_timer_cancel (ev_timer_cb cb, void* arg);
+
+// run cb from the loop (not from the signal handler) when sig arrives
+int  ev_signal (int sig, ev_sig_cb cb);
+
+// wait for and dispatch one round of events
+void ev_wait (void);
+
+#endif // PDD_EV_H
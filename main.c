@@ -38,6 +38,8 @@ MA 02111, USA.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -47,6 +49,8 @@ MA 02111, USA.
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <poll.h>
 
 #if defined(__linux__)
 #include <utmp.h>
@@ -59,6 +63,12 @@ MA 02111, USA.
 #include "constants.h"
 #include "dir_list.h"
 #include "xattr.h"
+#include "ev.h"
+#include "disk_img.h"
+#include "disk_fs.h"
+#include "disk_jnl.h"
+#include "stats.h"
+#include "capture.h"
 
 /*** config **************************************************/
 
@@ -120,7 +130,6 @@ MA 02111, USA.
 #define DEFAULT_TILDES true
 #endif
 
-
 // To mimic the original Desk-Link from Travelling Software:
 #ifndef TSDOS_ROOT_LABEL
 #define TSDOS_ROOT_LABEL   "0:    "
@@ -236,6 +245,82 @@ const char * magic_files[] = {
 #define C_CC_VMIN 1
 #define C_CC_VTIME 0
 
+// how long to wait for the trailing 0x0D of a TS-DOS DME request
+#define DME_WAIT_MS 100
+
+// client tty receive ring buffer size, must be a power of 2
+// and must hold a whole FDC write sector payload (1280)
+#ifndef RX_BUF_LEN
+#define RX_BUF_LEN 2048
+#endif
+#if RX_BUF_LEN < SECTOR_DATA_LEN || (RX_BUF_LEN & (RX_BUF_LEN-1))
+#error "RX_BUF_LEN must be a power of 2 and hold an FDC write sector payload (SECTOR_DATA_LEN)"
+#endif
+
+// client tty transmit queue size, at least 2 of the biggest response,
+// an FDC-mode sector read
+#ifndef TX_BUF_LEN
+#define TX_BUF_LEN 4096
+#endif
+#define TX_RESP_MAX SECTOR_DATA_LEN
+#if TX_BUF_LEN < 2*TX_RESP_MAX
+#error "TX_BUF_LEN must hold 2 FDC read sector responses (SECTOR_DATA_LEN)"
+#endif
+
+// at exit, how long to wait for the tty to take what's still queued
+#ifndef TX_EXIT_MS
+#define TX_EXIT_MS 2000
+#endif
+
+// readahead for files too big for the shared file data cache
+#ifndef READ_WINDOW
+#define READ_WINDOW 65536
+#endif
+
+// how long after the last client write to a disk image to write it out
+#ifndef DISK_IDLE_MS
+#define DISK_IDLE_MS 1000
+#endif
+
+// TPDD2 cache loads: records after the one loaded to get ready while the
+// client reads it out of the cache
+#ifndef CACHE_PREFETCH
+#define CACHE_PREFETCH 2
+#endif
+
+// DISK_JOURNAL: fsync the journal this long after the first unsynced
+// cache commit, or after this many, whichever comes first,
+// and checkpoint it into the image when it gets this long
+#ifndef DISK_JOURNAL_MS
+#define DISK_JOURNAL_MS 20
+#endif
+#ifndef DISK_JOURNAL_GROUP
+#define DISK_JOURNAL_GROUP 16
+#endif
+#ifndef DISK_JOURNAL_MAX
+#define DISK_JOURNAL_MAX 320
+#endif
+
+// write-behind, see WRITE_POLICY in ref/advanced_options.txt
+// none  = write() each packet before acking it
+// close = buffer, flush at close or when the buffer fills or goes idle
+// fsync = same as close, plus fsync() at close
+#define WRITE_POLICY_NONE  0
+#define WRITE_POLICY_CLOSE 1
+#define WRITE_POLICY_FSYNC 2
+#ifndef DEFAULT_WRITE_POLICY
+#define DEFAULT_WRITE_POLICY WRITE_POLICY_CLOSE
+#endif
+#ifndef WRITE_BUF_LEN
+#define WRITE_BUF_LEN 16384
+#endif
+#ifndef WRITE_IDLE_MS
+#define WRITE_IDLE_MS 2000
+#endif
+#ifndef REPLAY_MS
+#define REPLAY_MS 2000  // -R, how long to wait for a response before calling it missing
+#endif
+
 /*************************************************************/
 
 int debug = 0;
@@ -247,9 +332,13 @@ bool upcase = DEFAULT_UPCASE;
 bool tildes = DEFAULT_TILDES;
 uint8_t model = DEFAULT_MODEL;
 int BASIC_byte_us = DEFAULT_BASIC_BYTE_MS*1000;
+int write_policy = DEFAULT_WRITE_POLICY;
+bool tx_drain = false; // TX_DRAIN, tcdrain() after every write, see write_client_tty()
 
-char client_tty_name[PATH_MAX+1] = {0x00};
 char disk_img_fname[PATH_MAX+1] = {0x00};
+char convert_fname[PATH_MAX+1] = {0x00}; // -o
+char decode_fname[PATH_MAX+1] = {0x00};  // -t
+char replay_fname[PATH_MAX+1] = {0x00};  // -R
 char app_lib_dir[PATH_MAX+1] = APP_LIB_DIR;
 char share_path[2][PATH_MAX+1] = {{0},{0}};
 char dme_root_label[7] = TSDOS_ROOT_LABEL;
@@ -263,31 +352,107 @@ bool getty_mode = false;
 
 char** args;
 
-int f_open_mode = F_OPEN_NONE;
-int client_tty_fd = -1;
-int disk_img_fd = -1;
-struct termios client_termios;
-int o_file_h = -1;
-uint8_t gb[TPDD_MSG_MAX];
+DISK_IMG* disk = NULL; // disk_img_fname, once something has used it
+DISK_FS fs;            // Operation-mode files in disk, see mount_disk_image()
+bool disk_overlay = false; // keep changes to the disk image in memory
+char* disk_control = NULL; // control fifo, see disk_command()
+char* disk_library = NULL; // directory of disk images, see load_disk_library()
+char* stats_shm = NULL; // shared memory name for the stats, see stats.h
+char* capture_fname = NULL; // wire capture file, see capture.h
+bool disk_journal = false; // journal TPDD2 cache commits, see disk_committed()
+DISK_JNL disk_jnl = {.fd = -1};
+typedef struct {
+	char* path;
+	char* name;
+	DISK_IMG* d;
+} LIB_IMG;
+LIB_IMG* disk_lib = NULL;
+unsigned disk_lib_n = 0;
+int disk_lib_cur = -1; // the disk_lib[] that is disk, or -1
 char iwd[PATH_MAX+1] = {0x00};
-char cwd[PATH_MAX+1] = {0x00};
-char dme_cwd[7] = TSDOS_ROOT_LABEL;
 char bootstrap_fname[PATH_MAX+1] = {0x00};
-uint8_t in_dme = 0;
-uint8_t bank = 0;
-uint8_t ch[2] = {0xFF}; // 0x00 is a valid Operation-mode command, so init to 0xFF
-uint8_t rb[SECTOR_LEN] = {0x00}; // pdd1 disk image record buffer
-FILE_ENTRY* cur_file;
-int dir_depth=0;
-uint8_t pdd1_condition = PDD1_COND_NONE; // pdd1 condition bit flags
-uint8_t pdd2_condition = PDD2_COND_NONE; // pdd2 condition bit flags
-
-// drive cpu memory map
-uint8_t ioport[IOPORT_LEN] = {0x00}; // i/o port
-uint8_t cpuram[CPURAM_LEN] = {0x00}; // 128 bytes cpu internal ram
-uint8_t ga[GA_LEN] = {0x00};         // gate array interface
-uint8_t ram[RAM_LEN] = {0x00};       // 2k ram (pdd2 disk image record buffer)
-uint8_t rom[ROM_LEN] = {0x00};       // 4k cpu internal mask rom
+uint8_t ch[2] = {0x00}; // bootstrap line-ending state
+uint8_t rom[ROM_LEN] = {0x00}; // 4k cpu internal mask rom
+
+// One client, on one serial port. Everything that belongs to the
+// conversation with a particular client, or to the drive it thinks it's
+// talking to, lives here instead of in globals, so that one process can
+// serve several clients at once. Every request handler takes the session
+// it's working for as the first argument.
+typedef struct SESSION {
+	char client_tty_name[PATH_MAX+1];
+	unsigned id;                 // in the capture file
+	int client_tty_fd;
+	struct termios client_termios;
+
+	uint8_t gb[TPDD_MSG_MAX+3]; // +3 for fmt, len, chk around a 255-byte payload
+	uint8_t rxb[RX_BUF_LEN];     // client tty receive ring buffer
+	unsigned rx_head;            // free-running index of next byte to consume
+	unsigned rx_tail;            // free-running index of next free slot
+	unsigned rx_mark;            // rx_head at the end of the last request, see rx_taken()
+	uint8_t txb[TX_BUF_LEN];     // client tty transmit queue
+	unsigned tx_len;             // bytes waiting in txb[]
+	short tty_ev;                // what the event loop polls the tty for, 0 = not in the loop
+
+	int operation_mode;
+	int f_open_mode;
+	int o_file_h;
+	FILE_DATA* o_data;           // cached contents of o_file_h, if reading
+	off_t o_pos;                 // read position in o_data
+	uint8_t* rw;                 // else readahead window, READ_WINDOW bytes
+	unsigned rw_len;             // bytes in rw[]
+	unsigned rw_pos;             // read position in rw[]
+	uint8_t rp[TPDD_MSG_MAX+3];  // next RET_READ packet, ready to send
+	bool rp_ready;
+	uint8_t* wb;                 // write-behind buffer, WRITE_BUF_LEN bytes
+	unsigned wb_len;             // bytes in wb[]
+	uint8_t w_err;               // deferred write error for the next ret_std()
+	char o_img[TPDD_FILENAME_LEN+1]; // name of the open file, if it's in the disk image
+	uint8_t o_img_attr;
+	char cwd[PATH_MAX+1];        // path of dir_fd, for display and as a cache key
+	int dir_fd;                  // current directory, everything is relative to this
+	char dme_cwd[7];
+	uint8_t in_dme;
+	bool dme_wait;               // req_fdc() is waiting to see if a 0x0D follows
+	uint8_t bank;
+	int dir_depth;
+	FILE_CURSOR fc;              // directory list & position in it
+	FILE_ENTRY cur_fe;           // private copy of the current file entry
+	FILE_ENTRY* cur_file;        // NULL or &cur_fe
+	uint8_t pdd1_condition;      // pdd1 condition bit flags
+	uint8_t pdd2_condition;      // pdd2 condition bit flags
+
+	// request framing
+	uint8_t opr_state;
+	uint16_t opr_pos;
+	bool fdc_in_cmd;
+	uint8_t fdc_c;
+	uint8_t fdc_i;
+
+	// FDC-mode request in progress, see fdc_wait()
+	void (*fdc_resume)(struct SESSION* s);
+	unsigned fdc_need;
+	int fdc_p;
+	int fdc_l;
+	uint16_t fdc_len;
+
+	uint8_t rb[SECTOR_LEN];      // pdd1 disk image record buffer
+
+	// drive cpu memory map
+	uint8_t ioport[IOPORT_LEN];  // i/o port
+	uint8_t cpuram[CPURAM_LEN];  // 128 bytes cpu internal ram
+	uint8_t ga[GA_LEN];          // gate array interface
+	uint8_t ram[RAM_LEN];        // 2k ram (pdd2 disk image record buffer)
+	int pf_next;                 // record to prefetch from at the next mem_read, or -1
+	int pf_lo, pf_hi;            // records prefetched last time, pf_lo to pf_hi-1
+} SESSION;
+
+#ifndef SESSIONS_MAX
+#define SESSIONS_MAX 16
+#endif
+SESSION* sessions[SESSIONS_MAX] = {NULL};
+int nsessions = 0;
+int share_fd[2] = {-1,-1}; // share_path[] held open
 
 // client compatibility settings
 #define PROFILE_ID_LEN 8
@@ -649,6 +814,7 @@ void show_diskimage_help(int e) {
 		"Usage:\n"
 		" -i filename    use disk image file <filename>\n"
 		" -v -i          more help about disk images\n"
+		" -i in -o out   convert between raw and packed (*" IMG_PACK_SUFFIX ") images\n"
 		"\n"
 	);
 	dbg(1,
@@ -662,10 +828,18 @@ void show_diskimage_help(int e) {
 		"(such as a new empty file with an arbitrary name that you want created),\n"
 		"then use \"-m 1\" or \"-m 2\" to specify tpdd1 or tpdd2.\n"
 		"\n"
+		"A packed image (" IMG_PACK_SUFFIX ") stores each distinct record once,\n"
+		"compressed, and can be used anywhere a raw image can. The model is\n"
+		"read from its header. A new file named *" IMG_PACK_SUFFIX " is created packed.\n"
+		"\n"
 		"If filename does not exist, or exists but is zero bytes, then the file\n"
 		"will be created and filled with a new blank formatted disk image,\n"
 		"if and when the client issues a format command.\n"
 		"\n"
+		"While a disk image is in use, the Operation-mode file commands (list,\n"
+		"open, read, write, delete, rename) use the files in the disk image,\n"
+		"like a real drive, and the share directory is not used.\n"
+		"\n"
 		"Disk images may be dumped from / restored to physical disks using\n"
 		"the appropriate model real drive and https://github.com/bkw777/pdd.sh\n"
 		"\n"
@@ -687,6 +861,7 @@ void show_diskimage_help(int e) {
 		"Examples:\n"
 		"	%1$s -v -i Sardine_American_English.pdd1\n"
 		"	%1$s -v -i ./my_new_disk.pdd2\n"
+		"	%1$s -i my_disk.pdd1 -o my_disk.pddz\n"
 		"\n"
 	,args[0]);
 
@@ -773,15 +948,19 @@ void load_profile (const char* s) {
 
 }
 
-void update_cwd () {
-	memset(cwd,0x00,PATH_MAX);
-	(void)!getcwd(cwd,PATH_MAX);
+// Make fd the session's current directory. The share root fds are shared
+// by all sessions and stay open, any other directory fd belongs to the
+// session and is closed when it leaves.
+void set_dir (SESSION* s, int fd) {
+	if (s->dir_fd!=fd && s->dir_fd>=0 && s->dir_fd!=share_fd[0] && s->dir_fd!=share_fd[1]) close(s->dir_fd);
+	s->dir_fd = fd;
+	if (fd<0) return;
 
 	// if the current directory is not writable, set the write-protected disk flag
 	uint8_t wp = 0;
-	if (access(cwd,W_OK|X_OK)) wp = 1;
-	pdd1_condition |= wp << PDD1_COND_BIT_WPROT;
-	pdd2_condition |= wp << PDD2_COND_BIT_WPROT;
+	if (faccessat(fd,".",W_OK|X_OK,0)) wp = 1;
+	s->pdd1_condition |= wp << PDD1_COND_BIT_WPROT;
+	s->pdd2_condition |= wp << PDD2_COND_BIT_WPROT;
 }
 
 void add_share_path (char* s) {
@@ -791,11 +970,12 @@ void add_share_path (char* s) {
 	dbg(2,"Discarded excess share path \"%s\"\n",s);
 }
 
-void cd_share_path () {
-	if (!share_path[bank][0]) return;
-	if (!strncmp(cwd,share_path[bank],PATH_MAX)) return;
-	if (chdir(share_path[bank])) dbg(0,"FAILED CD TO \"%s\"\n",share_path[bank]);
-	update_cwd();
+// TPDD2 bank switch
+void cd_share_path (SESSION* s) {
+	if (share_fd[s->bank]<0) return;
+	if (s->dir_fd==share_fd[s->bank]) return;
+	set_dir(s,share_fd[s->bank]);
+	strcpy(s->cwd,share_path[s->bank]);
 }
 
 // find file f either directly or in app_lib_dir
@@ -851,7 +1031,12 @@ int set_disk_img_fname (char* f) {
 	// t has now possibly been re-written with the path to a bundled file,
 	// or not, and still may or may not exist
 	struct stat info;
-	if (!stat(t, &info) && info.st_size>0) {
+	int pm;
+	if ((pm = img_probe(t))) {
+		// a packed image says what it is
+		dbg(1,"Loading packed disk image file \"%s\"\n",t);
+		model = pm;
+	} else if (!stat(t, &info) && info.st_size>0) {
 		// if file exists and >0 bytes
 		dbg(1,"Loading disk image file \"%s\"\n",t);
 
@@ -897,7 +1082,7 @@ int set_disk_img_fname (char* f) {
 }
 
 // search for TTY(s) matching TTY_PREFIX
-void find_ttys (char* f) {
+void find_ttys (SESSION* s, char* f) {
 	dbg(3,"%s(%s)\n",__func__,f);
 
 	// open /dev
@@ -942,38 +1127,38 @@ void find_ttys (char* f) {
 	}
 
 	// set client_tty_name[] with the final result
-	client_tty_name[0]=0x00;
+	s->client_tty_name[0]=0x00;
 	if (i) {
-		strcpy(client_tty_name,path);
-		strcat(client_tty_name,ttys[i]);
+		strcpy(s->client_tty_name,path);
+		strcat(s->client_tty_name,ttys[i]);
 	}
 
 	free(ttys);
 }
 
 // take the user-supplied tty arg and figure out the actual /dev/ttyfoo
-void resolve_client_tty_name () {
+void resolve_client_tty_name (SESSION* s) {
 	dbg(3,"%s()\n",__func__);
-	switch (client_tty_name[0]) {
+	switch (s->client_tty_name[0]) {
 		case 0x00:
 			// nothing supplied, scan for any ttys matching the default prefix
-			find_ttys(TTY_PREFIX);
+			find_ttys(s,TTY_PREFIX);
 			break;
 		case '-':
 			// stdin/stdout mode, silence all messages - untested
 			debug = -1;
-			strcpy (client_tty_name,"/dev/tty");
-			client_tty_fd=1;
+			strcpy (s->client_tty_name,"/dev/tty");
+			s->client_tty_fd=1;
 			break;
 		default:
 			// something given, try with and without prepending /dev/
-			if (!access(client_tty_name,F_OK)) break;
+			if (!access(s->client_tty_name,F_OK)) break;
 			char t[PATH_MAX+1]={0x00};
 			int i = 0;
-			strcpy(t,client_tty_name);
-			strcpy(client_tty_name,"/dev/");
-			if (!strncmp(client_tty_name,t,5)) i=5;
-			strcat(client_tty_name,t+i);
+			strcpy(t,s->client_tty_name);
+			strcpy(s->client_tty_name,"/dev/");
+			if (!strncmp(s->client_tty_name,t,5)) i=5;
+			strcat(s->client_tty_name,t+i);
 	}
 }
 
@@ -981,47 +1166,47 @@ void resolve_client_tty_name () {
 // >=0 set the value explicitly
 // -1 set app default
 // -2 set app default if currently different
-void client_tty_vmt(int m,int t) {
-	if (m<-1 || t<-1) tcgetattr(client_tty_fd,&client_termios);
+void client_tty_vmt(SESSION* s, int m,int t) {
+	if (m<-1 || t<-1) tcgetattr(s->client_tty_fd,&s->client_termios);
 	if (m<0) m = C_CC_VMIN;
 	if (t<0) t = C_CC_VTIME;
-	if (client_termios.c_cc[VMIN] == m && client_termios.c_cc[VTIME] == t) return;
-	client_termios.c_cc[VMIN] = m;
-	client_termios.c_cc[VTIME] = t;
-	tcsetattr(client_tty_fd,TCSANOW,&client_termios);
+	if (s->client_termios.c_cc[VMIN] == m && s->client_termios.c_cc[VTIME] == t) return;
+	s->client_termios.c_cc[VMIN] = m;
+	s->client_termios.c_cc[VTIME] = t;
+	tcsetattr(s->client_tty_fd,TCSANOW,&s->client_termios);
 }
 
-void show_tty_settings() {
+void show_tty_settings(SESSION* s) {
 	if (debug<2) return;
-	tcgetattr(client_tty_fd,&client_termios);
-	dbg(0,"BAUD %u\n",baudtoi(cfgetispeed(&client_termios)));
-	dbg(0,"CRTSCTS %u\n",(client_termios.c_cflag & CRTSCTS) != 0 );
-	dbg(0,"IXON %u\n",(client_termios.c_iflag & IXON) != 0 );
-	dbg(0,"IXOFF %u\n",(client_termios.c_iflag & IXOFF) != 0 );
-	dbg(0,"IXANY %u\n",(client_termios.c_iflag & IXANY) != 0 );
-	dbg(0,"XON 0x%02X\n",client_termios.c_cc[VSTART]);
-	dbg(0,"XOFF 0x%02X\n",client_termios.c_cc[VSTOP]);
-	dbg(0,"VMIN %u\n",client_termios.c_cc[VMIN]);
-	dbg(0,"VTIME %u\n",client_termios.c_cc[VTIME]);
-}
-
-int open_client_tty () {
+	tcgetattr(s->client_tty_fd,&s->client_termios);
+	dbg(0,"BAUD %u\n",baudtoi(cfgetispeed(&s->client_termios)));
+	dbg(0,"CRTSCTS %u\n",(s->client_termios.c_cflag & CRTSCTS) != 0 );
+	dbg(0,"IXON %u\n",(s->client_termios.c_iflag & IXON) != 0 );
+	dbg(0,"IXOFF %u\n",(s->client_termios.c_iflag & IXOFF) != 0 );
+	dbg(0,"IXANY %u\n",(s->client_termios.c_iflag & IXANY) != 0 );
+	dbg(0,"XON 0x%02X\n",s->client_termios.c_cc[VSTART]);
+	dbg(0,"XOFF 0x%02X\n",s->client_termios.c_cc[VSTOP]);
+	dbg(0,"VMIN %u\n",s->client_termios.c_cc[VMIN]);
+	dbg(0,"VTIME %u\n",s->client_termios.c_cc[VTIME]);
+}
+
+int open_client_tty (SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 
-	if (!client_tty_name[0]) {
+	if (!s->client_tty_name[0]) {
 		show_main_help();
 		dbg(0,"Error: No serial device specified\n(searched: /dev/%s*)\n",TTY_PREFIX);
 		return 1;
 	}
 
-	dbg(0,"Opening \"%s\" ... ",client_tty_name);
-	// open with O_NONBLOCK to avoid hang if client not ready, then unset later.
-	if (client_tty_fd<0) client_tty_fd=open((char *)client_tty_name,O_RDWR|O_NOCTTY|O_NONBLOCK);
-	if (client_tty_fd<0) { dbg(0,"%s\n",strerror(errno)); return 1; }
+	dbg(0,"Opening \"%s\" ... ",s->client_tty_name);
+	// O_NONBLOCK to avoid hang if client not ready, and for good, see flush_client_tx()
+	if (s->client_tty_fd<0) s->client_tty_fd=open((char *)s->client_tty_name,O_RDWR|O_NOCTTY|O_NONBLOCK);
+	if (s->client_tty_fd<0) { dbg(0,"%s\n",strerror(errno)); return 1; }
 	dbg(0,"OK\n");
 
 #ifdef TIOCEXCL
-	ioctl(client_tty_fd,TIOCEXCL);
+	ioctl(s->client_tty_fd,TIOCEXCL);
 //#else
 //  #include <sys/file.h>
 //	if (flock(client_tty_fd,LOCK_EX|LOCK_NB) == -1) dbg(0,"Failed to get exclusive lock on tty.");
@@ -1031,69 +1216,200 @@ int open_client_tty () {
 #if !defined(_WIN)
 	if (getty_mode) {
 		debug = -1;
-		if (!login_tty(client_tty_fd)) client_tty_fd = STDIN_FILENO;
+		if (!login_tty(s->client_tty_fd)) s->client_tty_fd = STDIN_FILENO;
 		else (void)!daemon(1,1);
 	}
 #endif
 
-	(void)!tcflush(client_tty_fd, TCIOFLUSH);
+	(void)!tcflush(s->client_tty_fd, TCIOFLUSH);
 
-	if (tcgetattr(client_tty_fd,&client_termios)==-1) return 21;
+	if (tcgetattr(s->client_tty_fd,&s->client_termios)==-1) return 21;
 
-	cfmakeraw(&client_termios);
+	cfmakeraw(&s->client_termios);
 
-	// unset O_NONBLOCK
-	fcntl(client_tty_fd, F_SETFL, fcntl(client_tty_fd, F_GETFL, NULL) & ~O_NONBLOCK);
+	// stdin/stdout and getty mode didn't come from the open() above
+	fcntl(s->client_tty_fd, F_SETFL, fcntl(s->client_tty_fd, F_GETFL, NULL) | O_NONBLOCK);
 
-	if (cfsetspeed(&client_termios,itobaud(baud))==-1) return 22;
+	if (cfsetspeed(&s->client_termios,itobaud(baud))==-1) return 22;
 
-	client_termios.c_iflag &= ~IXANY; // disable IXANY in all cases
-	if (xonoff) client_termios.c_iflag |= (IXON|IXOFF); // do not include IXANY
-	else client_termios.c_iflag &= ~(IXON|IXOFF);
+	s->client_termios.c_iflag &= ~IXANY; // disable IXANY in all cases
+	if (xonoff) s->client_termios.c_iflag |= (IXON|IXOFF); // do not include IXANY
+	else s->client_termios.c_iflag &= ~(IXON|IXOFF);
 
-	if (rtscts) client_termios.c_cflag |= CRTSCTS;
-	else client_termios.c_cflag &= ~CRTSCTS;
+	if (rtscts) s->client_termios.c_cflag |= CRTSCTS;
+	else s->client_termios.c_cflag &= ~CRTSCTS;
 
-	client_termios.c_cflag |= (CREAD|CLOCAL);
-	client_termios.c_cflag &= ~PARENB;
-	client_termios.c_cflag &= ~CSTOPB;
-	client_termios.c_cflag &= ~CSIZE;
-	client_termios.c_cflag |= CS8;
+	s->client_termios.c_cflag |= (CREAD|CLOCAL);
+	s->client_termios.c_cflag &= ~PARENB;
+	s->client_termios.c_cflag &= ~CSTOPB;
+	s->client_termios.c_cflag &= ~CSIZE;
+	s->client_termios.c_cflag |= CS8;
 
-	if (tcsetattr(client_tty_fd,TCSANOW,&client_termios)==-1) return 23;
+	if (tcsetattr(s->client_tty_fd,TCSANOW,&s->client_termios)==-1) return 23;
+	stats_baud(baudtoi(cfgetospeed(&s->client_termios)));
+	capture_note(s->id,"open %s baud %u model %d mode %s profile %s",s->client_tty_name,baud,model,s->operation_mode==MODE_FDC?"fdc":"opr",profile);
 
-	client_tty_vmt(-2,-2);
+	client_tty_vmt(s,-2,-2);
 
 	//show_tty_settings();
 
 	return 0;
 }
 
-
 // reference
 // if (something) tcflow(client_tty_fd,TCOOFF);  //stop sending
 // else tcflow(client_tty_fd,TCOON);   //start sending
 
-int write_client_tty(void* b, int n) {
+// Responses are queued in txb[] and handed to the kernel by
+// flush_client_tx() without waiting for the uart to shift them out.
+// The queue is flushed after every batch of requests, so the client has
+// the whole response by the time we wait for its next request.
+//
+// The tty is O_NONBLOCK, so a client that's holding us off with flow
+// control, or a slow uart, never stops the loop. Whatever the kernel won't
+// take right now stays in txb[], and the session waits for POLLOUT instead
+// of POLLIN, so it takes no more requests until the tty has caught up.
+// Other sessions carry on meanwhile.
+//
+// drain_client_tty() also waits for the bytes to physically leave the
+// port. Only bootstrap needs that, to pace the bytes and before it closes
+// the tty, and it has the tty and the process to itself. Everything in
+// the loop goes out in order through the queue. TX_DRAIN=true puts back
+// the old way, a tcdrain() after every write, to compare with in make bench.
+
+void client_tty_event(int fd, short revents, void* arg);
+
+// poll the tty for room in the kernel if the queue is stuck, else requests
+void client_tty_watch(SESSION* s) {
+	short e = s->tx_len ? POLLOUT : POLLIN;
+	if (!s->tty_ev || s->tty_ev==e) return;
+	if (ev_add_fd(s->client_tty_fd,e,client_tty_event,s)) { dbg(0,"%s: %s\n",s->client_tty_name,strerror(errno)); return; }
+	s->tty_ev = e;
+}
+
+// Hand as much of txb[] to the kernel as it will take. Returns the number
+// of bytes written, and leaves the rest queued.
+int flush_client_tx(SESSION* s) {
+	uint64_t t0 = stats_now();
+	unsigned t = 0;
+	int n;
+	while (t<s->tx_len) {
+		n = write(s->client_tty_fd,s->txb+t,s->tx_len-t);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			if (errno==EAGAIN || errno==EWOULDBLOCK) break;
+			dbg(0,"error: %s\n",strerror(errno));
+			s->tx_len = t; // the rest is lost
+			break;
+		}
+		t += n;
+	}
+	stats_serial(stats_now()-t0);
+	if (capturing && t) capture_put(CAP_TX,s->id,s->txb,t,NULL,0);
+	s->tx_len -= t;
+	if (s->tx_len) memmove(s->txb,s->txb+t,s->tx_len);
+	client_tty_watch(s);
+	return t;
+}
+
+// Wait until the queue has room for n more bytes, or ms (<0 = forever)
+// goes by with the tty taking nothing. n = TX_BUF_LEN waits for it to
+// empty. Blocks, so only for bootstrap and exit.
+bool wait_client_tx(SESSION* s, unsigned n, int ms) {
+	struct pollfd p = { .fd = s->client_tty_fd, .events = POLLOUT };
+	if (s->tx_len+n>TX_BUF_LEN) flush_client_tx(s);
+	while (s->tx_len+n>TX_BUF_LEN && poll(&p,1,ms)>0 && !(p.revents&(POLLERR|POLLHUP|POLLNVAL))) flush_client_tx(s);
+	return s->tx_len+n<=TX_BUF_LEN;
+}
+
+void drain_client_tty(SESSION* s) {
+	wait_client_tx(s,TX_BUF_LEN,-1);
+	uint64_t t0 = stats_now();
+	tcdrain(s->client_tty_fd);
+	stats_serial(stats_now()-t0);
+}
+
+// Queue n bytes for the client. In the loop, process_client_rx() keeps
+// room for a whole response, so only bootstrap ever waits here.
+int write_client_tty(SESSION* s, void* b, int n) {
 	dbg(4,"%s(%u)\n",__func__,n);
 	dbg(3,"SEND: "); dbg_b(3,b,n);
-	n = write(client_tty_fd,b,n);
-	tcdrain(client_tty_fd);
+	if (n>TX_BUF_LEN) n = TX_BUF_LEN;
+	if (!wait_client_tx(s,n,-1)) return -1;
+	memcpy(s->txb+s->tx_len,b,n);
+	s->tx_len += n;
+	stats_sent(n);
+	if (tx_drain) drain_client_tty(s);
+	return n;
+}
+
+// Everything received from the client goes through the rx ring.
+// fill_client_rx() drains whatever the tty has available in a single
+// readv(), and consumers take bytes from the ring, so a whole packet
+// (or several) usually costs one syscall instead of one per byte.
+unsigned rx_avail(SESSION* s) {
+	return s->rx_tail - s->rx_head;
+}
+
+// bytes consumed since the last time, which is what the request just
+// handled took from the client, for the stats line model
+unsigned rx_taken(SESSION* s) {
+	unsigned n = s->rx_head - s->rx_mark;
+	s->rx_mark = s->rx_head;
 	return n;
 }
 
-// It is correct that this blocks and waits forever.
-// The one time we don't want to block, we don't use this.
-int read_client_tty(void* b, const unsigned int n) {
+// next byte in the ring without consuming it, -1 if empty
+int rx_peek(SESSION* s) {
+	if (!rx_avail(s)) return -1;
+	return s->rxb[s->rx_head&(RX_BUF_LEN-1)];
+}
+
+// next byte in the ring, -1 if empty
+int rx_getc(SESSION* s) {
+	if (!rx_avail(s)) return -1;
+	return s->rxb[s->rx_head++&(RX_BUF_LEN-1)];
+}
+
+// Called when poll() says the tty is readable, so this doesn't block.
+// Returns the number of bytes added to the ring, 0 if there were none,
+// or -1 on error.
+int fill_client_rx(SESSION* s) {
+	unsigned f = RX_BUF_LEN - rx_avail(s);
+	unsigned t = s->rx_tail&(RX_BUF_LEN-1);
+	struct iovec v[2];
+	int i, n;
+
+	if (!f) return 0;
+	v[0].iov_base = s->rxb+t;
+	v[0].iov_len = (t+f>RX_BUF_LEN) ? RX_BUF_LEN-t : f;
+	v[1].iov_base = s->rxb;
+	v[1].iov_len = f - v[0].iov_len;
+
+	while ((n = readv(s->client_tty_fd, v, v[1].iov_len?2:1))<0 && errno==EINTR);
+	if (n<0) {
+		if (errno==EAGAIN || errno==EWOULDBLOCK) return 0; // O_NONBLOCK, nothing there after all
+		dbg(0,"%s: %s\n",s->client_tty_name,strerror(errno));
+		return n;
+	}
+
+	if (debug>2 && n) {
+		dbg(3,"RCVD: ");
+		for (i=0;i<n;i++) dbg(3,"%02X ",s->rxb[(t+i)&(RX_BUF_LEN-1)]);
+		dbg(3,"\n");
+	}
+
+	if (capturing && n) capture_put(CAP_RX,s->id,v[0].iov_base,n<v[0].iov_len?n:v[0].iov_len,v[1].iov_base,n<v[0].iov_len?0:n-v[0].iov_len);
+	s->rx_tail += n;
+	return n;
+}
+
+// Take n bytes out of the rx ring.
+// This never waits. Callers only ask for bytes that have already arrived.
+int read_client_tty(SESSION* s, void* b, const unsigned int n) {
 	dbg(4,"%s(%u)\n",__func__,n);
 	unsigned t = 0;
-	int i = 0;
-	while (t<n) if ((i = read(client_tty_fd, b+t, n-t))) t+=i;
-	if (i<0) {
-		dbg(0,"error: %s\n",strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	dbg(3,"RCVD: "); dbg_b(3,b,n);
+	while (t<n && rx_avail(s)) ((uint8_t*)b)[t++] = rx_getc(s);
 	return t;
 }
 
@@ -1125,7 +1441,7 @@ void dcat(char* f) {
  * ignore everything after b[1+len]
  */
 uint8_t checksum(unsigned char* b) {
-	uint16_t s=0; uint8_t i, l=2+b[1];
+	uint16_t s=0, i, l=2+b[1];
 	for (i=0;i<l;i++) s+=b[i];
 	return ~(s&0xFF);
 }
@@ -1187,61 +1503,280 @@ void load_rom(char* f) {
 
 // standard fdc-mode 8-byte response
 // e = error code ERR_FDC_* -> ascii hex pair
-// s = status or data       -> ascii hex pair
+// d = status or data       -> ascii hex pair
 // l = length or address    -> 2 ascii hex pairs
 // TODO - don't assume endianness
-void ret_fdc_std(uint8_t e, uint8_t s, uint16_t l) {
+void ret_fdc_std(SESSION* s, uint8_t e, uint8_t d, uint16_t l) {
 	dbg(2,"%s()\n",__func__);
 	char b[9] = { 0x00 };
-	snprintf(b,9,"%02X%02X%04X",e,s,l);
+	snprintf(b,9,"%02X%02X%04X",e,d,l);
 	dbg(2,"FDC: response: \"%s\"\n",b);
-	write_client_tty(b,8);
+	write_client_tty(s,b,8);
 }
 
-// p   : physical sector to seek to
-// m   : mode read-only / write-only / read-write
-int open_disk_image (int p, int m) {
-	dbg(2,"%s(%d,%d)\n",__func__,p,m);
-	int of; int e=ERR_FDC_SUCCESS;
+void disk_idle_timeout(void* arg);
+void journal_timeout(void* arg);
 
-	if (!*disk_img_fname) e=ERR_FDC_NO_DISK;
+// img_rec() on the current disk, timed as image I/O
+uint8_t* disk_rec(unsigned rn, bool w) {
+	uint64_t t0 = stats_now();
+	uint8_t* r = img_rec(disk,rn,w);
+	stats_image(t0);
+	return r;
+}
+
+// Write the disk image changes out to the file.
+// With a journal, that's a checkpoint.
+void disk_sync(void) {
+	bool jnl = disk && disk_jnl.d==disk;
+	int e;
+	// a checkpoint is still due if the image was synced some other way
+	if (!disk || (!disk->ndirty && !(jnl && disk_jnl.n))) return;
+	ev_timer_cancel(disk_idle_timeout,NULL);
+	unsigned n = disk->ndirty;
+	uint64_t t0 = stats_now();
+	if (jnl) {
+		ev_timer_cancel(journal_timeout,NULL);
+		e = jnl_checkpoint(&disk_jnl);
+	} else e = img_sync(disk);
+	stats_image(t0);
+	if (e) {
+		dbg(0,"%s: %s%s\n",disk_img_fname,jnl?"checkpoint: ":"",strerror(errno));
+		// whatever didn't make it is still dirty, and still in the
+		// journal, try again later
+		if (ev_timer(disk_idle_timeout,NULL,DISK_IDLE_MS)) dbg(0,"Disk image: can't retry: %s\n",strerror(errno));
+		return;
+	}
+	dbg(2,"Disk image: %u records written out, %lu writes saved so far\n",n,disk->wrote-disk->writes);
+}
 
-	if (!e) switch (m) {
-		case O_RDWR: of=O_RDWR; dbg(2,"edit rw\n");
-			if (access(disk_img_fname,W_OK)) e=ERR_FDC_WRITE_PROTECT;
+void journal_timeout(void* arg) {
+	(void)arg;
+	uint64_t t0 = stats_now();
+	int e = jnl_flush(&disk_jnl);
+	stats_image(t0);
+	if (e) dbg(0,"%s: %s\n",disk_jnl.path,strerror(errno));
+}
+
+void disk_idle_timeout(void* arg) {
+	(void)arg;
+	dbg(3,"%s()\n",__func__);
+	disk_sync();
+}
+
+// A client write went into the disk image. Rather than hitting the file
+// for every logical sector, it goes out when the client goes quiet,
+// or sooner on a mode switch, format, disk change, or exit.
+void disk_wrote(unsigned rn, unsigned off, unsigned len) {
+	img_wrote(disk,rn,off,len);
+	// a replay of older commits must not land on top of this
+	if (disk_jnl.d==disk && disk_jnl.n) { disk_sync(); return; }
+	if (ev_timer(disk_idle_timeout,NULL,DISK_IDLE_MS)) disk_sync(); // no timer, write it now
+}
+
+// A TPDD2 cache commit went into the disk image. With DISK_JOURNAL it
+// goes into the journal too, and is on the disk within DISK_JOURNAL_MS,
+// with one fsync for the whole group. The image catches up at idle.
+void disk_committed(unsigned rn) {
+	if (disk_jnl.d!=disk) { disk_wrote(rn,0,SECTOR_LEN); return; }
+	img_wrote(disk,rn,0,SECTOR_LEN);
+	uint64_t t0 = stats_now();
+	int e = jnl_append(&disk_jnl,rn);
+	stats_image(t0);
+	if (e) {
+		dbg(0,"%s: %s\n",disk_jnl.path,strerror(errno));
+		disk_sync();
+		return;
+	}
+	if (disk_jnl.pending>=DISK_JOURNAL_GROUP) journal_timeout(NULL);
+	else if (disk_jnl.pending==1 && ev_timer(journal_timeout,NULL,DISK_JOURNAL_MS)) journal_timeout(NULL);
+	if (disk_jnl.n>=DISK_JOURNAL_MAX || ev_timer(disk_idle_timeout,NULL,DISK_IDLE_MS)) disk_sync();
+}
+
+void journal_close(void) {
+	if (!disk_jnl.d) return;
+	ev_timer_cancel(journal_timeout,NULL);
+	dbg(2,"Disk journal: %lu commits in %lu fsyncs\n",disk_jnl.appends,disk_jnl.syncs);
+	jnl_close(&disk_jnl);
+}
+
+// -o: write the -i image to another file and exit,
+// packed if the name ends in IMG_PACK_SUFFIX, else raw
+int convert_disk_image (char* f) {
+	size_t l = strlen(f), sl = strlen(IMG_PACK_SUFFIX);
+	bool p = l>=sl && !strcasecmp(f+l-sl,IMG_PACK_SUFFIX);
+	struct stat st;
+	DISK_IMG* d;
+	int e = 0;
+
+	if (!*disk_img_fname) { dbg(0,"-o needs a disk image, -i\n"); return 1; }
+	// overlay = opened read-only
+	if (!(d = img_open(disk_img_fname,model==1?PDD1_TRACKS*PDD1_SECTORS:PDD2_TRACKS*PDD2_SECTORS,false,true))) {
+		dbg(0,"%s: %s\n",disk_img_fname,strerror(errno));
+		return 1;
+	}
+	if (img_save(d,f,p)) { dbg(0,"%s: %s\n",f,strerror(errno)); e = 1; }
+	else if (!stat(f,&st)) dbg(0,"\"%s\" -> \"%s\" (%s, %lld bytes)\n",disk_img_fname,f,p?"packed":"raw",(long long)st.st_size);
+	img_close(d);
+	return e;
+}
+
+// -t: print a CAPTURE file, Operation-mode packets the same as dbg_p()
+// Bytes are collected per session and direction until they make a whole
+// packet. FDC-mode traffic, and anything that doesn't parse, is dumped as is.
+typedef struct {
+	uint8_t b[CAP_REC_MAX+TPDD_MSG_MAX+8];
+	unsigned n;
+} CAP_PART;
+
+void decode_capture_bytes(CAP_PART* p, bool rx, bool fdc) {
+	unsigned i = 0, l;
+	while (i<p->n) {
+		uint8_t* b = p->b+i;
+		unsigned n = p->n-i;
+		if (fdc) {
+			bool t = true;
+			for (l=0;l<n;l++) if (!isprint(b[l]) && b[l]!=FDC_CMD_EOL) t = false;
+			if (t) { for (l=0;l<n;l++) dbg(0,"%c",b[l]==FDC_CMD_EOL?'\n':b[l]); if (b[n-1]!=FDC_CMD_EOL) dbg(0,"\n"); }
+			else dbg_b(0,b,n);
+			i = p->n;
 			break;
-		case O_WRONLY: of=O_WRONLY;
-			if (access(disk_img_fname,F_OK)) { of|=O_CREAT; dbg(2,"create\n");} else {
-				dbg(2,"edit wo\n");
-				if (access(disk_img_fname,W_OK)) e=ERR_FDC_WRITE_PROTECT;
+		}
+		if (rx) {
+			// request: ZZ fmt len data chk
+			for (l=0;l+1<n && (b[l]!=0x5A || b[l+1]!=0x5A);l++);
+			if (l+1>=n && b[n-1]!=0x5A) l = n; // no ZZ, but keep a last Z
+			if (l) {
+				dbg(0,"raw: "); dbg_b(0,b,l);
+				i += l;
+				continue;
 			}
-			break;
-		default: of=O_RDONLY; dbg(2,"read\n"); break;
+			if (n<4 || n<5u+b[3]) break;
+			dbg_p(0,b+2);
+			if (checksum(b+2)!=b[4+b[3]]) dbg(0,"bad checksum\n");
+			i += 5+b[3];
+		} else {
+			// response: fmt len data chk
+			if (n<2 || n<3u+b[1]) break;
+			if (checksum(b)!=b[2+b[1]]) { dbg(0,"raw: "); dbg_b(0,b,n); i = p->n; break; }
+			dbg_p(0,b);
+			i += 3+b[1];
+		}
+	}
+	// keep a partial packet for the next record, unless it can't be one
+	p->n -= i;
+	if (p->n>TPDD_MSG_MAX+5) { dbg(0,"raw: "); dbg_b(0,p->b+i,p->n); p->n = 0; }
+	memmove(p->b,p->b+i,p->n);
+}
+
+int decode_capture (char* f) {
+	CAP_REC* r = malloc(sizeof(CAP_REC));
+	CAP_PART* p = calloc(256*2,sizeof(CAP_PART));
+	bool fdc[256] = {false};
+	uint64_t t0 = 0;
+	FILE* fp;
+	int e;
+
+	if (!r || !p) return 1;
+	if (!(fp = capture_read_open(f))) { dbg(0,"%s: %s\n",f,strerror(errno)); return 1; }
+	while ((e = capture_read(fp,r))>0) {
+		if (!t0) t0 = r->ns;
+		dbg(0,"%llu.%06llu %u ",(unsigned long long)(r->ns-t0)/1000000000u,(unsigned long long)(r->ns-t0)/1000%1000000,r->sess);
+		switch (r->type) {
+			case CAP_NOTE:
+				dbg(0,"%s\n",r->data);
+				if (strstr((char*)r->data,"mode fdc")) fdc[r->sess] = true;
+				if (strstr((char*)r->data,"mode opr")) fdc[r->sess] = false;
+				break;
+			case CAP_RX:
+			case CAP_TX: {
+				CAP_PART* q = p+r->sess*2+r->type;
+				dbg(0,"%s %u\n",r->type==CAP_RX?"RX":"TX",r->len);
+				memcpy(q->b+q->n,r->data,r->len);
+				q->n += r->len;
+				decode_capture_bytes(q,r->type==CAP_RX,fdc[r->sess]);
+				break;
+			}
+			default: dbg(0,"unknown record type %u\n",r->type);
+		}
+	}
+	if (e<0) dbg(0,"%s: truncated\n",f);
+	fclose(fp);
+	free(p);
+	free(r);
+	return e<0;
+}
+
+// Make sure the disk image is loaded and usable for m, then the records
+// are reached with disk_rec(...).
+// m   : mode read-only / write-only / read-write
+// write-only (format, cache commit) creates the image if it doesn't exist
+int open_disk_image (SESSION* s, int m) {
+	dbg(2,"%s(%d)\n",__func__,m);
+	int e=ERR_FDC_SUCCESS;
+	uint64_t t0 = stats_now();
+
+	if (!*disk_img_fname) e=ERR_FDC_NO_DISK;
+
+	if (!e && disk && img_changed(disk)) {
+		dbg(1,"Disk image file changed, reloading\n");
+		ev_timer_cancel(disk_idle_timeout,NULL);
+		if (disk_jnl.d==disk) journal_close();
+		img_close(disk);
+		disk = NULL;
 	}
 
-	if (!e) {
-		disk_img_fd=open(disk_img_fname,of|O_EXCL,0666);
-		if (disk_img_fd<0) { dbg(0,"%s\n",strerror(errno)) ;e=ERR_FDC_READ;}
+	if (!e && !disk) {
+		disk = img_open(disk_img_fname,model==1?PDD1_TRACKS*PDD1_SECTORS:PDD2_TRACKS*PDD2_SECTORS,m==O_WRONLY,disk_overlay);
+		if (!disk) {
+			dbg(0,"%s: %s\n",disk_img_fname,strerror(errno));
+			e = (m==O_RDWR && errno==ENOENT) ? ERR_FDC_WRITE_PROTECT : ERR_FDC_READ;
+		} else dbg(2,"%s \"%s\"\n",disk->mapped?"mapped":disk->packed?"opened packed":"loaded",disk_img_fname);
+		if (disk_lib_cur>=0) disk_lib[disk_lib_cur].d = disk;
 	}
 
-	if (!e) {
-		int s = (p*SECTOR_LEN); // initial seek position to start of physical sector
-		if (lseek(disk_img_fd,s,SEEK_SET)!=s) e=ERR_FDC_READ;
+	// replay anything left from a crash before the first look at the disk
+	if (!e && disk_journal && model==2 && disk_jnl.d!=disk && !disk->overlay && !disk->ro) {
+		int n;
+		journal_close();
+		if ((n = jnl_open(&disk_jnl,disk))<0) dbg(0,"%s.jnl: %s\n",disk_img_fname,strerror(errno));
+		else if (n) dbg(0,"Disk journal: %d records replayed into \"%s\"\n",n,disk_img_fname);
 	}
 
-	if (operation_mode) switch (e) {
+	if (!e && m!=O_RDONLY && disk->ro) e=ERR_FDC_WRITE_PROTECT;
+
+	if (s->operation_mode) switch (e) {
 		//case ERR_FDC_SUCCESS: e=ERR_SUCCESS; break; // same
 		case ERR_FDC_NO_DISK: e=ERR_NO_DISK; break;
 		case ERR_FDC_WRITE_PROTECT: e=ERR_WRITE_PROTECT; break;
 		case ERR_FDC_READ: e=ERR_READ_TIMEOUT; break;
 	}
 
+	stats_image(t0);
+	return e;
+}
+
+// With -i, the Operation-mode files are the ones in the disk image.
+// Load it for m, and bring the filesystem tables up to date with it.
+uint8_t mount_disk_image (SESSION* s, int m) {
+	uint8_t e = open_disk_image(s,m);
+	uint64_t t0 = stats_now();
+	if (!e) e = fs_mount(&fs,disk);
+	stats_image(t0);
 	return e;
 }
 
-void req_fdc_set_mode(int m) {
+// the filesystem wrote to the image
+void fs_wrote(void) {
+	if (disk_jnl.d==disk && disk_jnl.n) { disk_sync(); return; } // see disk_wrote()
+	if (ev_timer(disk_idle_timeout,NULL,DISK_IDLE_MS)) disk_sync();
+}
+
+void req_fdc_set_mode(SESSION* s, int m) {
 	dbg(2,"%s(%d)\n",__func__,m);
-	operation_mode = m; // no response, just switch modes
+	s->operation_mode = m; // no response, just switch modes
+	capture_note(s->id,"mode %s",m==MODE_FDC?"fdc":"opr");
+	disk_sync();
 	if (m==MODE_OPR) dbg(2,"Switched to \"Operation\" mode\n");
 }
 
@@ -1254,259 +1789,329 @@ void req_fdc_set_mode(int m) {
 //   bit 5 = disk write-protected
 //   0-4 not used
 // l = 0
-void req_fdc_condition() {
+void req_fdc_condition(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	ret_fdc_std(ERR_FDC_SUCCESS,pdd1_condition,0);
+	ret_fdc_std(s,ERR_FDC_SUCCESS,s->pdd1_condition,0);
+	s->pdd1_condition &= ~(1<<PDD1_COND_BIT_CHANGED); // reported once
+}
+
+// Formatted image layouts. Each one is built the first time it's used
+// and kept, and a format is then one copy of the whole image.
+#define FMT_PDD1 0 // Operation-mode TPDD1
+#define FMT_PDD2 1 // Operation-mode TPDD2
+#define FMT_FDC  2 // FDC-mode, + logical sector size code
+#define FDC_LSC_MAX (sizeof(FDC_LOGICAL_SECTOR_SIZE)/sizeof(FDC_LOGICAL_SECTOR_SIZE[0])-1)
+const uint8_t* format_template(int f) {
+	static uint8_t* tmpl[FMT_FDC+FDC_LSC_MAX+1];
+	const unsigned rc = f==FMT_PDD2?(PDD2_TRACKS*PDD2_SECTORS):(PDD1_TRACKS*PDD1_SECTORS);
+	uint8_t* b = tmpl[f];
+	if (b) return b;
+	if (!(b = calloc(rc,SECTOR_LEN))) return NULL;
+
+	for (unsigned rn=0;rn<rc;rn++) {
+		uint8_t* r = b+(size_t)rn*SECTOR_LEN;
+		switch (f) {
+			// Real drive TPDD1 fresh Operation-mode format is strange.
+			// Any sector with any data gets LSC 0, and all others get LSC 1.
+			// Later, any sector that gets used by a file gets changed from LSC 1 to
+			// LSC 0, and never changed back even when files are deleted.
+			// A fresh format has one byte of data in sector 0 in the SMT,
+			// so a fresh format sector 0 has LSC 0 and all other sectors have LSC 1.
+			// We exactly mimick that here "just because", even though the LSC 1s
+			// don't seem to actually matter and we could just make all LSC 0.
+			case FMT_PDD1: if (rn==0) r[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD1_SMT; else r[0]=1; break;
+			case FMT_PDD2: r[0]=0x16; if (rn<2) { r[1]=0xFF; r[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD2_SMT; } break;
+			default: r[0]=f-FMT_FDC; // logical sector size code
+		}
+	}
+	return tmpl[f] = b;
 }
 
 // lc = logical sector size code
-void req_fdc_format(uint8_t lc) {
+void req_fdc_format(SESSION* s, uint8_t lc) {
 	dbg(2,"%s(%d)\n",__func__,lc);
-	uint16_t ll = FDC_LOGICAL_SECTOR_SIZE[lc];
 	uint8_t rn = 0;     // physical sector number
 	uint8_t rc = (PDD1_TRACKS*PDD1_SECTORS); // total record count
 
-	dbg(0,"Format: Logical sector size: %d = %d\n",lc,ll);
+	if (lc>FDC_LSC_MAX) { ret_fdc_std(s,ERR_FDC_LSSC_HI,0,0); return; }
+	dbg(0,"Format: Logical sector size: %d = %d\n",lc,FDC_LOGICAL_SECTOR_SIZE[lc]);
 
-	uint8_t e = open_disk_image(0,O_RDWR);
-	if (e) { ret_fdc_std(e,0,0); return; }
+	uint8_t e = open_disk_image(s,O_RDWR);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	memset(rb,0x00,SECTOR_LEN);
-	rb[0]=lc; // logical sector size code
-	for (rn=0;rn<rc;rn++) {
-		if (write(disk_img_fd,rb,SECTOR_LEN)<0) {
-			dbg(0,"%s\n",strerror(errno));
-			e = ERR_FDC_READ;
-			break;
-		}
+	const uint8_t* t = format_template(FMT_FDC+lc);
+	uint64_t t0 = stats_now();
+	bool ok = false;
+	if (disk->records!=rc) dbg(0,"Format: the image has %u records, FDC-mode needs %u\n",disk->records,rc);
+	else if (!t || img_fill(disk,t)) dbg(0,"Format: %s\n",strerror(errno));
+	else ok = true;
+	if (!ok) {
+		e = ERR_FDC_READ;
+		// report the first sector that isn't there
+		rn = disk->len/SECTOR_LEN;
 	}
+	stats_image(t0);
 
-	close(disk_img_fd);
-	if (!e) rn = 0;
-	ret_fdc_std(e,rn,0);
+	disk_sync();
+	ret_fdc_std(s,e,rn,0);
+}
+
+// FDC-mode requests that stop part way through to wait for more bytes
+// from the client are split in two. The first stage sends its response and
+// calls fdc_wait(), and process_client_rx() runs the second stage once the
+// bytes it needs are in the rx ring, instead of blocking in a read.
+void fdc_wait(SESSION* s, unsigned n, void (*f)(SESSION* s)) {
+	s->fdc_need = n;
+	s->fdc_resume = f;
+}
+
+void fdc_read_id_data(SESSION* s) {
+	if (rx_getc(s)==FDC_CMD_EOL) write_client_tty(s,s->rb+1,SECTOR_ID_LEN); // if 0D send data else silently abort
 }
 
 // read ID section of a sector
 // p = physical sector number 0-79
-void req_fdc_read_id(uint8_t p) {
+void req_fdc_read_id(SESSION* s, uint8_t p) {
 	dbg(2,"%s(%d)\n",__func__,p);
 
-	uint8_t e = open_disk_image(p,O_RDONLY);
-	if (e) { ret_fdc_std(e,0,0); return; }
+	uint8_t e = open_disk_image(s,O_RDONLY);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	int r = read(disk_img_fd,rb,SECTOR_HEADER_LEN);
-	close(disk_img_fd);
-	dbg_b(2,rb,SECTOR_HEADER_LEN);
-	if(r!=SECTOR_HEADER_LEN) {
-		ret_fdc_std(ERR_FDC_READ,p,0);
+	uint8_t* r = disk_rec(p,false);
+	if (!r) {
+		ret_fdc_std(s,ERR_FDC_READ,p,0);
 		return;
 	}
- 
-	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[rb[0]];          // get logical size from header
-	ret_fdc_std(ERR_FDC_SUCCESS,p,l);   // send OK
-	char t=0x00;
-	read_client_tty(&t,1); // read 1 byte from client
-	if (t==FDC_CMD_EOL) write_client_tty(rb+1,r-1); // if 0D send data else silently abort
+	memcpy(s->rb,r,SECTOR_HEADER_LEN);
+	dbg_b(2,s->rb,SECTOR_HEADER_LEN);
+
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[s->rb[0]];          // get logical size from header
+	ret_fdc_std(s,ERR_FDC_SUCCESS,p,l);   // send OK
+	fdc_wait(s,1,fdc_read_id_data); // read 1 byte from client
+}
+
+void fdc_read_sector_data(SESSION* s) {
+	if (rx_getc(s)==FDC_CMD_EOL) write_client_tty(s,s->rb,s->fdc_len); // if 0D send data else silently abort
 }
 
 // read DATA section of a sector
 // tp = target physical sector 0-79
 // tl = target logical sector 1-20
-void req_fdc_read_sector(uint8_t tp,uint8_t tl) {
+void req_fdc_read_sector(SESSION* s, uint8_t tp,uint8_t tl) {
 	dbg(2,"%s(%d,%d)\n",__func__,tp,tl);
 
-	uint8_t e = open_disk_image(tp,O_RDONLY);
-	if (e) { ret_fdc_std(e,0,0); return; }
+	uint8_t e = open_disk_image(s,O_RDONLY);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	if (read(disk_img_fd,rb,SECTOR_HEADER_LEN)!=SECTOR_HEADER_LEN) { // read header
+	uint8_t* r = disk_rec(tp,false);
+	if (!r) {
 		dbg(1,"failed read header\n");
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+		ret_fdc_std(s,ERR_FDC_READ,tp,0);
 		return;
 	}
-	dbg_b(3,rb,SECTOR_HEADER_LEN);
+	dbg_b(3,r,SECTOR_HEADER_LEN);
 
-	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[rb[0]]; // get logical size from header
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[r[0]]; // get logical size from header
+	if (tl<1) {
+		ret_fdc_std(s,ERR_FDC_LSN_LO,tp,l);
+		return;
+	}
 	if (l*tl>SECTOR_DATA_LEN) {
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_LSN_HI,tp,l);
+		ret_fdc_std(s,ERR_FDC_LSN_HI,tp,l);
 		return;
 	}
 
-	// seek to target_physical*(id_len+physical_len) + id_len + (target_logical-1)*logical_len
-	int s = (tp*SECTOR_LEN)+SECTOR_HEADER_LEN+((tl-1)*l);
-	if (lseek(disk_img_fd,s,SEEK_SET)!=s) {
-		dbg(1,"failed seek %d : %s\n",s,strerror(errno));
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+	// header + (target_logical-1)*logical_len
+	memcpy(s->rb,r+SECTOR_HEADER_LEN+((tl-1)*l),l);
+	ret_fdc_std(s,ERR_FDC_SUCCESS,tp,l); // 1st stage response
+	s->fdc_len = l;
+	fdc_wait(s,1,fdc_read_sector_data); // read 1 byte from client
+}
+
+void fdc_search_id_data(SESSION* s) {
+	int rn = 0;     // physical sector number
+	int rc = (PDD1_TRACKS*PDD1_SECTORS); // total record count
+	uint8_t sb[SECTOR_ID_LEN] = {0x00}; // search data
+	uint8_t* r;
+
+	read_client_tty(s,sb,SECTOR_ID_LEN);
+
+	uint8_t e = open_disk_image(s,O_RDONLY);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
+
+	// hash probe instead of reading every header, see img_find_id()
+	uint64_t t0 = stats_now();
+	rn = img_find_id(disk,sb);
+	stats_image(t0);
+	if (rn>=rc) rn = -1;
+	dbg(3,"ID index: %d\n",rn);
+
+	if (rn>=0) {
+		r = disk_rec(rn,false);
+		ret_fdc_std(s,ERR_FDC_SUCCESS,rn,FDC_LOGICAL_SECTOR_SIZE[r[0]]);
 		return;
 	}
-	memset(rb,0x00,l);
-	if (read(disk_img_fd,rb,l)!=l) { // read one logical sector of DATA
-		dbg(1,"failed logical sector read\n");
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+
+	// not found, and a short image fails where the search ran out of records
+	for (rn=0;rn<rc && disk_rec(rn,false);rn++);
+	if (rn<rc) {
+		ret_fdc_std(s,ERR_FDC_READ,rn,0);
 		return;
 	}
-	close(disk_img_fd);
-	ret_fdc_std(ERR_FDC_SUCCESS,tp,l); // 1st stage response
-	char t=0x00;
-	read_client_tty(&t,1); // read 1 byte from client
-	if (t==FDC_CMD_EOL) write_client_tty(rb,l); // if 0D send data else silently abort
+	r = disk_rec(rc-1,false);
+	ret_fdc_std(s,ERR_FDC_ID_NOT_FOUND,255,FDC_LOGICAL_SECTOR_SIZE[r[0]]);
 }
 
 // ref/search_id_section.txt
-void req_fdc_search_id() {
+void req_fdc_search_id(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	int rn = 0;     // physical sector number
-	int rc = (PDD1_TRACKS*PDD1_SECTORS); // total record count
-	char sb[SECTOR_ID_LEN] = {0x00}; // search data
-
-	uint8_t e = open_disk_image(0,O_RDONLY);
-	if (e) { ret_fdc_std(e,0,0); return; }
-
-	ret_fdc_std(ERR_FDC_SUCCESS,0,0); // tell client to send data
-	read_client_tty(sb,SECTOR_ID_LEN); // read 12 bytes from client
-
-	uint16_t l = 0;
-	bool found = false;
-	for (rn=0;rn<rc;rn++) {
-		memset(rb,0x00,SECTOR_HEADER_LEN);
-		if (read(disk_img_fd,rb,SECTOR_LEN)!=SECTOR_LEN) {  // read one record
-			dbg(0,"%s\n",strerror(errno));
-			close(disk_img_fd);
-			ret_fdc_std(ERR_FDC_READ,rn,0);
-			return;
-		}
 
-		dbg(3,"%d ",rn);
-		dbg_b(3,rb,SECTOR_HEADER_LEN);
+	uint8_t e = open_disk_image(s,O_RDONLY);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-		l = FDC_LOGICAL_SECTOR_SIZE[rb[0]]; // get logical size from header
+	ret_fdc_std(s,ERR_FDC_SUCCESS,0,0); // tell client to send data
+	fdc_wait(s,SECTOR_ID_LEN,fdc_search_id_data); // read 12 bytes from client
+}
 
-		// does sb exactly match ID?
-		if (!strncmp(sb,(char*)rb+1,SECTOR_ID_LEN)) {
-			found = true;
-			break;
-		}
-	}
-	close(disk_img_fd);
+void fdc_write_id_data(SESSION* s) {
+	int tp = s->fdc_p;
+	uint16_t l = s->fdc_len;
+
+	read_client_tty(s,s->rb,SECTOR_ID_LEN);
+
+	uint8_t e = open_disk_image(s,O_RDWR);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	if (found) {
-		ret_fdc_std(ERR_FDC_SUCCESS,rn,l);
+	// write those to the image, after the LSC
+	uint8_t* r = disk_rec(tp,true);
+	if (r) {
+		memcpy(r+1,s->rb,SECTOR_ID_LEN);
+		disk_wrote(tp,1,SECTOR_ID_LEN);
 	} else {
-		ret_fdc_std(ERR_FDC_ID_NOT_FOUND,255,l);
+		dbg(0,"%s\n",strerror(errno));
+		e = ERR_FDC_READ;
+		l = 0;
 	}
+
+	ret_fdc_std(s,e,tp,l); // send final response to client
 }
 
-void req_fdc_write_id(int tp) {
+void req_fdc_write_id(SESSION* s, int tp) {
 	dbg(2,"%s(%d)\n",__func__,tp);
 
-	uint8_t e = open_disk_image(tp,O_RDWR);
-	if (e) { ret_fdc_std(e,0,0); return; }
+	uint8_t e = open_disk_image(s,O_RDWR);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	if (read(disk_img_fd,rb,1)!=1) { // read LSC
+	uint8_t* r = disk_rec(tp,false);
+	if (!r) {
 		dbg(0,"failed to read LSC\n");
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+		ret_fdc_std(s,ERR_FDC_READ,tp,0);
 		return;
 	}
 
-	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[rb[0]]; // get logical size from LSC
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[r[0]]; // get logical size from LSC
+
+	ret_fdc_std(s,ERR_FDC_SUCCESS,tp,l); // tell client to send data
+
+	s->fdc_p = tp;
+	s->fdc_len = l;
+	fdc_wait(s,SECTOR_ID_LEN,fdc_write_id_data); // read 12 bytes from client
+}
 
-	ret_fdc_std(ERR_FDC_SUCCESS,tp,l); // tell client to send data
+void fdc_write_sector_data(SESSION* s) {
+	int tp = s->fdc_p;
+	int tl = s->fdc_l;
+	uint16_t l = s->fdc_len;
 
-	read_client_tty(rb,SECTOR_ID_LEN); // read 12 bytes from client
+	read_client_tty(s,s->rb,l);
 
-	// write those to the file
-	if (write(disk_img_fd,rb,SECTOR_ID_LEN)<0) {
+	uint8_t e = open_disk_image(s,O_RDWR);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
+
+	// header + (target_logical-1)*logical_size
+	int o = SECTOR_HEADER_LEN+((tl-1)*l);
+	uint8_t* r = disk_rec(tp,true);
+	if (!r) {
 		dbg(0,"%s\n",strerror(errno));
-		e = ERR_FDC_READ;
-		l = 0;
+		ret_fdc_std(s,ERR_FDC_READ,tp,0);
+		return;
 	}
+	memcpy(r+o,s->rb,l);
+	disk_wrote(tp,o,l);
 
-	close(disk_img_fd);
-	ret_fdc_std(e,tp,l); // send final response to client
+	ret_fdc_std(s,ERR_FDC_SUCCESS,tp,l); // send final OK to client
 }
 
-void req_fdc_write_sector(int tp,int tl) {
+void req_fdc_write_sector(SESSION* s, int tp,int tl) {
 	dbg(2,"%s(%d,%d)\n",__func__,tp,tl);
 
-	uint8_t e = open_disk_image(tp,O_RDWR);
-	if (e) { ret_fdc_std(e,0,0); return; }
+	uint8_t e = open_disk_image(s,O_RDWR);
+	if (e) { ret_fdc_std(s,e,0,0); return; }
 
-	if (read(disk_img_fd,rb,SECTOR_HEADER_LEN)!=SECTOR_HEADER_LEN) { // read header
+	uint8_t* r = disk_rec(tp,false);
+	if (!r) {
 		dbg(0,"failed read ID\n");
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+		ret_fdc_std(s,ERR_FDC_READ,tp,0);
 		return;
 	}
 
-	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[rb[0]]; // get logical size from header
-
-	// seek to target_physical*full_sectors + header + target_logical*logical_size
-	int s = (tp*SECTOR_LEN)+SECTOR_HEADER_LEN+((tl-1)*l);
-	if (lseek(disk_img_fd,s,SEEK_SET)!=s) {
-		dbg(0,"failed seek %d : %s\n",s,strerror(errno));
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
+	uint16_t l = FDC_LOGICAL_SECTOR_SIZE[r[0]]; // get logical size from header
+	if (tl<1) {
+		ret_fdc_std(s,ERR_FDC_LSN_LO,tp,l);
+		return;
+	}
+	if (l*tl>SECTOR_DATA_LEN) {
+		ret_fdc_std(s,ERR_FDC_LSN_HI,tp,l);
 		return;
 	}
 
-	ret_fdc_std(ERR_FDC_SUCCESS,tp,l); // tell client to send data
+	ret_fdc_std(s,ERR_FDC_SUCCESS,tp,l); // tell client to send data
 
-	read_client_tty(rb,l); // read logical_size bytes from client
+	s->fdc_p = tp;
+	s->fdc_l = tl;
+	s->fdc_len = l;
+	fdc_wait(s,l,fdc_write_sector_data); // read logical_size bytes from client
+}
 
-	// write them to the file
-	if (write(disk_img_fd,rb,l)<0) {
-		dbg(0,"%s\n",strerror(errno));
-		close(disk_img_fd);
-		ret_fdc_std(ERR_FDC_READ,tp,0);
-		return;
+// FDC-mode command line framing
+// A command is one command byte, then up to 6 bytes of parameters,
+// ended by 0x0D or by the 6th parameter byte.
+// Like opr_frame(), bytes are fed in from the rx ring one at a time.
+// returns true when fdc_c and gb[] hold a complete command
+bool fdc_frame(SESSION* s, uint8_t c) {
+	if (!s->fdc_in_cmd) {
+		if (!c) return false; // nulls are not a command
+		memset(s->gb,0x00,TPDD_MSG_MAX);
+		s->fdc_i = 0;
+		if (c==FDC_CMD_EOL) { s->fdc_c = 0x20; return true; } // fall through to ERR_FDC_COMMAND, important for Sardine
+		s->fdc_c = strchr(FDC_CMDS,c) ? c : 0x20;
+		s->fdc_in_cmd = true;
+		return false;
 	}
 
-	close(disk_img_fd); // close file
-
-	ret_fdc_std(ERR_FDC_SUCCESS,tp,l); // send final OK to client
+	dbg(3,"i:%d gb[]:\n%s\n",s->fdc_i,s->gb);
+	switch (c) {
+		case FDC_CMD_EOL: break;
+		case 0x20: return false; // spaces after the command byte are ignored
+		default: s->gb[s->fdc_i++] = c;
+			if (s->fdc_i<6) return false; // max params is "##,##"
+	}
+	s->fdc_in_cmd = false;
+	return true;
 }
 
 // ref/fdc.txt
-void get_fdc_cmd() {
+// Takes bytes from the rx ring until a whole command has arrived, then
+// executes it. Returns without doing anything if the ring runs dry first.
+void get_fdc_cmd(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
-	uint8_t i = 0;
-	bool eol = false;
-	uint8_t c = 0x00;
+	int r;
 	int p = -1;
 	int l = -1;
 
-	memset(gb,0x00,TPDD_MSG_MAX);
-	if (ch[0]==0xFF) ch[0]=0x00; // blech figure out something better
-
-	// scan for a valid command byte first
-	while (!c) {
-		if (ch[0]) {
-			c = ch[0];
-			ch[0] = 0x00;
-			dbg(3,"Restored from req_fdc(): 0x%02X\n",c);
-		} else {
-			read_client_tty(&c,1);
-		}
-		if (c==FDC_CMD_EOL) { eol=true; c=0x20; break; } // fall through to ERR_FDC_COMMAND, important for Sardine
-		if (!strchr(FDC_CMDS,c)) c=0x20 ; // eat bytes until valid cmd or eol
-	}
-
-	// read params
-	i = 0;
-	while (i<6 && !eol) {  // max params is "##,##"
-		if (read_client_tty(&gb[i],1)==1) {
-			dbg(3,"i:%d gb[]:\n%s\n",i,gb);
-			switch (gb[i]) {
-				case FDC_CMD_EOL: eol=true;    // fall through
-				case 0x20: gb[i]=0x00; break;  // if 1st byte after cmd is space, ignore it
-				default: i++;
-			}
-		}
-	}
+	while ((r = rx_getc(s))>=0) if (fdc_frame(s,r)) break;
+	if (r<0) return;
+	uint8_t c = s->fdc_c;
 
 	// We can pre-parse & validate the params since they take the same
 	// form (or a consistent subset) for all commands.
@@ -1521,34 +2126,37 @@ void get_fdc_cmd() {
 	p=0; // real drive uses physical sector 0 when omitted
 	l=1; // real drive uses logical sector 1 when omitted
 	char* t;
-	if ((t=strtok((char*)gb,","))!=NULL) p=atoi(t); // target physical sector number
+	if ((t=strtok((char*)s->gb,","))!=NULL) p=atoi(t); // target physical sector number
 	if ((t=strtok(NULL,","))!=NULL) l=atoi(t); // target logical sector number
 	// for physical sector out of range, real drive error response will have dat=last_valid_p if any
 	// if no command has ever supplied a valid physical sector number yet, then dat=FF
-	if (p<0) {ret_fdc_std(ERR_FDC_PARAM,0xFF,0); return;}
-	if (p>79) {ret_fdc_std(ERR_FDC_PSN_HI,0xFF,0); return;}
-	if (l<1) {ret_fdc_std(ERR_FDC_LSN_LO,p,0); return;}
-	if (l>20) {ret_fdc_std(ERR_FDC_LSN_HI,p,0); return;}
+	if (p<0) {ret_fdc_std(s,ERR_FDC_PARAM,0xFF,0); return;}
+	if (p>79) {ret_fdc_std(s,ERR_FDC_PSN_HI,0xFF,0); return;}
+	if (l<1) {ret_fdc_std(s,ERR_FDC_LSN_LO,p,0); return;}
+	if (l>20) {ret_fdc_std(s,ERR_FDC_LSN_HI,p,0); return;}
 
 	// debug
 	dbg(3,"command:%c  physical:%d  logical:%d\n",c,p,l);
 
 	// dispatch
+	stats_begin(c>='A' && c<='Z' ? STATS_FDC+c-'A' : STATS_OPS);
 	switch (c) {
-		case FDC_SET_MODE:        req_fdc_set_mode(p);        break;
-		case FDC_CONDITION:       req_fdc_condition();        break;
+		case FDC_SET_MODE:        req_fdc_set_mode(s,p);        break;
+		case FDC_CONDITION:       req_fdc_condition(s);        break;
 		case FDC_FORMAT_NV:
-		case FDC_FORMAT:          req_fdc_format(p);          break;
-		case FDC_READ_ID:         req_fdc_read_id(p);         break;
-		case FDC_READ_SECTOR:     req_fdc_read_sector(p,l);   break;
-		case FDC_SEARCH_ID:       req_fdc_search_id();        break;
+		case FDC_FORMAT:          req_fdc_format(s,p);          break;
+		case FDC_READ_ID:         req_fdc_read_id(s,p);         break;
+		case FDC_READ_SECTOR:     req_fdc_read_sector(s,p,l);   break;
+		case FDC_SEARCH_ID:       req_fdc_search_id(s);        break;
 		case FDC_WRITE_ID_NV:
-		case FDC_WRITE_ID:        req_fdc_write_id(p);        break;
+		case FDC_WRITE_ID:        req_fdc_write_id(s,p);        break;
 		case FDC_WRITE_SECTOR_NV:
-		case FDC_WRITE_SECTOR:    req_fdc_write_sector(p,l);  break;
-		default: dbg(2,"FDC: invalid cmd \"%s\"\n",gb);
-			ret_fdc_std(ERR_FDC_COMMAND,0,0); // required for model detection
+		case FDC_WRITE_SECTOR:    req_fdc_write_sector(s,p,l);  break;
+		default: dbg(2,"FDC: invalid cmd \"%s\"\n",s->gb);
+			ret_fdc_std(s,ERR_FDC_COMMAND,0,0); // required for model detection
 	}
+	flush_client_tx(s);
+	stats_end(rx_taken(s));
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -1632,198 +2240,291 @@ FILE_ENTRY* make_file_entry(char* namep, uint8_t attr, uint16_t len, char flags)
 }
 
 // standard return - return for: error open close delete status write
-void ret_std(unsigned char err) {
+void ret_std(SESSION* s, unsigned char err) {
 	dbg(3,"%s()\n",__func__);
-	gb[0] = RET_STD[0];
-	gb[1] = RET_STD[1];
-	gb[2] = err;
-	gb[3] = checksum(gb);
+	// a buffered write that failed after it was acked
+	if (s->w_err) {
+		if (err==ERR_SUCCESS) err = s->w_err;
+		s->w_err = ERR_SUCCESS;
+	}
+	s->gb[0] = RET_STD[0];
+	s->gb[1] = RET_STD[1];
+	s->gb[2] = err;
+	s->gb[3] = checksum(s->gb);
 	dbg(3,"Response: %02X\n",err);
-	write_client_tty(gb,gb[1]+3);
-	if (gb[2]!=ERR_SUCCESS) dbg(2,"ERROR RESPONSE TO CLIENT\n");
+	write_client_tty(s,s->gb,s->gb[1]+3);
+	if (s->gb[2]!=ERR_SUCCESS) dbg(2,"ERROR RESPONSE TO CLIENT\n");
 }
 
-int read_next_dirent(DIR* dir,int m) {
+// Names are filtered first, and the type from the directory entry is used
+// when there is one, so nothing is stat'ed that isn't going to be listed.
+int read_next_dirent(SESSION* s, DIR_SCAN* dir,int m) {
 	dbg(3,"%s()\n",__func__);
-	struct stat st;
-	struct dirent* dire;
+	const char* name;
+	uint8_t type;
+	off_t size = 0;
 	int flags;
 
 	if (dir == NULL) {
-		dire=NULL;
 		dbg(0,"%s(NULL) ???\n",__func__);
-		if (m) ret_std(ERR_NO_DISK);
+		if (m) ret_std(s,ERR_NO_DISK);
 		return 0;
 	}
 
-	while ((dire=readdir(dir)) != NULL) {
-		flags=FE_FLAGS_NONE;
+	while ((name=dir_scan_next(dir,&type)) != NULL) {
+		if (base_len) {
+			if (name[0]=='.') continue; // skip "." ".." and hidden files
+			if (strlen(name)>LOCAL_FILENAME_MAX) continue; // skip long filenames
+		}
+
+		if (type==DS_TYPE_OTHER) continue;
+		if (type==DS_TYPE_DIR && s->in_dme<2) continue;
 
-		if (stat(dire->d_name,&st)) {
-			if (m) ret_std(ERR_NO_FILE);
+		if (dir_scan_stat(s->dir_fd,name,&type,&size)) {
+			s->fc.fl->valid = false; // partial list
+			if (m) ret_std(s,ERR_NO_FILE);
 			return 0;
 		}
 
-		if (S_ISDIR(st.st_mode)) flags=FE_FLAGS_DIR;
-		else if (!S_ISREG (st.st_mode)) continue;
+		if (type==DS_TYPE_DIR) flags=FE_FLAGS_DIR;
+		else if (type==DS_TYPE_FILE) flags=FE_FLAGS_NONE;
+		else continue;
 
-		if (flags==FE_FLAGS_DIR && in_dme<2) continue;
-
-		if (base_len) {
-			if (dire->d_name[0]=='.') continue; // skip "." ".." and hidden files
-			if (strlen(dire->d_name)>LOCAL_FILENAME_MAX) continue; // skip long filenames
-		}
+		if (flags==FE_FLAGS_DIR && s->in_dme<2) continue;
 
 		// TODO - make this configurable
 		// If filesize is too large for the tpdd 16 bit size field, then say
 		// size=0 but allow the file to be accessed.
 		// A real drive does NOT do this, but REXCPM cpmupd.CO
 		// violates the tpdd protocol to load a large CP/M disk image.
-		if (st.st_size>UINT16_MAX) st.st_size=0;
+		if (size>UINT16_MAX) size=0;
 
 		uint8_t attr = default_attr;
-		dl_getxattr(dire->d_name, &attr);
-		add_file(make_file_entry(dire->d_name, attr, st.st_size, flags));
+		dl_getxattrat(s->dir_fd, name, &attr);
+		FILE_ENTRY* fe = make_file_entry((char*)name, attr, size, flags);
+		if (add_file(&s->fc,fe)>0)
+			dbg(0,"Name collision: \"%s\" and \"%s\" are both \"%s\" (%c) to the client, only the first can be opened\n",
+				find_file(s->fc.fl,fe->client_fname,fe->attr)->local_fname,fe->local_fname,fe->client_fname,fe->attr);
 		break;
 	}
 
-	if (dire == NULL) return 0;
+	if (name == NULL) return 0;
 
 	return 1;
 }
 
-// read the current share directory
-void update_file_list(int m) {
-	dbg(3,"%s()\n",__func__);
-	DIR* dir;
+// Switch the session to the shared list for the current directory,
+// the way this session needs to see it.
+void use_file_list(SESSION* s) {
+	uint8_t f = FL_FLAGS_NONE;
+	if (s->dir_depth) f |= FL_FLAGS_PARENT;
+	if (s->in_dme>1) f |= FL_FLAGS_DIRS;
+	if (s->fc.fl && s->fc.fl->flags==f && !strcmp(s->fc.fl->path,s->cwd)) return;
+	file_list_put(s->fc.fl);
+	s->fc.fl = file_list_get(s->cwd,f);
+	s->fc.cur = 0;
+}
+
+// The file list for the disk image is made from the directory table that
+// fs_mount() keeps, so it's only rebuilt when that changes.
+void update_image_list(SESSION* s) {
+	static unsigned long ver = 0;
+	FILE_ENTRY fe;
+	unsigned i;
 
-	if (model==2) cd_share_path();
-	dir = opendir(".");
-	file_list_clear_all();
+	uint8_t e = mount_disk_image(s,O_RDONLY);
+	if (!s->fc.fl || strcmp(s->fc.fl->path,disk_img_fname)) {
+		file_list_put(s->fc.fl);
+		s->fc.fl = file_list_get(disk_img_fname,FL_FLAGS_NONE);
+	}
+	s->fc.cur = 0;
+	if (!s->fc.fl) return;
+	if (!e && s->fc.fl->valid && ver==fs.ver) {
+		dbg(3,"Disk image directory unchanged\n");
+		return;
+	}
+	file_list_clear_all(&s->fc);
+	s->fc.fl->valid = false;
+	if (e) {
+		dbg(1,"Disk image: no directory (%02X)\n",e);
+		return;
+	}
+
+	dbg(1,"\nDisk image: %s\n",disk_img_fname);
+	dbg(1,"\"%-*s\"  |a|  size  sectors\n",TPDD_FILENAME_LEN,"name");
+	dbg(1,"-------------------------------------------------------------------------------\n");
+	for (i=0;i<fs.n;i++) {
+		memset(&fe,0x00,sizeof(fe));
+		strcpy(fe.client_fname,fs.ent[i].name);
+		strcpy(fe.local_fname,fs.ent[i].name);
+		fe.attr = fs.ent[i].attr;
+		fe.len = fs.ent[i].size;
+		fe.flags = FE_FLAGS_IMG;
+		add_file(&s->fc,&fe);
+		dbg(1,"\"%-*s\"  |%c|  %5u  %u-%u\n",TPDD_FILENAME_LEN,fe.client_fname,fe.attr,fe.len,fs.ent[i].head,fs.ent[i].tail);
+	}
+	dbg(1,"-------------------------------------------------------------------------------\n");
+	s->fc.fl->valid = true;
+	ver = fs.ver;
+}
+
+// read the current share directory, if it changed since the last time
+void update_file_list(SESSION* s, int m) {
+	dbg(3,"%s()\n",__func__);
+	DIR_SCAN* dir;
+
+	if (*disk_img_fname) { update_image_list(s); return; }
+	if (model==2) cd_share_path(s);
+	use_file_list(s);
+	if (!s->fc.fl) return;
+	if (file_list_fresh(s->fc.fl,s->dir_fd)) {
+		dbg(3,"Directory unchanged: %s\n",s->cwd);
+		s->fc.cur = 0;
+		return;
+	}
+	dir = dir_scan_open(s->dir_fd);
+	if (!dir) s->fc.fl->valid = false;
+	file_list_clear_all(&s->fc);
 
 	//int w = base_len+1+ext_len;
 	//if (base_len<1||w>TPDD_FILENAME_LEN) w = TPDD_FILENAME_LEN;
-	dbg(1,"\nDirectory %s: %s\n",model==2?bank==1?"[Bank 1]":"[Bank 0]":"",cwd);
+	dbg(1,"\nDirectory %s: %s\n",model==2?s->bank==1?"[Bank 1]":"[Bank 0]":"",s->cwd);
 	/* match format with end of make_file_entry() */
 	dbg(1,"\"%-*s\"  |a|  local filename\n",cfnl,"tpdd view");
 	dbg(1,"-------------------------------------------------------------------------------\n");
-	if (dir_depth) add_file(make_file_entry("..", default_attr, 0, FE_FLAGS_DIR));
-	while (read_next_dirent(dir,m));
+	if (s->dir_depth) add_file(&s->fc,make_file_entry("..", default_attr, 0, FE_FLAGS_DIR));
+	while (read_next_dirent(s,dir,m));
 	dbg(1,"-------------------------------------------------------------------------------\n");
-	closedir(dir);
+	dir_scan_close(dir);
 }
 
 // return for dirent
-int ret_dirent(FILE_ENTRY* ep) {
+int ret_dirent(SESSION* s, FILE_ENTRY* ep) {
 	// ep may be null
 	dbg(2,"%s()\n",__func__);
 	int i;
 
-	memset(gb,0x00,TPDD_MSG_MAX);
-	gb[0] = RET_DIRENT[0];
-	gb[1] = RET_DIRENT[1];
+	memset(s->gb,0x00,TPDD_MSG_MAX);
+	s->gb[0] = RET_DIRENT[0];
+	s->gb[1] = RET_DIRENT[1];
 
 	if (ep) {
 		// name
-		memset (gb + 2, ' ', TPDD_FILENAME_LEN);
-		if (base_len) for (i=0;i<base_len+3;i++)
-			gb[i+2] = (ep->client_fname[i])?ep->client_fname[i]:' ';
-		else memcpy (gb+2,ep->client_fname,TPDD_FILENAME_LEN);
+		memset (s->gb + 2, ' ', TPDD_FILENAME_LEN);
+		if (ep->flags&FE_FLAGS_IMG) memcpy(s->gb+2,ep->client_fname,strlen(ep->client_fname));
+		else if (base_len) for (i=0;i<base_len+3;i++)
+			s->gb[i+2] = (ep->client_fname[i])?ep->client_fname[i]:' ';
+		else memcpy (s->gb+2,ep->client_fname,TPDD_FILENAME_LEN);
 
 		// attribute
-		gb[26] = ep->attr;
+		s->gb[26] = ep->attr;
 
 		// size
-		gb[27] = (uint8_t)(ep->len >> 0x08); // most significant byte
-		gb[28] = (uint8_t)(ep->len & 0xFF);  // least significant byte
+		s->gb[27] = (uint8_t)(ep->len >> 0x08); // most significant byte
+		s->gb[28] = (uint8_t)(ep->len & 0xFF);  // least significant byte
 	}
 
-	dbg(3,"\"%*.*s\" (%c) 0x%02X%02X\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,gb+2,gb[26],gb[27],gb[28]);
+	dbg(3,"\"%*.*s\" (%c) 0x%02X%02X\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,s->gb+2,s->gb[26],s->gb[27],s->gb[28]);
 
 	// free sectors
-	gb[29] = model==2?(PDD2_TRACKS*PDD2_SECTORS):(PDD1_TRACKS*PDD1_SECTORS);
+	if (*disk_img_fname && disk && fs.d==disk && fs.ok) s->gb[29] = fs_free(&fs);
+	else s->gb[29] = model==2?(PDD2_TRACKS*PDD2_SECTORS):(PDD1_TRACKS*PDD1_SECTORS);
+
+	s->gb[30] = checksum (s->gb);
 
-	gb[30] = checksum (gb);
+	return (write_client_tty(s,s->gb,31) == 31);
+}
 
-	return (write_client_tty(gb,31) == 31);
+// The list entries can be rewritten by any session's rescan, and
+// make_file_entry() returns a static, so the session keeps its own copy.
+void set_cur_file(SESSION* s, FILE_ENTRY* fe) {
+	s->cur_file = NULL;
+	if (!fe) return;
+	memcpy(&s->cur_fe,fe,sizeof(FILE_ENTRY));
+	s->cur_file = &s->cur_fe;
 }
 
-void dirent_set_name() {
+void dirent_set_name(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	if (gb[2]) {
-		dbg(3,"filename: \"%-*.*s\"\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,gb+2);
-		dbg(3,"    attr: \"%c\" (%1$02X)\n",gb[26]);
+	if (s->gb[2]) {
+		dbg(3,"filename: \"%-*.*s\"\n",TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,s->gb+2);
+		dbg(3,"    attr: \"%c\" (%1$02X)\n",s->gb[26]);
 	}
 	char* p;
 	char filename[TPDD_FILENAME_LEN+1] = {0x00};
 	uint8_t fileattr = 0x00;
 	int f = 0;
 
-	// Update the local file list before every set-name.
+	// Make sure the local file list is current before every set-name.
 	// * clients may open files any time without ever listing first
 	// * local files may be changed at any time by other processes
 	// and we need to have the tpdd version of all filenames ready to compare
 	// against, to respond correctly if it exists/doesn't/writable/not etc.
-	// TODO - Do we really need to do it that way?
-	// What about examining each local file on the spot instead of
-	// pre/re-generating a stored list of converted filenames?
-	// Maybe one thing a pre-generated list might be good for is the eventual
-	// filesystem access to disk images where we would model the FCB and SMT
-	// tables and disk sectors and update them the same way a real drive
-	// does when files are added/removed/read/written.
-	update_file_list(ALLOW_RET);
+	// The list is kept between requests and only rescanned when the
+	// directory has changed (inotify, or the directory mtime), so this
+	// is normally just a lookup.
+	update_file_list(s,ALLOW_RET);
 
 	// copy the filename from the buffer
-	strncpy(filename,(char*)gb+2,TPDD_FILENAME_LEN);
+	strncpy(filename,(char*)s->gb+2,TPDD_FILENAME_LEN);
 	filename[TPDD_FILENAME_LEN]=0x00;
-	fileattr = gb[26];
+	fileattr = s->gb[26];
 
 	// Remove trailing spaces
 	for (p = strrchr(filename,' ');p >= filename && *p == ' ';p--) *p = 0x00;
 
-	cur_file = find_file(filename, fileattr);
-
-	if (cur_file) {
-		dbg(3,"Exists: \"%s\"  %u\n", cur_file->local_fname, cur_file->len);
-		ret_dirent(cur_file);
+	set_cur_file(s,find_file(s->fc.fl,filename,fileattr));
+
+	if (s->cur_file) {
+		dbg(3,"Exists: \"%s\"  %u\n", s->cur_file->local_fname, s->cur_file->len);
+		ret_dirent(s,s->cur_file);
+	} else if (*disk_img_fname) {
+		// new file in the disk image, named just as the client sent it
+		FILE_ENTRY fe;
+		memset(&fe,0x00,sizeof(fe));
+		strcpy(fe.client_fname,filename);
+		strcpy(fe.local_fname,filename);
+		fe.attr = fileattr;
+		fe.flags = FE_FLAGS_IMG;
+		set_cur_file(s,&fe);
+		dbg(3,"New File: \"%s\"\n",filename);
+		ret_dirent(s,NULL);
 	} else if (!check_magic_file(filename)) {
 		// let UR2/TSLOAD load DOSxxx.CO from anywhere
-		cur_file = make_file_entry(filename, fileattr, 0, 0);
+		set_cur_file(s,make_file_entry(filename, fileattr, 0, 0));
 		char t[LOCAL_FILENAME_MAX+1] = {0x00};
 		// try share root
-		// TODO - save initial share_path[0] and use that instead of "../"*depth
 		// tpdd2 can't do dme, so share_path[1] is available
-		for (int i=dir_depth;i>0;i--) strcat(t,"../");
-		strncat(t,cur_file->local_fname,LOCAL_FILENAME_MAX-dir_depth*3);
-		struct stat st; int e = stat(t, &st);
+		struct stat st; int e = fstatat(share_fd[0],s->cur_file->local_fname,&st,0);
+		if (!e && snprintf(t,sizeof(t),"%s/%s",share_path[0],s->cur_file->local_fname)>=(int)sizeof(t)) e = -1;
 		if (e) { // try app_lib_dir
 			strcpy(t,app_lib_dir);
 			strcat(t,"/");
-			strcat(t,cur_file->local_fname);
+			strcat(t,s->cur_file->local_fname);
 			e=stat(t,&st);
 		}
-		if (e) ret_dirent(NULL); // not found
+		if (e) ret_dirent(s,NULL); // not found
 		else { // found in share root or in app_lib_dir
-			strcpy(cur_file->local_fname,t);
-			cur_file->len=st.st_size;
-			dbg(3,"Magic: \"%s\" <-- \"%s\"\n",cur_file->client_fname,cur_file->local_fname);
-			ret_dirent(cur_file);
+			strcpy(s->cur_file->local_fname,t);
+			s->cur_file->len=st.st_size;
+			dbg(3,"Magic: \"%s\" <-- \"%s\"\n",s->cur_file->client_fname,s->cur_file->local_fname);
+			ret_dirent(s,s->cur_file);
 		}
 	} else {
 		if (!strncmp(filename+base_len+1,dme_dir_label,2)) f = FE_FLAGS_DIR;
-		cur_file = make_file_entry(collapse_padded_fname(filename), fileattr, 0, f);
-		dbg(3,"New %s: \"%s\"\n",f==FE_FLAGS_DIR?"Directory":"File",cur_file->local_fname);
-		ret_dirent(NULL);
+		set_cur_file(s,make_file_entry(collapse_padded_fname(filename), fileattr, 0, f));
+		dbg(3,"New %s: \"%s\"\n",f==FE_FLAGS_DIR?"Directory":"File",s->cur_file->local_fname);
+		ret_dirent(s,NULL);
 	}
 }
 
-void dirent_get_first() {
+void dirent_get_first(SESSION* s) {
 	dbg(2,"Directory Listing\n");
-	// update every time before get-first,
+	// check every time before get-first,
 	// because set-name is not required before get-first
-	update_file_list(ALLOW_RET);
-	ret_dirent(get_first_file());
-	in_dme = 0; // exit dme - see req_fdc()
+	update_file_list(s,ALLOW_RET);
+	ret_dirent(s,get_first_file(&s->fc));
+	s->in_dme = 0; // exit dme - see req_fdc()
 }
 
 // b[0] = cmd
@@ -1835,26 +2536,26 @@ void dirent_get_first() {
 // Ignore the name & attr until after determining the action.
 // TS-DOS submits get-first & get-next requests with junk data
 // in the filename & attribute fields left over from previous actions.
-int req_dirent() {
+int req_dirent(SESSION* s) {
 	if (debug>1) {
 		dbg(2,"%s(%s)\n",__func__,
-			gb[27]==DIRENT_SET_NAME?"set_name":
-			gb[27]==DIRENT_GET_FIRST?"get_first":
-			gb[27]==DIRENT_GET_NEXT?"get_next":
-			gb[27]==DIRENT_GET_PREV?"get_prev":
-			gb[27]==DIRENT_CLOSE?"close":
+			s->gb[27]==DIRENT_SET_NAME?"set_name":
+			s->gb[27]==DIRENT_GET_FIRST?"get_first":
+			s->gb[27]==DIRENT_GET_NEXT?"get_next":
+			s->gb[27]==DIRENT_GET_PREV?"get_prev":
+			s->gb[27]==DIRENT_CLOSE?"close":
 			"UNKNOWN"
 		);
 		dbg(5,"gb[]\n");
-		dbg_b(5,gb,-1);
-		dbg_p(4,gb);
+		dbg_b(5,s->gb,-1);
+		dbg_p(4,s->gb);
 	}
 
-	switch (gb[27]) {
-		case DIRENT_SET_NAME:  dirent_set_name();           break;
-		case DIRENT_GET_FIRST: dirent_get_first();          break;
-		case DIRENT_GET_NEXT:  ret_dirent(get_next_file()); break;
-		case DIRENT_GET_PREV:  ret_dirent(get_prev_file()); break;
+	switch (s->gb[27]) {
+		case DIRENT_SET_NAME:  dirent_set_name(s);           break;
+		case DIRENT_GET_FIRST: dirent_get_first(s);          break;
+		case DIRENT_GET_NEXT:  ret_dirent(s,get_next_file(&s->fc)); break;
+		case DIRENT_GET_PREV:  ret_dirent(s,get_prev_file(&s->fc)); break;
 		case DIRENT_CLOSE:                                  break;
 	}
 	return 0;
@@ -1863,39 +2564,46 @@ int req_dirent() {
 // update dme_cwd with current dir, truncated & padded both required
 // If you don't send all 6 bytes, TS-DOS doesn't clear the previous
 // contents from the display
-void update_dme_cwd() {
+void update_dme_cwd(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
 	if (!dme_en) return;
 
 	int i;
-	update_cwd();
-	dbg(0,"Changed Dir: %s\n",cwd);
-	if (dir_depth) {
-		for (i=strlen(cwd); i>=0 ; i--) {
-			if (cwd[i]=='/') break;
-			if (upcase && cwd[i]>='a' && cwd[i]<='z') cwd[i]=cwd[i]-32;
-		}
-		snprintf(dme_cwd,base_len+1,"%-*.*s",6,6,cwd+1+i);
+	char t[7] = {0x00};
+	dbg(0,"Changed Dir: %s\n",s->cwd);
+	if (s->dir_depth) {
+		snprintf(t,7,"%s",strrchr(s->cwd,'/')+1);
+		if (upcase) for (i=0;t[i];i++) if (t[i]>='a' && t[i]<='z') t[i]=t[i]-32;
+		snprintf(s->dme_cwd,base_len+1,"%-*.*s",6,6,t);
 	} else {
-		memcpy(dme_cwd,dme_root_label,6);
+		memcpy(s->dme_cwd,dme_root_label,6);
 	}
 }
 
 // TS-DOS DME return
 // Construct a DME packet around dme_cwd and send it to the client
-void ret_dme_cwd() {
-	dbg(2,"%s(\"%s\")\n",__func__,dme_cwd);
+void ret_dme_cwd(SESSION* s) {
+	dbg(2,"%s(\"%s\")\n",__func__,s->dme_cwd);
 	if (!dme_en) return;
-	gb[0] = RET_STD[0];
-	gb[1] = 0x0B;   // not RET_STD[1] because TS-DOS DME violates the spec
-	gb[2] = 0x00;   // don't know why this byte is 0
-	memcpy(gb+3,dme_cwd,6); // 6 bytes 3-8 display in top-right corner
-	gb[9] = 0x00;   // gb[9]='.';  // remaining contents don't matter but length does
-	gb[10] = 0x00;  // gb[10]=dme_dir_label[0];
-	gb[11] = 0x00;  // gb[11]=dme_dir_label[1];
-	gb[12] = 0x00;  // gb[12]=0x20;
-	gb[13] = checksum(gb);
-	write_client_tty(gb,14);
+	s->gb[0] = RET_STD[0];
+	s->gb[1] = 0x0B;   // not RET_STD[1] because TS-DOS DME violates the spec
+	s->gb[2] = 0x00;   // don't know why this byte is 0
+	memcpy(s->gb+3,s->dme_cwd,6); // 6 bytes 3-8 display in top-right corner
+	s->gb[9] = 0x00;   // gb[9]='.';  // remaining contents don't matter but length does
+	s->gb[10] = 0x00;  // gb[10]=dme_dir_label[0];
+	s->gb[11] = 0x00;  // gb[11]=dme_dir_label[1];
+	s->gb[12] = 0x00;  // gb[12]=0x20;
+	s->gb[13] = checksum(s->gb);
+	write_client_tty(s,s->gb,14);
+}
+
+void req_fdc_dme(SESSION* s);
+
+void req_fdc_dme_timeout(void* arg) {
+	SESSION* s = arg;
+	dbg(3,"%s()\n",__func__);
+	req_fdc_dme(s);
+	flush_client_tx(s);
 }
 
 // The "switch to FDC-mode" command requires careful handling, because
@@ -1909,7 +2617,7 @@ void ret_dme_cwd() {
 //
 // Any FDC request might actually be a DME request
 // See ref/dme.txt for the full explaination
-void req_fdc() {
+void req_fdc(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
 
 	// TPDD1 does not send back any response
@@ -1925,7 +2633,7 @@ void req_fdc() {
 	//
 	// If we are in tpdd2 mode and reject the DME request like a real tpdd2,
 	// then TS-DOS does show the Bank button and you can switch banks 0 & 1.
-	if (model==2) { ret_std(ERR_PARAM); return; }
+	if (model==2) { ret_std(s,ERR_PARAM); return; }
 
 	// Some versions of TS-DOS send 2 FDC requests in a row, both with trailing
 	// 0x0D. Some versions also send a 3rd FDC request without the trailing 0x0D.
@@ -1934,155 +2642,329 @@ void req_fdc() {
 	// byte of a real FDC command, and respond to the 2nd and any other FDC
 	// requests with DME response instead of switching to FDC mode, as long as in_dme>1.
 	// in_dme is only set here, and only unset in dirent_get_first()
-	if (in_dme<2 && dme_en) {
-		// Try to read one more byte, and store it in ch[0] where get_fdc_req()
-		// can pick it up in case it was NOT the trailing 0x0D of a DME request
-		// but instead was the first byte of an actual FDC command.
-		// Timeout fast whether there is a byte or not.
+	//
+	// We need to see one more byte to decide. If it's not already in the
+	// rx ring, give it DME_WAIT_MS to show up. Nothing else is processed
+	// while dme_wait is set, and req_fdc_dme() finishes the job either when
+	// the next byte arrives or when the timer runs out.
+	if (s->in_dme<2 && dme_en && !rx_avail(s)) {
+		if (!ev_timer(req_fdc_dme_timeout,s,DME_WAIT_MS)) { s->dme_wait = true; return; }
+		dbg(0,"DME: can't wait for the next byte: %s\n",strerror(errno));
+	}
+	req_fdc_dme(s);
+}
+
+void req_fdc_dme(SESSION* s) {
+	dbg(3,"%s()\n",__func__);
+	bool eol = false;
+	s->dme_wait = false;
+	ev_timer_cancel(req_fdc_dme_timeout,s);
+	if (s->in_dme<2 && dme_en) {
+		// Peek at the byte, and leave it in the rx ring where get_fdc_cmd()
+		// can pick it up in case it was NOT the trailing 0x0D of a DME
+		// request but instead was the first byte of an actual FDC command.
 		//dbg(3,"looking for dme req %d of 2\n",in_dme+1);
-		ch[0] = 0x00;
-		client_tty_vmt(0,1);   // allow this read to time out, and fast
-		(void)!read(client_tty_fd,ch,1);
-		client_tty_vmt(-1,-1); // restore normal VMIN/VTIME
-		if (ch[0]==FDC_CMD_EOL) dbg(3,"Got dme req %d of 2\n",++in_dme);
-		//if (ch[0]) dbg(3,"ate a byte: %02X\n",ch[0]);
-	}
-	if (in_dme>1) {
-		ret_dme_cwd();
+		if (rx_peek(s)==FDC_CMD_EOL) { eol = true; dbg(3,"Got dme req %d of 2\n",++s->in_dme); }
+	}
+	if (s->in_dme>1) {
+		if (eol) rx_getc(s); // the 0x0D was part of the DME request, eat it
+		ret_dme_cwd(s);
 	} else {
-		operation_mode = MODE_FDC;
+		disk_sync();
+		s->operation_mode = MODE_FDC;
+		capture_note(s->id,"mode fdc");
 		dbg(2,"Switched to \"FDC\" mode\n"); // no response to client, just switch modes
 	}
 }
 
+// Build the next RET_READ packet in rp[] ahead of time, from the cached
+// file data, or from the readahead window, refilling it with one big read
+// when it runs out.
+void prep_read(SESSION* s) {
+	uint8_t* b = s->rp;
+	int i = 0, n;
+
+	if (s->o_data) {
+		i = s->o_data->size - s->o_pos;
+		if (i>REQ_RW_DATA_MAX) i = REQ_RW_DATA_MAX;
+		memcpy(b+2,s->o_data->buf+s->o_pos,i);
+		s->o_pos += i;
+	} else if (s->rw) {
+		while (i<REQ_RW_DATA_MAX) {
+			if (s->rw_pos>=s->rw_len) {
+				if (*s->o_img) break; // the whole file is already in rw[]
+				s->rw_pos = 0;
+				while ((n = read(s->o_file_h,s->rw,READ_WINDOW))<0 && errno==EINTR);
+				s->rw_len = n>0 ? n : 0;
+				if (!s->rw_len) break;
+			}
+			n = s->rw_len - s->rw_pos;
+			if (n>REQ_RW_DATA_MAX-i) n = REQ_RW_DATA_MAX-i;
+			memcpy(b+2+i,s->rw+s->rw_pos,n);
+			s->rw_pos += n;
+			i += n;
+		}
+	} else if ((i = read(s->o_file_h, b+2, REQ_RW_DATA_MAX))<0) i = 0;
+
+	b[0] = RET_READ;
+	b[1] = (uint8_t)i;
+	b[2+i] = checksum(b);
+	s->rp_ready = true;
+}
+
+void write_idle_timeout(void* arg);
+
+// Write out the write-behind buffer. Any error has to wait for the next
+// ret_std(), since the packets it came from were already acked.
+void flush_o_write(SESSION* s) {
+	unsigned p = 0;
+	int n;
+	ev_timer_cancel(write_idle_timeout,s);
+	while (p<s->wb_len) {
+		n = write(s->o_file_h,s->wb+p,s->wb_len-p);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) {
+			dbg(0,"Write failed: \"%s\": %s\n",s->cur_fe.local_fname,n<0?strerror(errno):"short write");
+			s->w_err = ERR_SECTOR_NUM;
+			break;
+		}
+		p += n;
+	}
+	s->wb_len = 0;
+}
+
+void write_idle_timeout(void* arg) {
+	dbg(3,"%s()\n",__func__);
+	flush_o_write(arg);
+}
+
+// Close the open file if any. If it was written, flush it, and make sure
+// nobody gets the old contents from the file data cache.
+void close_o_file(SESSION* s) {
+	struct stat st;
+	file_data_put(s->o_data);
+	s->o_data = NULL;
+	free(s->rw);
+	s->rw = NULL;
+	s->rp_ready = false;
+	if (*s->o_img) {
+		if (s->f_open_mode!=F_OPEN_READ && write_policy==WRITE_POLICY_FSYNC) disk_sync();
+		*s->o_img = 0x00;
+	}
+	if (s->o_file_h<0) return;
+	if (s->f_open_mode!=F_OPEN_READ) {
+		if (s->wb) flush_o_write(s);
+		if (write_policy==WRITE_POLICY_FSYNC && fsync(s->o_file_h)) s->w_err = ERR_SECTOR_NUM;
+		if (!fstat(s->o_file_h,&st)) file_data_forget(&st);
+		file_list_invalidate(s->cwd);
+	}
+	free(s->wb);
+	s->wb = NULL;
+	close(s->o_file_h);
+	s->o_file_h = -1;
+}
+
+// req_open() for a file in the disk image
+// Reads get the whole file up front, it's never more than 64k.
+// Writes go straight into the image, see fs_write().
+int req_open_image(SESSION* s, uint8_t omode) {
+	uint8_t e;
+	int i;
+
+	if (omode!=F_OPEN_WRITE && omode!=F_OPEN_APPEND && omode!=F_OPEN_READ) {
+		dbg(2,"Unrecognized mode: \"0x%02X\"\n",omode);
+		ret_std(s,ERR_PARAM);
+		return -1;
+	}
+	close_o_file(s);
+	if (!s->cur_file) {
+		ret_std(s,omode==F_OPEN_READ?ERR_NO_FILE:ERR_FMT_MISMATCH);
+		return -1;
+	}
+
+	e = mount_disk_image(s,omode==F_OPEN_READ?O_RDONLY:O_RDWR);
+	i = e ? -1 : fs_find(&fs,s->cur_file->client_fname,s->cur_file->attr);
+	if (!e) switch (omode) {
+		case F_OPEN_WRITE:
+			if (s->cur_file->flags&FE_FLAGS_DIR || i>=0) e = ERR_FMT_MISMATCH;
+			else {
+				uint64_t t0 = stats_now();
+				e = fs_create(&fs,s->cur_file->client_fname,s->cur_file->attr);
+				stats_image(t0);
+				if (!e) fs_wrote();
+			}
+			break;
+		case F_OPEN_APPEND:
+			if (i<0) e = ERR_FMT_MISMATCH;
+			break;
+		case F_OPEN_READ:
+			if (i<0) e = ERR_NO_FILE;
+			else if (!(s->rw = malloc(READ_WINDOW))) e = ERR_NO_FILE;
+			else {
+				uint64_t t0 = stats_now();
+				s->rw_len = fs_read(&fs,i,s->rw,READ_WINDOW);
+				s->rw_pos = 0;
+				stats_image(t0);
+			}
+			break;
+	}
+	if (e) {
+		ret_std(s,e);
+		return -1;
+	}
+
+	strcpy(s->o_img,s->cur_file->client_fname);
+	s->o_img_attr = s->cur_file->attr;
+	s->f_open_mode = omode;
+	dbg(1,"Open for %s: \"%s\" (%c) in the disk image\n",omode==F_OPEN_READ?"read":omode==F_OPEN_WRITE?"write":"append",s->o_img,s->o_img_attr);
+	ret_std(s,ERR_SUCCESS);
+	if (omode==F_OPEN_READ) {
+		flush_client_tx(s);
+		prep_read(s);
+	}
+	return 0;
+}
+
 // b[0] = fmt  0x01
 // b[1] = len  0x01
 // b[2] = mode 0x01 write new
 //             0x02 write append
 //             0x03 read
 // b[3] = chk
-int req_open() {
+int req_open(SESSION* s) {
 	if (debug>1) {
-		dbg(2,"%s(\"%s\",\"%c\")\n",__func__,cur_file->client_fname,cur_file->attr);
+		dbg(2,"%s(\"%s\",\"%c\")\n",__func__,s->cur_file->client_fname,s->cur_file->attr);
 		dbg(5,"gb[]\n");
-		dbg_b(5,gb,-1);
-		dbg_p(4,gb);
+		dbg_b(5,s->gb,-1);
+		dbg_p(4,s->gb);
 	}
 
-	uint8_t omode = gb[2];
+	uint8_t omode = s->gb[2];
+
+	if (*disk_img_fname) return req_open_image(s,omode);
 
 	switch(omode) {
 		case F_OPEN_WRITE:
 			dbg(2,"mode: write\n");
-			if (o_file_h >= 0) {
-				close(o_file_h);
-				o_file_h=-1;
-			}
-			if (cur_file->flags&FE_FLAGS_DIR) {
-				if (!mkdir(cur_file->local_fname,0777)) {
-					ret_std(ERR_SUCCESS);
+			close_o_file(s);
+			if (s->cur_file->flags&FE_FLAGS_DIR) {
+				if (!mkdirat(s->dir_fd,s->cur_file->local_fname,0777)) {
+					file_list_invalidate(s->cwd);
+					ret_std(s,ERR_SUCCESS);
 				} else {
-					ret_std(ERR_FMT_MISMATCH);
+					ret_std(s,ERR_FMT_MISMATCH);
 				}
 			} else {
-				o_file_h = open(cur_file->local_fname,O_CREAT|O_TRUNC|O_WRONLY|O_EXCL,0666);
-				if (o_file_h<0)
-					ret_std(ERR_FMT_MISMATCH);
+				s->o_file_h = openat(s->dir_fd,s->cur_file->local_fname,O_CREAT|O_TRUNC|O_WRONLY|O_EXCL,0666);
+				if (s->o_file_h<0)
+					ret_std(s,ERR_FMT_MISMATCH);
 				else {
-					f_open_mode=omode;
-					dl_fsetxattr(o_file_h, &cur_file->attr);
-					dbg(1,"Open for write: \"%s\" (%c)\n",cur_file->local_fname,cur_file->attr);
-					ret_std(ERR_SUCCESS);
+					s->f_open_mode=omode;
+					file_list_invalidate(s->cwd);
+					if (write_policy!=WRITE_POLICY_NONE) s->wb = malloc(WRITE_BUF_LEN);
+					dl_fsetxattr(s->o_file_h, &s->cur_file->attr);
+					dbg(1,"Open for write: \"%s\" (%c)\n",s->cur_file->local_fname,s->cur_file->attr);
+					ret_std(s,ERR_SUCCESS);
 				}
 			}
 			break;
 		case F_OPEN_APPEND:
 			dbg(2,"mode: append\n");
-			if (o_file_h >= 0) {
-				close(o_file_h);
-				o_file_h=-1;
-			}
-			if (cur_file==0) {
-				ret_std(ERR_FMT_MISMATCH);
+			close_o_file(s);
+			if (s->cur_file==0) {
+				ret_std(s,ERR_FMT_MISMATCH);
 				return -1;
 			}
-			o_file_h = open(cur_file->local_fname, O_WRONLY | O_APPEND);
-			if (o_file_h < 0)
-				ret_std(ERR_FMT_MISMATCH);
+			s->o_file_h = openat(s->dir_fd,s->cur_file->local_fname, O_WRONLY | O_APPEND);
+			if (s->o_file_h < 0)
+				ret_std(s,ERR_FMT_MISMATCH);
 			else {
-				f_open_mode=omode;
-				dl_fsetxattr(o_file_h, &cur_file->attr);
-				dbg(1,"Open for append: \"%s\" (%c)\n",cur_file->local_fname,cur_file->attr);
-				ret_std(ERR_SUCCESS);
+				s->f_open_mode=omode;
+				if (write_policy!=WRITE_POLICY_NONE) s->wb = malloc(WRITE_BUF_LEN);
+				dl_fsetxattr(s->o_file_h, &s->cur_file->attr);
+				dbg(1,"Open for append: \"%s\" (%c)\n",s->cur_file->local_fname,s->cur_file->attr);
+				ret_std(s,ERR_SUCCESS);
 			}
 			break;
 		case F_OPEN_READ:
 			dbg(2,"mode: read\n");
-			if (o_file_h >= 0) {
-				close(o_file_h);
-				o_file_h=-1;
-			}
-			if (cur_file==0) {
-				ret_std(ERR_NO_FILE);
+			close_o_file(s);
+			if (s->cur_file==0) {
+				ret_std(s,ERR_NO_FILE);
 				return -1;
 			}
 	
-			if (cur_file->flags&FE_FLAGS_DIR) {
-				int err=0;
+			if (s->cur_file->flags&FE_FLAGS_DIR) {
+				int err=0, fd;
 				// directory
-				if (cur_file->local_fname[0]=='.' && cur_file->local_fname[1]=='.') {
+				if (s->cur_file->local_fname[0]=='.' && s->cur_file->local_fname[1]=='.') {
 					// parent dir
-					if (dir_depth>0) {
-						err=chdir(cur_file->local_fname);
-						if (!err) dir_depth--;
+					if (s->dir_depth>0) {
+						fd = openat(s->dir_fd,"..",O_RDONLY|O_DIRECTORY);
+						if ((err = fd<0)) ;
+						else if (--s->dir_depth) { set_dir(s,fd); *strrchr(s->cwd,'/') = 0x00; }
+						else { close(fd); set_dir(s,share_fd[0]); strcpy(s->cwd,share_path[0]); }
 					}
 				} else {
 					// enter dir
-					err=chdir(cur_file->local_fname);
-					if (!err) dir_depth++;
+					fd = openat(s->dir_fd,s->cur_file->local_fname,O_RDONLY|O_DIRECTORY);
+					if (!(err = fd<0 || strlen(s->cwd)+1+strlen(s->cur_file->local_fname)>PATH_MAX)) {
+						set_dir(s,fd);
+						strcat(s->cwd,"/");
+						strcat(s->cwd,s->cur_file->local_fname);
+						s->dir_depth++;
+					} else if (fd>=0) close(fd);
 				}
-				update_dme_cwd();
-				if (err) ret_std(ERR_FMT_MISMATCH);
-				else ret_std(ERR_SUCCESS);
+				update_dme_cwd(s);
+				if (err) ret_std(s,ERR_FMT_MISMATCH);
+				else ret_std(s,ERR_SUCCESS);
 			} else {
 				// regular file
-				o_file_h = open(cur_file->local_fname, O_RDONLY);
-				if (o_file_h<0)
-					ret_std(ERR_NO_FILE);
+				s->o_file_h = openat(s->dir_fd,s->cur_file->local_fname, O_RDONLY);
+				if (s->o_file_h<0)
+					ret_std(s,ERR_NO_FILE);
 				else {
-					f_open_mode = omode;
-					dl_fgetxattr(o_file_h, &cur_file->attr);
-					dbg(1,"Open for read: \"%s\" (%c)\n",cur_file->local_fname,cur_file->attr);
-					ret_std(ERR_SUCCESS);
+					s->o_data = file_data_get(s->o_file_h);
+					s->o_pos = 0;
+					if (!s->o_data) { s->rw = malloc(READ_WINDOW); s->rw_len = s->rw_pos = 0; }
+					s->f_open_mode = omode;
+					dl_fgetxattr(s->o_file_h, &s->cur_file->attr);
+					dbg(1,"Open for read: \"%s\" (%c)\n",s->cur_file->local_fname,s->cur_file->attr);
+					ret_std(s,ERR_SUCCESS);
+					flush_client_tx(s);
+					prep_read(s);
 				}
 			}
 			break;
 		default:
 			dbg(2,"Unrecognized mode: \"0x%02X\"\n",omode);
-			ret_std(ERR_PARAM);
+			ret_std(s,ERR_PARAM);
 			break;
 	}
-	return o_file_h;
+	return s->o_file_h;
 }
 
-void req_read() {
+// The response is normally already built by prep_read(), so all that's
+// left to do here is hand it to the tty. Then the next one is built
+// while this one is going out.
+void req_read(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
 	int i;
 
-	if (o_file_h<0) {
-		ret_std(ERR_NO_FNAME);
+	if (s->o_file_h<0 && !*s->o_img) {
+		ret_std(s,ERR_NO_FNAME);
 		return;
 	}
-	if (f_open_mode!=F_OPEN_READ) {
-		ret_std(ERR_FMT_MISMATCH);
+	if (s->f_open_mode!=F_OPEN_READ) {
+		ret_std(s,ERR_FMT_MISMATCH);
 		return;
 	}
 
-	i = read(o_file_h, gb+2, REQ_RW_DATA_MAX);
-
-	gb[0] = RET_READ;
-	gb[1] = (uint8_t)i;
-	gb[2+i] = checksum(gb);
+	if (!s->rp_ready) prep_read(s);
+	i = s->rp[1];
+	write_client_tty(s,s->rp, 3+i);
+	flush_client_tx(s);
+	s->rp_ready = false;
 
 	if (debug<2) {
 		dbg(1,".");
@@ -2091,54 +2973,94 @@ void req_read() {
 
 	if (debug>1) {
 		dbg(4,"...outgoing packet...\n");
-		dbg(5,"gb[]\n");
-		dbg_b(5,gb,-1);
-		dbg_p(4,gb);
+		dbg(5,"rp[]\n");
+		dbg_b(5,s->rp,-1);
+		dbg_p(4,s->rp);
 		dbg(4,".....................\n");
 	}
 
-	write_client_tty(gb, 3+i);
+	if (i==REQ_RW_DATA_MAX) prep_read(s);
 }
 
 // b[0] = 0x04
 // b[1] = 0x01 - 0x80
 // b[2] = b[1] bytes
 // b[2+len] = chk
-void req_write() {
+void req_write(SESSION* s) {
 	if (debug>1) {
 		dbg(2,"%s()\n",__func__);
 		dbg(4,"...incoming packet...\n");
 		dbg(5,"gb[]\n");
-		dbg_b(5,gb,-1);
-		dbg_p(4,gb);
+		dbg_b(5,s->gb,-1);
+		dbg_p(4,s->gb);
 		dbg(4,".....................\n");
 	}
 
-	if (o_file_h<0) {ret_std(ERR_NO_FNAME); return;}
+	if (s->o_file_h<0 && !*s->o_img) {ret_std(s,ERR_NO_FNAME); return;}
 
-	if (f_open_mode!=F_OPEN_WRITE && f_open_mode !=F_OPEN_APPEND) {
-		ret_std(ERR_FMT_MISMATCH);
+	if (s->f_open_mode!=F_OPEN_WRITE && s->f_open_mode !=F_OPEN_APPEND) {
+		ret_std(s,ERR_FMT_MISMATCH);
 		return;
 	}
 
 	if (debug<2) {
 		dbg(1,".");
-		if (gb[1]<REQ_RW_DATA_MAX) dbg(1,"\n"); // final packet
+		if (s->gb[1]<REQ_RW_DATA_MAX) dbg(1,"\n"); // final packet
+	}
+
+	if (*s->o_img) {
+		uint8_t e = mount_disk_image(s,O_RDWR);
+		int i = e ? -1 : fs_find(&fs,s->o_img,s->o_img_attr);
+		if (!e && i<0) e = ERR_NO_FILE; // deleted out from under us
+		uint64_t t0 = stats_now();
+		if (!e) e = fs_write(&fs,i,s->gb+2,s->gb[1]);
+		stats_image(t0);
+		if (!e) fs_wrote();
+		ret_std(s,e);
+		return;
 	}
 
-	if (write (o_file_h,gb+2,gb[1]) != gb[1]) ret_std (ERR_SECTOR_NUM);
-	else ret_std (ERR_SUCCESS);
+	// write-behind: ack now, write later
+	if (s->wb) {
+		if (s->wb_len+s->gb[1]>WRITE_BUF_LEN) flush_o_write(s);
+		memcpy(s->wb+s->wb_len,s->gb+2,s->gb[1]);
+		s->wb_len += s->gb[1];
+		if (ev_timer(write_idle_timeout,s,WRITE_IDLE_MS)) flush_o_write(s); // no timer, write it now
+		ret_std (s,ERR_SUCCESS);
+		return;
+	}
+
+	if (write (s->o_file_h,s->gb+2,s->gb[1]) != s->gb[1]) ret_std (s,ERR_SECTOR_NUM);
+	else ret_std (s,ERR_SUCCESS);
 }
 
-void req_delete() {
+void req_delete(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	if (cur_file->flags&FE_FLAGS_DIR) rmdir(cur_file->local_fname);
-	else unlink (cur_file->local_fname);
-	dbg(1,"Deleted: %s\n",cur_file->local_fname);
-	ret_std (ERR_SUCCESS);
+	struct stat st;
+	if (*disk_img_fname) {
+		uint8_t e = mount_disk_image(s,O_RDWR);
+		int i = e ? -1 : fs_find(&fs,s->cur_file->client_fname,s->cur_file->attr);
+		if (!e && i<0) e = ERR_NO_FILE;
+		uint64_t t0 = stats_now();
+		if (!e) e = fs_delete(&fs,i);
+		stats_image(t0);
+		if (!e) {
+			fs_wrote();
+			dbg(1,"Deleted: \"%s\" from the disk image\n",s->cur_file->client_fname);
+		}
+		ret_std(s,e);
+		return;
+	}
+	if (s->cur_file->flags&FE_FLAGS_DIR) unlinkat(s->dir_fd,s->cur_file->local_fname,AT_REMOVEDIR);
+	else {
+		if (!fstatat(s->dir_fd,s->cur_file->local_fname,&st,0)) file_data_forget(&st); // the inode may be reused
+		unlinkat(s->dir_fd,s->cur_file->local_fname,0);
+	}
+	file_list_invalidate(s->cwd);
+	dbg(1,"Deleted: %s\n",s->cur_file->local_fname);
+	ret_std (s,ERR_SUCCESS);
 }
 
-
 /*
  * PDD2 cache load, cache commit, mem read, mem write
  * 
@@ -2180,13 +3102,13 @@ void req_delete() {
  */
 
 // also the return format for mem_write and undocumented 0x0F
-void ret_cache(uint8_t e) {
+void ret_cache(SESSION* s, uint8_t e) {
 	dbg(3,"%s()\n",__func__);
-	gb[0] = RET_CACHE[0];
-	gb[1] = RET_CACHE[1];
-	gb[2] = e;
-	gb[3] = checksum(gb);
-	write_client_tty(gb,4);
+	s->gb[0] = RET_CACHE[0];
+	s->gb[1] = RET_CACHE[1];
+	s->gb[2] = e;
+	s->gb[3] = checksum(s->gb);
+	write_client_tty(s,s->gb,4);
 }
 
 /*
@@ -2204,35 +3126,38 @@ void ret_cache(uint8_t e) {
  *   b[5] side (always 00)
  *   b[6] sector 0-1
  */
-void req_cache() {
-	dbg(3,"%s(action=%u track=%u sector=%u)\n",__func__,gb[2],gb[4],gb[6]);
+void req_cache(SESSION* s) {
+	dbg(3,"%s(action=%u track=%u sector=%u)\n",__func__,s->gb[2],s->gb[4],s->gb[6]);
 	if (model==1) return;
-	uint8_t a=gb[2];
+	uint8_t a=s->gb[2];
 	//uint_16_t t=b[3]*256+b[4]; // b[3] is always 0
-	uint8_t t=gb[4];
+	uint8_t t=s->gb[4];
 	//int d=gb[5]; // side#? - always 0
-	uint8_t s=gb[6]; // sector
-	if (t>=PDD2_TRACKS || s>=PDD2_SECTORS) { ret_cache(ERR_PARAM); return; }
-	uint8_t rn = t*2 + s; // convert track#:sector# to linear record#
+	uint8_t n=s->gb[6]; // sector
+	if (t>=PDD2_TRACKS || n>=PDD2_SECTORS) { ret_cache(s,ERR_PARAM); return; }
+	uint8_t rn = t*2 + n; // convert track#:sector# to linear record#
 	uint8_t e = ERR_SUCCESS;
+	uint8_t* r;
 
 	switch (a) {
 		case CACHE_LOAD:
-			dbg(2,"cache load: track:%u  sector:%u\n",t,s);
+			dbg(2,"cache load: track:%u  sector:%u\n",t,n);
 
-			// open disk image file and seek to record number
-			if ((e = open_disk_image(rn,O_RDONLY))) break;
+			if ((e = open_disk_image(s,O_RDONLY))) break;
+			stats_cache(rn>=s->pf_lo && rn<s->pf_hi);
+			if (!(r = disk_rec(rn,false))) { e = ERR_DEFECTIVE; break; }
+			s->pf_next = rn+1;
 
 			// virtual 2k drive ram
-			memset(ram,0x00,RAM_LEN); // 2k ram at 0x8000 - 0x87FF
-			ram[0]=PDD2_CACHE_LEN_MSB; // len MSB - always 0x05
-			ram[1]=PDD2_CACHE_LEN_LSB; // len LSB - always 0x13
-			ram[2]=rn;   // linear sector number (0-159)
+			memset(s->ram,0x00,RAM_LEN); // 2k ram at 0x8000 - 0x87FF
+			s->ram[0]=PDD2_CACHE_LEN_MSB; // len MSB - always 0x05
+			s->ram[1]=PDD2_CACHE_LEN_LSB; // len LSB - always 0x13
+			s->ram[2]=rn;   // linear sector number (0-159)
 			//ram[0x03]=0x00; // side number? - always 0
-			if (read(disk_img_fd,ram+PDD2_ID_REL,SECTOR_HEADER_LEN)!=SECTOR_HEADER_LEN) { e = ERR_DEFECTIVE; break; }
+			memcpy(s->ram+PDD2_ID_REL,r,SECTOR_HEADER_LEN);
 			//ram[0x11]= // unknown but changes when other data changes, crc msb?
 			//ram[0x12]= // unknown but changes when other data changes, crc lsb?
-			if (read(disk_img_fd,ram+PDD2_DATA_REL,SECTOR_DATA_LEN)!=SECTOR_DATA_LEN) { e = ERR_DEFECTIVE; break; }
+			memcpy(s->ram+PDD2_DATA_REL,r+SECTOR_HEADER_LEN,SECTOR_DATA_LEN);
 			//ram[0x0513]= // unknown
 			//...          //
 			//ram[0x07FF]= // end of 2k ram
@@ -2241,18 +3166,23 @@ void req_cache() {
 		case CACHE_COMMIT:   // write cache to disk
 		case CACHE_COMMIT_VERIFY: // write cache to disk and verify
 
-			// open disk image file and seek to record number
-			dbg(2,"cache commit: track:%u  sector:%u\n",t,s);
-			if ((e = open_disk_image(rn,O_WRONLY))) break;
-			if (write(disk_img_fd,ram+PDD2_ID_REL,SECTOR_HEADER_LEN)!=SECTOR_HEADER_LEN) { e = ERR_DEFECTIVE; break; }
-			if (write(disk_img_fd,ram+PDD2_DATA_REL,SECTOR_DATA_LEN)!=SECTOR_DATA_LEN) { e = ERR_DEFECTIVE; break; }
+			dbg(2,"cache commit: track:%u  sector:%u\n",t,n);
+			if ((e = open_disk_image(s,O_WRONLY))) break;
+			if (!(r = disk_rec(rn,true))) { e = ERR_DEFECTIVE; break; }
+			memcpy(r,s->ram+PDD2_ID_REL,SECTOR_HEADER_LEN);
+			memcpy(r+SECTOR_HEADER_LEN,s->ram+PDD2_DATA_REL,SECTOR_DATA_LEN);
+			disk_committed(rn);
+			if (a!=CACHE_COMMIT_VERIFY) break;
+			// against what went into the journal, else the image in memory
+			if (!(r = (uint8_t*)jnl_rec(&disk_jnl,rn)) && !(r = disk_rec(rn,false))) { e = ERR_DEFECTIVE; break; }
+			if (memcmp(r,s->ram+PDD2_ID_REL,SECTOR_HEADER_LEN)) e = ERR_ID_CRC;
+			else if (memcmp(r+SECTOR_HEADER_LEN,s->ram+PDD2_DATA_REL,SECTOR_DATA_LEN)) e = ERR_DATA_CRC;
 			break;
 		default: e = ERR_PARAM;
 	}
-	close(disk_img_fd);
-	dbg_b(3,ram,RAM_LEN);
+	dbg_b(3,s->ram,RAM_LEN);
 	if (e) dbg(2,"FAILED\n");
-	ret_cache(e);
+	ret_cache(s,e);
 }
 
 /*
@@ -2274,42 +3204,51 @@ void req_cache() {
  *      b[5+] data       dlen bytes
  * b[#] chk
  */
-void req_mem_read() {
+void req_mem_read(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 	if (model==1) return;
-	uint8_t a = gb[2];
-	uint16_t o = gb[3]*256+gb[4];
-	uint8_t l = gb[5];
+	uint8_t a = s->gb[2];
+	uint16_t o = s->gb[3]*256+s->gb[4];
+	uint8_t l = s->gb[5];
 	uint8_t e = ERR_SUCCESS;
-	uint8_t* src = ram; // source of virtual ram data, ram[], rom[], etc
+	uint8_t* src = s->ram; // source of virtual ram data, ram[], rom[], etc
 	switch (a) {
 		case MEM_CACHE:
 			dbg(2,"mem_read: cache  offset:0x%04X  len:0x%02X\n",o,l);
 			if (o+l>SECTOR_DATA_LEN || l>PDD2_MEM_READ_MAX) e=ERR_PARAM;
 			o+=PDD2_DATA_REL;
+			// a whole-disk copy will want the next ones soon
+			if (s->pf_next>=0 && disk) {
+				uint64_t t0 = stats_now();
+				img_prefetch(disk,s->pf_next,CACHE_PREFETCH);
+				stats_image(t0);
+				s->pf_lo = s->pf_next;
+				s->pf_hi = s->pf_next+CACHE_PREFETCH;
+				s->pf_next = -1;
+			}
 			break;
 		case MEM_CPU:
 			dbg(2,"mem_read: cpu  addr:0x%04X  len:0x%02X\n",o,l);
-			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=ioport; o-=IOPORT_ADDR; break; }
-			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=cpuram; o-=CPURAM_ADDR; break; }
-			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=ga; o-=GA_ADDR; break; }
+			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=s->ioport; o-=IOPORT_ADDR; break; }
+			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=s->cpuram; o-=CPURAM_ADDR; break; }
+			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=s->ga; o-=GA_ADDR; break; }
 			if (o>=RAM_ADDR && o<RAM_ADDR+RAM_LEN) { o-=RAM_ADDR; break; }
 			if (o>=ROM_ADDR && o<ROM_ADDR+ROM_LEN) { src=rom; o-=ROM_ADDR; break; }
 			break;
 		default: e=ERR_PARAM;
 	}
-	if (e) { dbg(1,"mem_read: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(e); return; }
+	if (e) { dbg(1,"mem_read: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(s,e); return; }
 
 	// copy some data from src[] and return to client
-	gb[0] = RET_MEM_READ;
-	gb[1] = 3+l;  // len = area(1 byte) + offset(2 bytes) + data(1-252 bytes)
+	s->gb[0] = RET_MEM_READ;
+	s->gb[1] = 3+l;  // len = area(1 byte) + offset(2 bytes) + data(1-252 bytes)
 	//gb[2] = gb[2]; // area
 	//gb[3] = gb[3]; // offset msb
 	//gb[4] = gb[4]; // offset lsb
-	memcpy(gb+5,src+o,l); // data
-	gb[2+gb[1]] = checksum(gb); // chk
-	dbg_b(3,gb,-1);
-	write_client_tty(gb,gb[1]+3);
+	memcpy(s->gb+5,src+o,l); // data
+	s->gb[2+s->gb[1]] = checksum(s->gb); // chk
+	dbg_b(3,s->gb,-1);
+	write_client_tty(s,s->gb,s->gb[1]+3);
 }
 
 /*
@@ -2323,15 +3262,15 @@ void req_mem_read() {
  *      b[5+] data
  * b[#] chk
  */
-void req_mem_write() {
+void req_mem_write(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 	if (model==1) return;
-	uint8_t a = gb[2];
-	uint16_t o = gb[3]*256+gb[4];
-	uint8_t s = 5; // start of data
-	uint8_t l = gb[1]-3; // length of data = length of packet - 3
+	uint8_t a = s->gb[2];
+	uint16_t o = s->gb[3]*256+s->gb[4];
+	uint8_t d = 5; // start of data
+	uint8_t l = s->gb[1]-3; // length of data = length of packet - 3
 	uint8_t e = ERR_SUCCESS;
-	uint8_t* src = ram; // source of virtual ram data, ram[], rom[], etc
+	uint8_t* src = s->ram; // source of virtual ram data, ram[], rom[], etc
 	switch (a) {
 		case MEM_CACHE:
 			dbg(2,"mem_write: cache  offset:0x%04X  len:0x%02X\n",o,l);
@@ -2340,21 +3279,21 @@ void req_mem_write() {
 			break;
 		case MEM_CPU:
 			dbg(2,"mem_write: cpu  addr:0x%04X  len:0x%02X\n",o,l);
-			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=ioport; o-=IOPORT_ADDR; break; }
-			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=cpuram; o-=CPURAM_ADDR; break; }
-			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=ga; o-=GA_ADDR; break; }
+			if (o>=IOPORT_ADDR && o<IOPORT_ADDR+IOPORT_LEN) { src=s->ioport; o-=IOPORT_ADDR; break; }
+			if (o>=CPURAM_ADDR && o<CPURAM_ADDR+CPURAM_LEN) { src=s->cpuram; o-=CPURAM_ADDR; break; }
+			if (o>=GA_ADDR && o<GA_ADDR+GA_LEN) { src=s->ga; o-=GA_ADDR; break; }
 			if (o>=RAM_ADDR && o<RAM_ADDR+RAM_LEN) { o-=RAM_ADDR; break; }
 			//if (o>=ROM_ADDR && o<ROM_ADDR+ROM_LEN) { src=rom; o-=ROM_ADDR; break; }
 			o-=RAM_ADDR;
 			break;
 		default: e=ERR_PARAM;
 	}
-	if (e) { dbg(1,"mem_write: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(e); return; }
+	if (e) { dbg(1,"mem_write: ERROR: 0x%02X  area:0x%02X  offset:0x%04X  len:0x%02X\n",e,a,o,l); ret_cache(s,e); return; }
 
 	// copy data from client over part of src[]
-	memcpy(src+o,gb+s,l);
+	memcpy(src+o,s->gb+d,l);
 	dbg_b(3,src+o,l);
-	ret_cache(ERR_SUCCESS);
+	ret_cache(s,ERR_SUCCESS);
 }
 
 /*
@@ -2370,28 +3309,28 @@ void req_mem_write() {
  * that it can use TPDD2 features. (not a big deal really)
  *
  */
-void ret_version() {
+void ret_version(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 	if (model==1) return;
-	gb[0] = RET_VERSION[0];
-	gb[1] = RET_VERSION[1];
-	gb[2] = VERSION_MSB;
-	gb[3] = VERSION_LSB;
-	gb[4] = SIDES;
-	gb[5] = TRACKS_MSB;
-	gb[6] = TRACKS_LSB;
-	gb[7] = SECTOR_SIZE_MSB;
-	gb[8] = SECTOR_SIZE_LSB;
-	gb[9] = SECTORS_PER_TRACK;
-	gb[10] = DIRENTS_MSB;
-	gb[11] = DIRENTS_LSB;
-	gb[12] = MAX_FD;
-	gb[13] = MODEL_CODE;
-	gb[14] = VERSION_R0;
-	gb[15] = VERSION_R1;
-	gb[16] = VERSION_R2;
-	gb[17] = checksum(gb);
-	write_client_tty(gb,gb[1]+3);
+	s->gb[0] = RET_VERSION[0];
+	s->gb[1] = RET_VERSION[1];
+	s->gb[2] = VERSION_MSB;
+	s->gb[3] = VERSION_LSB;
+	s->gb[4] = SIDES;
+	s->gb[5] = TRACKS_MSB;
+	s->gb[6] = TRACKS_LSB;
+	s->gb[7] = SECTOR_SIZE_MSB;
+	s->gb[8] = SECTOR_SIZE_LSB;
+	s->gb[9] = SECTORS_PER_TRACK;
+	s->gb[10] = DIRENTS_MSB;
+	s->gb[11] = DIRENTS_LSB;
+	s->gb[12] = MAX_FD;
+	s->gb[13] = MODEL_CODE;
+	s->gb[14] = VERSION_R0;
+	s->gb[15] = VERSION_R1;
+	s->gb[16] = VERSION_R2;
+	s->gb[17] = checksum(s->gb);
+	write_client_tty(s,s->gb,s->gb[1]+3);
 }
 
 /*
@@ -2401,45 +3340,62 @@ void ret_version() {
  * Client sends  : 33 00
  * TPDD2 responds: 3A 06 80 13 05 00 10 E1
  */
-void ret_sysinfo() {
+void ret_sysinfo(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 	if (model==1) return;
-	gb[0] = RET_SYSINFO[0];
-	gb[1] = RET_SYSINFO[1];
-	gb[2] = SECTOR_CACHE_START_MSB;
-	gb[3] = SECTOR_CACHE_START_LSB;
-	gb[4] = SECTOR_SIZE_MSB;
-	gb[5] = SECTOR_SIZE_LSB;
-	gb[6] = SYSINFO_CPU_CODE;
-	gb[7] = MODEL_CODE;
-	gb[8] = checksum(gb);
-	write_client_tty(gb,gb[1]+3);
-}
-
-void req_rename() {
-	dbg(3,"%s(%-*.*s)\n",__func__,TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,gb+2);
+	s->gb[0] = RET_SYSINFO[0];
+	s->gb[1] = RET_SYSINFO[1];
+	s->gb[2] = SECTOR_CACHE_START_MSB;
+	s->gb[3] = SECTOR_CACHE_START_LSB;
+	s->gb[4] = SECTOR_SIZE_MSB;
+	s->gb[5] = SECTOR_SIZE_LSB;
+	s->gb[6] = SYSINFO_CPU_CODE;
+	s->gb[7] = MODEL_CODE;
+	s->gb[8] = checksum(s->gb);
+	write_client_tty(s,s->gb,s->gb[1]+3);
+}
+
+void req_rename(SESSION* s) {
+	dbg(3,"%s(%-*.*s)\n",__func__,TPDD_FILENAME_LEN,TPDD_FILENAME_LEN,s->gb+2);
 	if (model==1) return;
-	char *t = (char *)gb + 2;
+	char *t = (char *)s->gb + 2;
+	if (*disk_img_fname) {
+		char n[TPDD_FILENAME_LEN+1] = {0x00};
+		memcpy(n,t,TPDD_FILENAME_LEN);
+		for (int j=TPDD_FILENAME_LEN-1;j>=0 && n[j]==' ';j--) n[j] = 0x00;
+		uint8_t e = mount_disk_image(s,O_RDWR);
+		int i = e ? -1 : fs_find(&fs,s->cur_file->client_fname,s->cur_file->attr);
+		if (!e && i<0) e = ERR_NO_FILE;
+		uint64_t t0 = stats_now();
+		if (!e) e = fs_rename(&fs,i,n);
+		stats_image(t0);
+		if (!e) {
+			fs_wrote();
+			dbg(1,"Renamed: \"%s\" -> \"%s\" in the disk image\n",s->cur_file->client_fname,n);
+		}
+		ret_std(s,e);
+		return;
+	}
 	memcpy(t,collapse_padded_fname(t),TPDD_FILENAME_LEN);
-	if (rename(cur_file->local_fname,t))
-		ret_std(ERR_SECTOR_NUM);
+	if (renameat(s->dir_fd,s->cur_file->local_fname,s->dir_fd,t))
+		ret_std(s,ERR_SECTOR_NUM);
 	else {
-		dbg(1,"Renamed: %s -> %s\n",cur_file->local_fname,t);
-		ret_std(ERR_SUCCESS);
+		file_list_invalidate(s->cwd);
+		dbg(1,"Renamed: %s -> %s\n",s->cur_file->local_fname,t);
+		ret_std(s,ERR_SUCCESS);
 	}
 }
 
-void req_close() {
+void req_close(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	if (o_file_h>=0) close(o_file_h);
-	o_file_h = -1;
-	dbg(2,"Closed: \"%s\"\n",cur_file->local_fname);
-	ret_std(ERR_SUCCESS);
+	close_o_file(s);
+	dbg(2,"Closed: \"%s\"\n",s->cur_file->local_fname);
+	ret_std(s,ERR_SUCCESS);
 }
 
-void req_status() {
+void req_status(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
-	ret_std(ERR_SUCCESS);
+	ret_std(s,ERR_SUCCESS);
 }
 
 // TPDD2 only
@@ -2452,19 +3408,20 @@ void req_status() {
 // 2 disk not inserted
 // 1 write protected
 // 0 low power
-void ret_condition() {
+void ret_condition(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
-	gb[0] = RET_CONDITION[0];
-	gb[1] = RET_CONDITION[1];
-	gb[2] = pdd2_condition;
-	gb[3] = checksum(gb);
-	write_client_tty(gb,gb[1]+3);
+	s->gb[0] = RET_CONDITION[0];
+	s->gb[1] = RET_CONDITION[1];
+	s->gb[2] = s->pdd2_condition;
+	s->gb[3] = checksum(s->gb);
+	write_client_tty(s,s->gb,s->gb[1]+3);
+	s->pdd2_condition &= ~(1<<PDD2_COND_BIT_CHANGED); // reported once
 }
 
-void req_condition() {
+void req_condition(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
 	if (model!=2) return;
-	ret_condition();
+	ret_condition(s);
 }
 
 // opr-format - this creates a disk that can load & save files
@@ -2472,42 +3429,27 @@ void req_condition() {
 // opr-format is just this:
 //   start with: fdc-format 0    (0=64-byte logical sector size)
 //   then: write 0x80 at sector 0 byte 1240 (aka physical:0 logical:20 byte:25 counting from 1)
-void req_format() {
+void req_format(SESSION* s) {
 	dbg(2,"%s()\n",__func__);
 	const int rc = model==1?(PDD1_TRACKS*PDD1_SECTORS):(PDD2_TRACKS*PDD2_SECTORS); // records count
-	int rn = 0;          // record number
 
 	dbg(0,"Operation-mode Format (make a filesystem)\n");
 
-	uint8_t e = open_disk_image(0,O_WRONLY);
+	uint8_t e = open_disk_image(s,O_WRONLY);
 	if (e==ERR_READ_TIMEOUT) e=ERR_FMT_INTERRUPT;
-	if (e) { ret_std(e); return; }
+	if (e) { ret_std(s,e); return; }
 
 	// write the image
-	// Real drive TPDD1 fresh Operation-mode format is strange.
-	// Any sector with any data gets LSC 0, and all others get LSC 1.
-	// Later, any sector that gets used by a file gets changed from LSC 1 to
-	// LSC 0, and never changed back even when files are deleted.
-	// A fresh format has one byte of data in sector 0 in the SMT,
-	// so a fresh format sector 0 has LSC 0 and all other sectors have LSC 1.
-	// We exactly mimick that here "just because", even though the LSC 1s
-	// don't seem to actually matter and we could just make all LSC 0.
-	for (rn=0;rn<rc;rn++) {
-		memset(rb,0x00,SECTOR_LEN);
-		switch (model) {
-			case 1: if (rn==0) rb[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD1_SMT; else rb[0]=1; break;
-			default: rb[0]=0x16; if (rn<2) { rb[1]=0xFF; rb[SECTOR_HEADER_LEN+SMT_OFFSET]=PDD2_SMT; }
-		}
-		if (write(disk_img_fd,rb,SECTOR_LEN)<0) break;
-	}
-
-	if (rn<rc) {
+	const uint8_t* t = format_template(model==1?FMT_PDD1:FMT_PDD2);
+	ev_timer_cancel(disk_idle_timeout,NULL);
+	uint64_t t0 = stats_now();
+	if (!t || disk->records!=(unsigned)rc || img_fill(disk,t) || (disk_jnl.d==disk ? jnl_checkpoint(&disk_jnl) : img_sync(disk))) {
 		dbg(0,"%s\n",strerror(errno));
 		e = ERR_FMT_INTERRUPT;
 	}
+	stats_image(t0);
 
-	close(disk_img_fd);
-	ret_std(e);
+	ret_std(s,e);
 }
 
 /*
@@ -2530,15 +3472,15 @@ void req_format() {
  *      b[4] reg X lsb
  * b[5] chk
 */
-void ret_exec(uint8_t reg_A, uint16_t reg_X) {
+void ret_exec(SESSION* s, uint8_t reg_A, uint16_t reg_X) {
 	dbg(3,"%s(%u,%u)\n",__func__,reg_A,reg_X);
-	gb[0] = RET_EXEC[0];
-	gb[1] = RET_EXEC[1];
-	gb[2] = reg_A;
-	gb[3] = (uint8_t)(reg_X >> 0x08); // msb
-	gb[4] = (uint8_t)(reg_X & 0xFF);  // lsb
-	gb[5] = checksum(gb);
-	write_client_tty(gb,6);
+	s->gb[0] = RET_EXEC[0];
+	s->gb[1] = RET_EXEC[1];
+	s->gb[2] = reg_A;
+	s->gb[3] = (uint8_t)(reg_X >> 0x08); // msb
+	s->gb[4] = (uint8_t)(reg_X & 0xFF);  // lsb
+	s->gb[5] = checksum(s->gb);
+	write_client_tty(s,s->gb,6);
 }
 
 /* Load cpu registers A and X with supplied values, then jump to supplied address.
@@ -2557,48 +3499,83 @@ void ret_exec(uint8_t reg_A, uint16_t reg_X) {
  *      b[6] reg X lsb
  * b[7] chk
  */
-void req_exec() {
+void req_exec(SESSION* s) {
 	dbg(3,"%s() ***STUB***\n",__func__);
 	if (model==1) return;
-	uint16_t addr = gb[2]*256+gb[3];
-	uint8_t reg_A = gb[4];
-	uint16_t reg_X = gb[5]*256+gb[6];
+	uint16_t addr = s->gb[2]*256+s->gb[3];
+	uint8_t reg_A = s->gb[4];
+	uint16_t reg_X = s->gb[5]*256+s->gb[6];
 	dbg(2,"exec:  addr:%u  A:%u  X:%u\n",addr,reg_A,reg_X);
 	/*
 	 * ...6301 emulator here...
 	 * executed code leaves new values in reg_A and reg_X
 	 */
 	dbg(2,"(stub, exec() not implimented)");
-	ret_exec(reg_A,reg_X);
+	ret_exec(s,reg_A,reg_X);
 }
 
-void get_opr_cmd() {
+// Operation-mode packet framing
+// Bytes from the rx ring are fed to opr_frame() one at a time, and it
+// assembles "ZZ" fmt len payload chk into gb[] across as many reads as it
+// takes. Any bytes after the end of a packet stay in the ring for the next.
+#define OPR_SYNC0 0 // hunting for the 1st "Z"
+#define OPR_SYNC1 1 // hunting for the 2nd "Z"
+#define OPR_FMT   2 // next byte is the block format
+#define OPR_LEN   3 // next byte is the payload length
+#define OPR_DATA  4 // payload and checksum
+// returns true when gb[] holds a complete (not yet verified) packet
+bool opr_frame(SESSION* s, uint8_t c) {
+	switch (s->opr_state) {
+		case OPR_SYNC0:
+			if (c==OPR_CMD_SYNC) s->opr_state = OPR_SYNC1;
+			break;
+		case OPR_SYNC1:
+			s->opr_state = (c==OPR_CMD_SYNC) ? OPR_FMT : OPR_SYNC0;
+			break;
+		case OPR_FMT:
+			memset(s->gb,0x00,TPDD_MSG_MAX);
+			s->gb[0] = c;
+			s->opr_state = OPR_LEN;
+			break;
+		case OPR_LEN:
+			s->gb[1] = c;
+			s->opr_pos = 2;
+			s->opr_state = OPR_DATA;
+			break;
+		default:
+			s->gb[s->opr_pos++] = c;
+			if (s->opr_pos < s->gb[1]+3) break;
+			s->opr_state = OPR_SYNC0;
+			return true;
+	}
+	return false;
+}
+
+// Takes bytes from the rx ring until a whole packet has arrived, then
+// executes it. Returns without doing anything if the ring runs dry first.
+void get_opr_cmd(SESSION* s) {
 	dbg(3,"%s()\n",__func__);
 	uint16_t i = 0;
-	memset(gb,0x00,TPDD_MSG_MAX);
+	int r;
 
-	while (read_client_tty(&gb,1) == 1) {
-		if (gb[0]==OPR_CMD_SYNC) i++; else { i=0; gb[0]=0x00; continue; }
-		if (i<2) { gb[0]=0x00; continue; }
-		if (read_client_tty(&gb,2) == 2) if (read_client_tty(&gb[2],gb[1]+1) == gb[1]+1) break;
-		i=0; memset(gb,0x00,TPDD_MSG_MAX);
-	}
+	while ((r = rx_getc(s))>=0) if (opr_frame(s,r)) break;
+	if (r<0) return;
 
-	dbg_p(3,gb);
+	dbg_p(3,s->gb);
 
-	if ((i=checksum(gb))!=gb[gb[1]+2]) {
-		dbg(0,"Failed checksum: received: 0x%02X  calculated: 0x%02X\n",gb[gb[1]+2],i);
+	if ((i=checksum(s->gb))!=s->gb[s->gb[1]+2]) {
+		dbg(0,"Failed checksum: received: 0x%02X  calculated: 0x%02X\n",s->gb[s->gb[1]+2],i);
 		return; // real drive does not return anything
 	}
 
 	// Preserve the original packet for reference "just because" even though
 	// we could actually get away with modifying gb[0] at this point.
-	uint8_t c = gb[0];
+	uint8_t c = s->gb[0];
 
 	// decode bit 6 in the FMT byte b[0] for bank0 vs bank1
 	if (model==2) {
 		//bank = 0; if (c&0x40) { bank = 1; c-=0x40; } // alternative
-		bank = (c >> 6) & 1; // read bit 6 to set bank 0 or 1
+		s->bank = (c >> 6) & 1; // read bit 6 to set bank 0 or 1
 		c &= ~(1 << 6);      // clear bit 6 so incoming 0x4# matches 0x0# case
 	}
 
@@ -2613,27 +3590,456 @@ void get_opr_cmd() {
 	// Does tpdd1 do the 0x22 thing?
 
 	// dispatch
+	stats_begin(STATS_OPR+(c<STATS_FDC?c:STATS_FDC-1));
 	switch(c) {
-		case REQ_DIRENT:        req_dirent();        break;
-		case REQ_OPEN:          req_open();          break;
-		case REQ_CLOSE:         req_close();         break;
-		case REQ_READ:          req_read();          break;
-		case REQ_WRITE:         req_write();         break;
-		case REQ_DELETE:        req_delete();        break;
-		case REQ_FORMAT:        req_format();        break;
-		case REQ_STATUS:        req_status();        break;
-		case REQ_FDC:           req_fdc();           break;
-		case REQ_CONDITION:     req_condition();     break;
-		case REQ_RENAME:        req_rename();        break;
-		case REQ_VERSION:       ret_version();       break;
-		case REQ_CACHE:         req_cache();         break;
-		case REQ_MEM_READ:      req_mem_read();      break;
-		case REQ_MEM_WRITE:     req_mem_write();     break;
-		case REQ_SYSINFO:       ret_sysinfo();       break;
-		case REQ_EXEC:          req_exec();          break;
-		default: dbg(1,"OPR: unknown cmd \"0x%02X\"\n",gb[0]); dbg_p(1,gb);
+		case REQ_DIRENT:        req_dirent(s);        break;
+		case REQ_OPEN:          req_open(s);          break;
+		case REQ_CLOSE:         req_close(s);         break;
+		case REQ_READ:          req_read(s);          break;
+		case REQ_WRITE:         req_write(s);         break;
+		case REQ_DELETE:        req_delete(s);        break;
+		case REQ_FORMAT:        req_format(s);        break;
+		case REQ_STATUS:        req_status(s);        break;
+		case REQ_FDC:           req_fdc(s);           break;
+		case REQ_CONDITION:     req_condition(s);     break;
+		case REQ_RENAME:        req_rename(s);        break;
+		case REQ_VERSION:       ret_version(s);       break;
+		case REQ_CACHE:         req_cache(s);         break;
+		case REQ_MEM_READ:      req_mem_read(s);      break;
+		case REQ_MEM_WRITE:     req_mem_write(s);     break;
+		case REQ_SYSINFO:       ret_sysinfo(s);       break;
+		case REQ_EXEC:          req_exec(s);          break;
+		default: dbg(1,"OPR: unknown cmd \"0x%02X\"\n",s->gb[0]); dbg_p(1,s->gb);
 		// local msg, nothing to client
 	}
+	flush_client_tx(s);
+	stats_end(rx_taken(s));
+}
+
+// Run everything that can be run with the bytes in the rx ring.
+// A request that is waiting on the client for more bytes (an FDC-mode
+// second stage, or the DME check) gets first claim on whatever arrives.
+void process_client_rx(SESSION* s) {
+	unsigned n;
+	while ((n = rx_avail(s))) {
+		// room for a whole response, or wait for the tty to take some
+		if (s->tx_len>TX_BUF_LEN-TX_RESP_MAX) {
+			flush_client_tx(s);
+			if (s->tx_len) break;
+		}
+		if (s->fdc_resume) {
+			if (n<s->fdc_need) break;
+			void (*f)(SESSION* s) = s->fdc_resume;
+			s->fdc_resume = NULL;
+			stats_begin(s->fdc_c>='A' && s->fdc_c<='Z' ? STATS_FDC2+s->fdc_c-'A' : STATS_OPS);
+			f(s);
+			flush_client_tx(s);
+			stats_end(rx_taken(s));
+		}
+		else if (s->dme_wait) req_fdc_dme(s);
+		else if (s->operation_mode==MODE_FDC) get_fdc_cmd(s);
+		else get_opr_cmd(s);
+	}
+}
+
+SESSION* new_session (const char* tty) {
+	if (nsessions>=SESSIONS_MAX) {
+		dbg(0,"Discarded excess tty \"%s\"\n",tty);
+		return NULL;
+	}
+	static unsigned ids = 0;
+	SESSION* s = calloc(1,sizeof(SESSION));
+	if (!s) return NULL;
+	s->id = ids++;
+	strncpy(s->client_tty_name,tty,PATH_MAX);
+	s->client_tty_fd = -1;
+	s->dir_fd = -1;
+	s->operation_mode = operation_mode;
+	s->f_open_mode = F_OPEN_NONE;
+	s->o_file_h = -1;
+	s->pf_next = -1;
+	memcpy(s->dme_cwd,TSDOS_ROOT_LABEL,7);
+	sessions[nsessions++] = s;
+	return s;
+}
+
+void free_session (SESSION* s) {
+	int i;
+	ev_del_fd(s->client_tty_fd);
+	ev_timer_cancel(req_fdc_dme_timeout,s);
+	if (s->client_tty_fd>=0) close(s->client_tty_fd);
+	close_o_file(s);
+	file_list_put(s->fc.fl);
+	set_dir(s,-1);
+	for (i=0;i<nsessions;i++) if (sessions[i]==s) break;
+	for (;i<nsessions-1;i++) sessions[i] = sessions[i+1];
+	if (i<nsessions) nsessions--;
+	free(s);
+}
+
+void client_tty_event(int fd, short revents, void* arg) {
+	SESSION* s = arg;
+	int n = 0;
+	if (revents&POLLIN) n = fill_client_rx(s);
+	else if (revents&POLLOUT) flush_client_tx(s);
+	if (n<0 || (!n && revents&(POLLHUP|POLLERR|POLLNVAL))) {
+		dbg(0,"Lost \"%s\"\n",s->client_tty_name);
+		free_session(s);
+		if (!nsessions) exit(EXIT_FAILURE);
+		return;
+	}
+	process_client_rx(s);
+	flush_client_tx(s);
+}
+
+// Flag a disk change to every client, the way a real drive does after a
+// disk is swapped. The next condition request reports it.
+void disk_changed(void) {
+	for (int i=0;i<nsessions;i++) {
+		sessions[i]->pdd1_condition |= 1<<PDD1_COND_BIT_CHANGED;
+		sessions[i]->pdd2_condition |= 1<<PDD2_COND_BIT_CHANGED;
+	}
+}
+
+// 1 or 2 for a disk image by its header or size, else 0
+int disk_img_model(const char* path) {
+	struct stat st;
+	int m = img_probe(path);
+	if (m || stat(path,&st)) return m;
+	if (st.st_size==PDD1_IMG_LEN) return 1;
+	if (st.st_size==PDD2_IMG_LEN) return 2;
+	return 0;
+}
+
+int lib_cmp(const void* a, const void* b) {
+	return strcmp(((const LIB_IMG*)a)->name,((const LIB_IMG*)b)->name);
+}
+
+// DISK_LIBRARY: open every disk image in dir for the current model, and
+// read them all in, so a "load" is just a pointer swap.
+int load_disk_library(const char* dir) {
+	const unsigned rc = model==1?PDD1_TRACKS*PDD1_SECTORS:PDD2_TRACKS*PDD2_SECTORS;
+	char t[PATH_MAX+1];
+	struct dirent* de;
+	unsigned i, rn;
+	LIB_IMG* l;
+	DIR* D;
+
+	if (!(D = opendir(dir))) return -1;
+	while ((de = readdir(D))) {
+		if (*de->d_name=='.') continue;
+		if (snprintf(t,sizeof(t),"%s/%s",dir,de->d_name)>=(int)sizeof(t)) continue;
+		if (disk_img_model(t)!=model) continue;
+		if (!(l = realloc(disk_lib,(disk_lib_n+1)*sizeof(LIB_IMG)))) break;
+		disk_lib = l;
+		l += disk_lib_n;
+		if (!(l->path = realpath(t,NULL))) continue;
+		l->name = strrchr(l->path,'/')+1;
+		if (!(l->d = img_open(l->path,rc,false,disk_overlay))) {
+			dbg(0,"%s: %s\n",l->path,strerror(errno));
+			free(l->path);
+			continue;
+		}
+		for (rn=0;rn<rc && img_rec(l->d,rn,false);rn++); // fault in / unpack
+		disk_lib_n++;
+	}
+	closedir(D);
+	qsort(disk_lib,disk_lib_n,sizeof(LIB_IMG),lib_cmp);
+	dbg(1,"Disk library: %u TPDD%u images in \"%s\"\n",disk_lib_n,model,dir);
+	for (i=0;i<disk_lib_n;i++) dbg(2,"	%s\n",disk_lib[i].name);
+
+	// -i names one of them
+	if (*disk_img_fname && realpath(disk_img_fname,t))
+		for (i=0;i<disk_lib_n;i++) if (!strcmp(t,disk_lib[i].path)) {
+			disk = disk_lib[i].d;
+			disk_lib_cur = i;
+		}
+	return 0;
+}
+
+// Swap the disk for disk_lib[i], or eject it for i<0.
+void disk_load(int i) {
+	int j;
+	for (j=0;j<nsessions;j++) {
+		close_o_file(sessions[j]);
+		sessions[j]->cur_file = NULL;
+	}
+	disk_sync();
+	journal_close();
+	if (disk && disk_lib_cur<0) img_close(disk); // -i, not from the library
+	disk_lib_cur = i;
+	if (i<0) {
+		disk = NULL;
+		*disk_img_fname = 0x00;
+		dbg(0,"Disk library: ejected\n");
+	} else {
+		disk = disk_lib[i].d;
+		strcpy(disk_img_fname,disk_lib[i].path);
+		dbg(0,"Disk library: inserted \"%s\"\n",disk_lib[i].name);
+	}
+	disk_changed();
+}
+
+// a library image by filename, with or without the extension
+int find_lib_img(const char* name) {
+	size_t n = strlen(name);
+	for (unsigned i=0;i<disk_lib_n;i++) {
+		const char* f = disk_lib[i].name;
+		if (!strcmp(f,name)) return i;
+		if (!strncmp(f,name,n) && f[n]=='.' && !strchr(f+n+1,'.')) return i;
+	}
+	return -1;
+}
+
+// Commands from the DISK_CONTROL fifo, one per line.
+//   reset   overlay: forget all changes to the disk image
+//   commit  overlay: write the changes to the disk image file
+//   load NAME  switch to NAME from the DISK_LIBRARY
+//   eject      no disk
+void disk_command(char* c) {
+	int n;
+	dbg(2,"Disk control: \"%s\"\n",c);
+	if (!strncmp(c,"load ",5)) {
+		if ((n = find_lib_img(c+5))<0) dbg(0,"Disk library: no \"%s\"\n",c+5);
+		else disk_load(n);
+	} else if (!strcmp(c,"eject")) {
+		disk_load(-1);
+	} else if (!strcmp(c,"reset") || !strcmp(c,"commit")) {
+		if (!disk || !disk->overlay) {
+			dbg(0,"Disk control: %s: no overlay\n",c);
+			return;
+		}
+		if (*c=='r') {
+			dbg(0,"Disk overlay: %u changed records dropped\n",img_reset(disk));
+			disk_changed(); // as good as a different disk
+			return;
+		}
+		if ((n = img_commit(disk))<0) dbg(0,"Disk overlay: commit: %s: %s\n",disk_img_fname,strerror(errno));
+		else dbg(0,"Disk overlay: %d changed records written to \"%s\"\n",n,disk_img_fname);
+	} else dbg(0,"Disk control: unknown command \"%s\"\n",c);
+}
+
+void disk_control_event(int fd, short revents, void* arg) {
+	static char b[PATH_MAX+16];
+	static unsigned n = 0;
+	char *p, *q;
+	ssize_t r;
+	(void)revents; (void)arg;
+	while ((r = read(fd,b+n,sizeof(b)-1-n))>0) {
+		n += r;
+		b[n] = 0x00;
+		for (p=b;(q=strchr(p,'\n'));p=q+1) {
+			*q = 0x00;
+			if (q>p && q[-1]=='\r') q[-1] = 0x00;
+			if (*p) disk_command(p);
+		}
+		n -= p-b;
+		memmove(b,p,n);
+		if (n>=sizeof(b)-1) n = 0; // no newline in sight, drop it
+	}
+}
+
+int open_disk_control(const char* path) {
+	int fd;
+	if (mkfifo(path,0600) && errno!=EEXIST) return -1;
+	// read-write, so there is always a writer and poll() never sees EOF
+	if ((fd = open(path,O_RDWR|O_NONBLOCK|O_CLOEXEC))<0) return -1;
+	if (ev_add_fd(fd,POLLIN,disk_control_event,NULL)) { close(fd); return -1; }
+	return 0;
+}
+
+void stats_signal(int sig) {
+	(void)sig;
+	stats_dump(stderr);
+}
+
+// flush and close everything, for a clean exit
+void finish(void) {
+	for (int i=0;i<nsessions;i++) {
+		wait_client_tx(sessions[i],TX_BUF_LEN,TX_EXIT_MS);
+		close_o_file(sessions[i]);
+	}
+	disk_sync();
+	if (disk) dbg(1,"Disk image: %lu sector writes in %lu host writes\n",disk->wrote,disk->writes);
+	stats_close();
+	if (disk && disk->ov_n) dbg(1,"Disk overlay: %u changed records dropped\n",disk->ov_n);
+	journal_close();
+	img_close(disk);
+	for (unsigned i=0;i<disk_lib_n;i++) if ((int)i!=disk_lib_cur) img_close(disk_lib[i].d);
+}
+
+void quit(int sig) {
+	dbg(1,"\nExiting on signal %d\n",sig);
+	if (debug) stats_dump(stderr);
+	finish();
+	exit(0);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//  REPLAY
+//
+// -R feeds a CAPTURE file back through the same code that serves a real
+// client, with a socketpair standing in for each tty. Whatever was received
+// in the capture is written to the client end, and what comes back is
+// compared with what was sent in the capture. Requests are fed as fast as
+// the responses come back, not at the captured pace.
+// The share (and disk image) must be in the same state as when the capture
+// was made, and the options the same. The model is taken from the capture.
+
+typedef struct {
+	int fd;          // the client end of the socketpair
+	uint8_t* exp;    // response expected to the last request fed
+	unsigned exp_n, exp_max;
+	uint8_t* got;    // response actually received so far
+	unsigned got_n, got_max;
+	uint64_t t0;     // ns, when the last request was fed
+	uint64_t cap_ns; // ns, when it was received in the capture
+} REPLAY;
+
+REPLAY replay[SESSIONS_MAX];
+struct {
+	unsigned long n, bad;
+	uint64_t ns, max_ns;
+} replay_stat;
+
+void replay_add(uint8_t** b, unsigned* n, unsigned* max, const void* p, unsigned l) {
+	if (*n+l>*max) {
+		unsigned m = *max ? *max : 1024;
+		while (m<*n+l) m *= 2;
+		uint8_t* t = realloc(*b,m);
+		if (!t) return;
+		*b = t;
+		*max = m;
+	}
+	memcpy(*b+*n,p,l);
+	*n += l;
+}
+
+// the client end is readable
+void replay_event(int fd, short revents, void* arg) {
+	REPLAY* p = arg;
+	uint8_t b[4096];
+	ssize_t n;
+	(void)revents;
+	while ((n = read(fd,b,sizeof(b)))>0) replay_add(&p->got,&p->got_n,&p->got_max,b,n);
+}
+
+void replay_timeout(void* arg) { (void)arg; } // just to wake ev_wait()
+
+// Scan the capture for how many sessions it has, and the model it was made with.
+int replay_scan(char* f) {
+	CAP_REC* r = malloc(sizeof(CAP_REC));
+	FILE* fp;
+	char* t;
+	int n = 0, e;
+	if (!r) return -1;
+	if (!(fp = capture_read_open(f))) { free(r); return -1; }
+	while ((e = capture_read(fp,r))>0) {
+		if (r->sess>=n) n = r->sess+1;
+		if (r->type!=CAP_NOTE || strncmp((char*)r->data,"open ",5)) continue;
+		if ((t = strstr((char*)r->data," model "))) model = atoi(t+7);
+		if ((t = strstr((char*)r->data," profile ")) && strcmp(t+9,profile))
+			dbg(0,"Capture was made with profile \"%s\", replaying with \"%s\"\n",t+9,profile);
+	}
+	fclose(fp);
+	free(r);
+	if (e<0) { errno = EINVAL; return -1; }
+	if (n>SESSIONS_MAX) { errno = ERANGE; return -1; }
+	return n;
+}
+
+int replay_open(SESSION* s, int i) {
+	int sv[2];
+	if (socketpair(AF_UNIX,SOCK_STREAM,0,sv)) return -1;
+	for (int j=0;j<2;j++) fcntl(sv[j],F_SETFL,fcntl(sv[j],F_GETFL)|O_NONBLOCK);
+	s->client_tty_fd = sv[0];
+	replay[i].fd = sv[1];
+	return 0;
+}
+
+// wait for the response to the last request fed, and compare
+void replay_settle(int i) {
+	REPLAY* p = replay+i;
+	uint64_t d = ev_now()+REPLAY_MS;
+	// without the timer, ev_wait() could sleep forever
+	if (ev_timer(replay_timeout,NULL,REPLAY_MS)) { dbg(0,"Replay: %s\n",strerror(errno)); d = 0; }
+	while (p->got_n<p->exp_n && ev_now()<d) ev_wait();
+	ev_timer_cancel(replay_timeout,NULL);
+	if (p->exp_n) {
+		uint64_t t = stats_now()-p->t0;
+		replay_stat.n++;
+		replay_stat.ns += t;
+		if (t>replay_stat.max_ns) replay_stat.max_ns = t;
+		if (p->got_n!=p->exp_n || memcmp(p->got,p->exp,p->exp_n)) {
+			replay_stat.bad++;
+			dbg(0,"Session %d: response at %llu.%06llu differs\n",i,
+				(unsigned long long)p->cap_ns/1000000000u,(unsigned long long)p->cap_ns/1000%1000000);
+			dbg(1,"expected: "); dbg_b(1,p->exp,p->exp_n);
+			dbg(1,"received: "); dbg_b(1,p->got,p->got_n);
+		}
+	}
+	p->exp_n = p->got_n = 0;
+}
+
+int replay_capture(char* f) {
+	CAP_REC* r = malloc(sizeof(CAP_REC));
+	uint64_t c0 = 0;
+	FILE* fp;
+	int e, i;
+
+	if (!r) return 1;
+	if (!(fp = capture_read_open(f))) { dbg(0,"%s: %s\n",f,strerror(errno)); return 1; }
+	for (i=0;i<nsessions;i++) {
+		sessions[i]->tty_ev = POLLIN;
+		if (ev_add_fd(sessions[i]->client_tty_fd,POLLIN,client_tty_event,sessions[i])
+			|| ev_add_fd(replay[i].fd,POLLIN,replay_event,replay+i)) {
+			dbg(0,"Replay: session %d: %s\n",i,strerror(errno));
+			fclose(fp);
+			free(r);
+			return 1;
+		}
+	}
+	while ((e = capture_read(fp,r))>0) {
+		REPLAY* p = replay+r->sess;
+		if (!c0) c0 = r->ns;
+		switch (r->type) {
+			case CAP_NOTE:
+				if (!strncmp((char*)r->data,"open ",5)) {
+					char* t = strstr((char*)r->data," baud ");
+					sessions[r->sess]->operation_mode = strstr((char*)r->data," mode fdc") ? MODE_FDC : MODE_OPR;
+					if (t) stats_baud(atoi(t+6)); // for the line model
+				}
+				break;
+			case CAP_TX:
+				replay_add(&p->exp,&p->exp_n,&p->exp_max,r->data,r->len);
+				break;
+			case CAP_RX: {
+				unsigned t = 0;
+				ssize_t n;
+				replay_settle(r->sess);
+				p->t0 = stats_now();
+				p->cap_ns = r->ns-c0;
+				while (t<r->len) {
+					if ((n = write(p->fd,r->data+t,r->len-t))>0) t += n;
+					else if (n<0 && errno!=EAGAIN && errno!=EINTR) break;
+					else ev_wait(); // let dl catch up
+				}
+				break;
+			}
+		}
+	}
+	for (i=0;i<nsessions;i++) replay_settle(i);
+	fclose(fp);
+	free(r);
+
+	if (e<0) dbg(0,"%s: truncated\n",f);
+	dbg(0,"Replay: %lu responses, %lu differ, %llu us total, %llu us mean, %llu us max\n",
+		replay_stat.n,replay_stat.bad,(unsigned long long)replay_stat.ns/1000,
+		(unsigned long long)(replay_stat.n?replay_stat.ns/replay_stat.n/1000:0),(unsigned long long)replay_stat.max_ns/1000);
+	stats_dump(stderr);
+	finish();
+	return (e<0 || replay_stat.bad);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -2641,9 +4047,11 @@ void get_opr_cmd() {
 //  BOOTSTRAP
 //
 
-void slowbyte(uint8_t b) {
-	write_client_tty(&b,1);
-	if(BASIC_byte_us) usleep(BASIC_byte_us);
+void slowbyte(SESSION* s, uint8_t b) {
+	write_client_tty(s,&b,1);
+	// The per-byte delay only means anything if the byte is actually out
+	// on the wire before we start sleeping.
+	if(BASIC_byte_us) { drain_client_tty(s); usleep(BASIC_byte_us); }
 
 	// line-endings - convert CR, LF, CRLF to local eol
 	if (ch[0]==BASIC_EOL) {
@@ -2666,7 +4074,7 @@ void slowbyte(uint8_t b) {
 	dbg(0,"%c",b);
 }
 
-int send_BASIC(char* f) {
+int send_BASIC(SESSION* s, char* f) {
 	int fd;
 	uint8_t b;
 
@@ -2681,18 +4089,19 @@ int send_BASIC(char* f) {
 
 	dbg(0,"-- start --\n");
 	ch[0]=0x00;
-	while(read(fd,&b,1)==1) slowbyte(b);
+	while(read(fd,&b,1)==1) slowbyte(s,b);
 	close(fd);
 	if (base_len) { // if not in raw mode supply missing trailing EOF & EOL
-		if (b!=LOCAL_EOL && b!=BASIC_EOL && b!=BASIC_EOF) slowbyte(BASIC_EOL);
-		if (b!=BASIC_EOF) slowbyte(BASIC_EOF);
+		if (b!=LOCAL_EOL && b!=BASIC_EOL && b!=BASIC_EOF) slowbyte(s,BASIC_EOL);
+		if (b!=BASIC_EOF) slowbyte(s,BASIC_EOF);
 	}
-	close(client_tty_fd);
+	drain_client_tty(s);
+	close(s->client_tty_fd);
 	dbg(0,"\n-- end --\n\n");
 	return 0;
 }
 
-int bootstrap(char* f) {
+int bootstrap(SESSION* s, char* f) {
 	dbg(0,"Bootstrap: Installing \"%s\"\n\n",f);
 	if (access(f,F_OK)==-1) {
 		dbg(0,"Not found.\n");
@@ -2725,7 +4134,7 @@ int bootstrap(char* f) {
 	dbg(0,"\nPress [Enter] when ready...");
 	getchar();
 
-	{ int r; if ((r=send_BASIC(f))!=0) return r; }
+	{ int r; if ((r=send_BASIC(s,f))!=0) return r; }
 
 	strcpy(t,f);
 	strcat(t,".post-install.txt");
@@ -2742,6 +4151,15 @@ int bootstrap(char* f) {
 //  MAIN
 //
 
+char* tty_arg[SESSIONS_MAX];
+int ntty = 0;
+
+void add_client_tty (char* s) {
+	dbg(3,"%s(%s)\n",__func__,s);
+	if (ntty<SESSIONS_MAX) { tty_arg[ntty++] = s; return; }
+	dbg(0,"Discarded excess tty \"%s\"\n",s);
+}
+
 void show_config () {
 	dbg(0,"model           : %d\n",model);
 	dbg(0,"operation_mode  : %d\n",operation_mode);
@@ -2761,15 +4179,21 @@ void show_config () {
 	dbg(0,"BASIC_byte_ms   : %d\n",BASIC_byte_us/1000);
 	dbg(0,"app_lib_dir     : \"%s\"\n",app_lib_dir);
 	dbg(0,"disk_img_fname  : \"%s\"\n",disk_img_fname);
+	dbg(0,"disk_overlay    : %s\n",disk_overlay?"true":"false");
+	dbg(0,"disk_control    : \"%s\"\n",disk_control?disk_control:"");
+	dbg(0,"disk_library    : \"%s\"\n",disk_library?disk_library:"");
+	dbg(0,"disk_journal    : %s\n",disk_journal?"true":"false");
+	dbg(0,"stats_shm       : \"%s\"\n",stats_shm?stats_shm:"");
+	dbg(0,"capture_fname   : \"%s\"\n",capture_fname?capture_fname:"");
 	dbg(2,"iwd             : \"%s\"\n",iwd);
-	dbg(2,"cwd             : \"%s\"\n",cwd);
 	dbg(0,"share_path[0]   : \"%s\"\n",share_path[0]);
 	dbg(0,"share_path[1]   : \"%s\"\n",share_path[1]);
 	dbg(0,"dme_root_label  : \"%-*.*s\"\n",6,6,dme_root_label);
 	dbg(0,"dme_parent_label: \"%-*.*s\"\n",6,6,dme_parent_label);
 	dbg(0,"dme_dir_label   : \"%-2.2s\"\n",dme_dir_label);
 	dbg(0,"tildes          : %s\n",tildes?"true":"false");
-	dbg(0,"client_tty_name : \"%s\"\n",client_tty_name);
+	dbg(0,"write_policy    : %s\n",write_policy==WRITE_POLICY_NONE?"none":write_policy==WRITE_POLICY_FSYNC?"fsync":"close");
+	for (int i=0;i<nsessions;i++) dbg(0,"client_tty_name : \"%s\"\n",sessions[i]->client_tty_name);
 	dbg(0,"baud            : %d\n",baud);
 	dbg(0,"rtscts          : %s\n",rtscts?"true":"false");
 	dbg(0,"xonoff          : %s\n",xonoff?"true":"false");
@@ -2798,14 +4222,17 @@ void show_main_help() {
 		" -g          Getty mode - run as daemon\n"
 #endif
 		" -h          Print this help\n"
-		" -i file     Disk image filename for raw sector access - empty for help\n"
+		" -i file     Disk image to serve files and sectors from - empty for help\n"
 //		" -l          List loader files and show bootstrap help\n"
 		" -m 1|2      Model - 1 = FB-100/TPDD1, 2 = TPDD2 (%4$u)\n"
+		" -o file     Convert the -i disk image to file (packed if *" IMG_PACK_SUFFIX ") and exit\n"
 //		" -n          Disable TS-DOS directories\n"
 //		" -n #.#[p]   Names - Translate filenames to #.# format, optionally [p]added\n"
 		" -p dir      Path - /path/to/dir with files to be served (./)\n"
 		" -r bool     RTS/CTS hardware flow control (%6$s)\n"
+		" -R file     Replay a CAPTURE file against the share and exit\n"
 		" -s #        Speed - serial port baud rate (%5$d)\n"
+		" -t file     Decode a CAPTURE file and exit\n"
 		" -u          Uppercase all filenames (%7$s)\n"
 		" -~ bool     Truncated filenames end in '~' (%10$s)\n"
 		" -v          Verbosity - more v's = more verbose, both activity & help\n"
@@ -2815,6 +4242,7 @@ void show_main_help() {
 		"The 1st non-option argument is another way to specify the tty device.\n"
 		"The 2nd non-option argument is another way to specify the share path.\n"
 		"TPDD2 mode accepts a 2nd share path for bank 1.\n"
+		"-d may be given more than once to serve several clients at once.\n"
 		//"TS-DOS directory support is only possible in TPDD1 mode.\n"
 		"\"bool\" accepts case-insensitive: on off 0 1 y n t f yes no true false\n"
 		"\n"
@@ -2824,6 +4252,7 @@ void show_main_help() {
 		"   $ %1$s -v -p ~/Downloads/REX\n"
 		"   $ %1$s -c wp2 /dev/cu.usbserial-AB0MQNN1 \"~/Documents/WP-2 Files\"\n"
 		"   $ %1$s -m2 -p /tmp/bank0 -p /tmp/bank1\n"
+		"   $ %1$s -d ttyUSB0 -d ttyUSB1 -d ttyUSB2 -p ~/m100\n"
 		"\n"
 		,args[0]
 		,ATTR_DEF
@@ -2947,7 +4376,18 @@ int main(int argc, char** argv) {
 	if (getenv("DME")) dme_en = atobool(getenv("DME"));
 	if (getenv("TSLOAD")) enable_magic_files = atobool(getenv("TSLOAD"));
 	if (getenv("TILDES")) tildes = atobool(getenv("TILDES"));
-	if (getenv("CLIENT_TTY")) strcpy(client_tty_name,getenv("CLIENT_TTY"));
+	if (getenv("WRITE_POLICY")) {
+		if (!strcasecmp(getenv("WRITE_POLICY"),"none")) write_policy = WRITE_POLICY_NONE;
+		else if (!strcasecmp(getenv("WRITE_POLICY"),"fsync")) write_policy = WRITE_POLICY_FSYNC;
+		else write_policy = WRITE_POLICY_CLOSE;
+	}
+	if (getenv("DISK_OVERLAY")) disk_overlay = atobool(getenv("DISK_OVERLAY"));
+	if (getenv("DISK_CONTROL")) disk_control = getenv("DISK_CONTROL");
+	if (getenv("DISK_LIBRARY")) disk_library = getenv("DISK_LIBRARY");
+	if (getenv("DISK_JOURNAL")) disk_journal = atobool(getenv("DISK_JOURNAL"));
+	if (getenv("STATS_SHM")) stats_shm = getenv("STATS_SHM");
+	if (getenv("CAPTURE")) capture_fname = getenv("CAPTURE");
+	if (getenv("TX_DRAIN")) tx_drain = atobool(getenv("TX_DRAIN"));
 	if (getenv("BAUD")) baud = atoi(getenv("BAUD"));
 	if (getenv("RTSCTS")) rtscts = atobool(getenv("RTSCTS"));
 	if (getenv("XONOFF")) xonoff = atobool(getenv("XONOFF"));
@@ -2959,7 +4399,7 @@ int main(int argc, char** argv) {
 #endif
 
 	// commandline
-	while ((i = getopt (argc, argv, ":0a:b:c:d:e:fhi:lm:np:r:s:uvwx:z:~:^"
+	while ((i = getopt (argc, argv, ":0a:b:c:d:e:fhi:lm:no:p:r:R:s:t:uvwx:z:~:^"
 #if !defined(_WIN)
 		"g"
 #endif
@@ -2969,7 +4409,7 @@ int main(int argc, char** argv) {
 			case 'a': default_attr=*strndup(optarg,1);            break;
 			case 'b': strcpy(bootstrap_fname,optarg);             break;
 			case 'c': load_profile(optarg);                       break;
-			case 'd': strcpy(client_tty_name,optarg);             break;
+			case 'd': add_client_tty(optarg);                     break;
 			case 'e': dme_en = atobool(optarg);                   break;
 			//case 'f': set_fnames(optarg);                         break;
 			case 'f': operation_mode = MODE_FDC;                  break;
@@ -2983,9 +4423,12 @@ int main(int argc, char** argv) {
 			case 'n': dme_en = false;                             break; // back compat, short for -e false
 			//case 'n': set_fnames(optarg);                         break;
 			//case 'o': operation_mode = atobool(optarg);           break;
+			case 'o': strncpy(convert_fname,optarg,PATH_MAX);     break;
 			case 'p': add_share_path(optarg);                     break;
 			case 'r': rtscts = atobool(optarg);                   break;
+			case 'R': strncpy(replay_fname,optarg,PATH_MAX);      break;
 			case 's': baud = atoi(optarg);                        break;
+			case 't': strncpy(decode_fname,optarg,PATH_MAX);      break;
 			case 'u': upcase = true;                              break;
 			case 'v': debug++;                                    break;
 			case 'w': load_profile("wp2");                        break; // back compat, short for -c wp2
@@ -3008,20 +4451,44 @@ int main(int argc, char** argv) {
 	for (i=0; optind < argc; optind++) {
 		if (x) dbg(1,"non-option arg %u: \"%s\"\n",i,argv[optind]);
 		switch (i++) {
-			case 0: strcpy (client_tty_name,argv[optind]); break; // tty device
+			case 0: add_client_tty(argv[optind]); break; // tty device
 			case 1:
 			case 2: add_share_path(argv[optind]); break; // share path(s)
 			default: dbg(0,"Unknown argument: \"%s\"\n",argv[optind]);
 		}
 	}
 
+	if (*replay_fname) {
+		if ((i = replay_scan(replay_fname))<0) { dbg(0,"%s: %s\n",replay_fname,strerror(errno)); return 1; }
+		for (ntty=0;ntty<i;ntty++) tty_arg[ntty] = "replay";
+	}
+
 	// base setup that's always needed, whether tpdd or bootstrap
 	if (model<1||model>2) {dbg(0,"Invalid model \"%u\"\n",model); return 1; }
-	if (share_path[0][0]) cd_share_path();
-	if (!cwd[0]) update_cwd();
-	if (!share_path[0][0]) strcpy(share_path[0],cwd);
-	resolve_client_tty_name();
+	if (*convert_fname) return convert_disk_image(convert_fname);
+	if (*decode_fname) return decode_capture(decode_fname);
+	if (!share_path[0][0]) strcpy(share_path[0],iwd);
+	// open the share paths, everything else is relative to these
+	for (i=0;i<2;i++) {
+		char t[PATH_MAX+1] = {0x00};
+		if (!share_path[i][0]) continue;
+		if (realpath(share_path[i],t)) strcpy(share_path[i],t);
+		if ((share_fd[i] = open(share_path[i],O_RDONLY|O_DIRECTORY))<0) dbg(0,"FAILED CD TO \"%s\"\n",share_path[i]);
+	}
+	if (share_fd[0]<0) share_fd[0] = open(iwd,O_RDONLY|O_DIRECTORY);
+	if (!ntty && getenv("CLIENT_TTY")) add_client_tty(getenv("CLIENT_TTY"));
+	if (!ntty) add_client_tty("");
+	for (i=0;i<ntty;i++) {
+		SESSION* s = new_session(tty_arg[i]);
+		if (!s) continue;
+		set_dir(s,share_fd[0]);
+		strcpy(s->cwd,share_path[0]);
+		if (!*replay_fname) resolve_client_tty_name(s);
+	}
 	find_lib_file(bootstrap_fname);
+#if !defined(_WIN)
+	if (getty_mode && nsessions>1) { dbg(0,"Getty mode only supports one tty\n"); return 1; }
+#endif
 
 	// bootstrap overrides needed before opening the tty
 	if (bootstrap_fname[0]) {
@@ -3033,18 +4500,32 @@ int main(int argc, char** argv) {
 
 	if (x) { show_config(); return 0; }
 
-	dbg(0,    "Serial Device: %s\n",client_tty_name);
-
-	if ((i=open_client_tty())) return i;
-
-	show_tty_settings();
+	if (capture_fname && capture_open(capture_fname)) dbg(0,"CAPTURE: %s: %s\n",capture_fname,strerror(errno));
 
 	// send loader and exit
-	if (bootstrap_fname[0]) return (bootstrap(bootstrap_fname));
+	if (bootstrap_fname[0]) {
+		SESSION* s = sessions[0];
+		dbg(0,    "Serial Device: %s\n",s->client_tty_name);
+		if ((i=open_client_tty(s))) return i;
+		show_tty_settings(s);
+		return (bootstrap(s,bootstrap_fname));
+	}
+
+	for (i=0;i<nsessions;i++) {
+		SESSION* s = sessions[i];
+		int e;
+		if (*replay_fname) {
+			if (replay_open(s,i)) { dbg(0,"%s\n",strerror(errno)); return 1; }
+			continue;
+		}
+		dbg(0,    "Serial Device: %s\n",s->client_tty_name);
+		if ((e=open_client_tty(s))) return e;
+		show_tty_settings(s);
+	}
 
 	// further setup that's only needed for tpdd
 	if (model==2) { load_rom(TPDD2_ROM); dme_en=false; }
-	if (dme_en && base_len && base_len<=6) memcpy(dme_cwd,dme_root_label,base_len);
+	if (dme_en && base_len && base_len<=6) for (i=0;i<nsessions;i++) memcpy(sessions[i]->dme_cwd,dme_root_label,base_len);
 	cfnl = base_len + 1 + ext_len; // client filename length
 	if (base_len<1||cfnl>TPDD_FILENAME_LEN) cfnl = TPDD_FILENAME_LEN;
 
@@ -3071,13 +4552,23 @@ int main(int argc, char** argv) {
 	// commands, so that a user with no client-side display like TEENY, REX
 	// rom image loading, REXCPM rxcini setup, etc can see what filenames are
 	// available to load, and their exact spelling from the tpdd client side.
-	if (debug) update_file_list(NO_RET);
+	if (debug) update_file_list(sessions[0],NO_RET);
 
 	// process commands forever
-	while (1) switch (operation_mode) {
-		case MODE_FDC: get_fdc_cmd(); break;
-		default: get_opr_cmd(); break;
+	if (ev_signal(SIGINT,quit) || ev_signal(SIGTERM,quit) || ev_signal(SIGHUP,quit) || ev_signal(SIGUSR1,stats_signal))
+		dbg(0,"Signals: %s\n",strerror(errno));
+	if (stats_init(stats_shm)) dbg(0,"STATS_SHM: %s: %s\n",stats_shm,strerror(errno));
+	if (*replay_fname) return replay_capture(replay_fname);
+	if (disk_library && load_disk_library(disk_library)) dbg(0,"DISK_LIBRARY: %s: %s\n",disk_library,strerror(errno));
+	if (disk_control && open_disk_control(disk_control)) dbg(0,"DISK_CONTROL: %s: %s\n",disk_control,strerror(errno));
+	for (i=0;i<nsessions;) {
+		sessions[i]->tty_ev = POLLIN;
+		if (!ev_add_fd(sessions[i]->client_tty_fd,POLLIN,client_tty_event,sessions[i])) { i++; continue; }
+		dbg(0,"Discarded tty \"%s\": %s\n",sessions[i]->client_tty_name,strerror(errno));
+		free_session(sessions[i]);
 	}
+	if (!nsessions) return 1;
+	while (1) ev_wait();
 
 	// file_list_cleanup()
 	return 0;
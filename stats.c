@@ -0,0 +1,230 @@
+// Per-request counters and latency histograms, see stats.h.
+//
+// Two clock_gettime() per request, and two around each tty write and
+// each trip into the disk image, is all this costs, so it's always on. SIGUSR1 prints it, and STATS_SHM
+// shares it.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "stats.h"
+
+static STATS local;
+STATS* stats = &local;
+static char* shm_name = NULL;
+
+// the request being timed
+static int cur = -1;
+static uint64_t t0, serial_ns, image_ns;
+static unsigned tx;
+
+// the last one, for the line model
+static uint64_t last_end, last_tx_ns;
+
+uint64_t stats_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+static void stats_header(STATS* s) {
+	memcpy(s->magic,STATS_MAGIC,8);
+	s->version = STATS_VERSION;
+	s->ops = STATS_OPS;
+	s->buckets = STATS_BUCKETS;
+	s->pid = getpid();
+}
+
+int stats_init(const char* name) {
+	STATS* s;
+	int fd;
+	stats_header(&local);
+	if (!name || !*name) return 0;
+	if ((fd = shm_open(name,O_RDWR|O_CREAT,0644))<0) return -1;
+	if (ftruncate(fd,sizeof(STATS))
+		|| (s = mmap(NULL,sizeof(STATS),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0))==MAP_FAILED) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	close(fd);
+	memcpy(s,&local,sizeof(STATS));
+	stats = s;
+	shm_name = strdup(name);
+	return 0;
+}
+
+void stats_baud(uint32_t baud) {
+	stats->baud = baud;
+}
+
+// wire time of n bytes, ns
+// Whole seconds' worth of bytes first, so the running totals from
+// stats_dump_line() can't overflow the multiply.
+static uint64_t wire_ns(uint64_t n) {
+	uint64_t b = stats->baud;
+	if (!b) return 0;
+	return n/b*STATS_FRAME_BITS*1000000000u + n%b*STATS_FRAME_BITS*1000000000u/b;
+}
+
+void stats_close(void) {
+	if (!shm_name) return;
+	shm_unlink(shm_name);
+}
+
+// Seqlock writer. The fence keeps the counter stores from being seen
+// ahead of the odd seq, and the release on the even one keeps them from
+// being seen after it.
+static void write_begin(void) {
+	__atomic_store_n(&stats->seq,stats->seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(void) {
+	__atomic_store_n(&stats->seq,stats->seq+1,__ATOMIC_RELEASE);
+}
+
+void stats_begin(unsigned op) {
+	cur = op<STATS_OPS ? (int)op : -1;
+	serial_ns = 0;
+	image_ns = 0;
+	tx = 0;
+	t0 = stats_now();
+}
+
+void stats_image(uint64_t since) {
+	if (cur>=0) image_ns += stats_now()-since;
+}
+
+void stats_serial(uint64_t ns) {
+	if (cur>=0) serial_ns += ns;
+}
+
+void stats_sent(unsigned n) {
+	if (cur>=0) tx += n;
+}
+
+void stats_end(unsigned rx) {
+	if (cur<0) return;
+	uint64_t e = stats_now(), t = e-t0, us = t/1000, gap = 0, w;
+	STATS_OP* o = stats->op+cur;
+	unsigned b = 0;
+	while (us && b<STATS_BUCKETS-1) { us >>= 1; b++; }
+	if (serial_ns>t) serial_ns = t;
+	if (image_ns>t-serial_ns) image_ns = t-serial_ns;
+	// client time: since the last response was queued, less both wire times
+	w = last_tx_ns+wire_ns(rx);
+	if (last_end && t0-last_end<STATS_IDLE_MS*1000000ull) gap = t0-last_end;
+	last_end = e;
+	last_tx_ns = wire_ns(tx);
+
+	write_begin();
+	o->n++;
+	o->ns[STATS_SERIAL] += serial_ns;
+	o->ns[STATS_IMG] += image_ns;
+	o->ns[STATS_FS] += t-serial_ns-image_ns;
+	if (t>o->max_ns) o->max_ns = t;
+	o->hist[b]++;
+	o->rx_bytes += rx;
+	o->tx_bytes += tx;
+	if (gap) { o->gaps++; o->client_ns += gap>w ? gap-w : 0; }
+	write_end();
+	cur = -1;
+}
+
+void stats_cache(bool hit) {
+	write_begin();
+	if (hit) stats->cache_hits++;
+	else stats->cache_misses++;
+	write_end();
+}
+
+static const char* op_name(unsigned i, char* b, size_t l) {
+	if (i>=STATS_FDC) {
+		snprintf(b,l,"fdc %c%s",'A'+(i-STATS_FDC)%(STATS_FDC2-STATS_FDC),i>=STATS_FDC2?" data":"");
+		return b;
+	}
+	switch (i) {
+		case REQ_DIRENT:    return "dirent";
+		case REQ_OPEN:      return "open";
+		case REQ_CLOSE:     return "close";
+		case REQ_READ:      return "read";
+		case REQ_WRITE:     return "write";
+		case REQ_DELETE:    return "delete";
+		case REQ_FORMAT:    return "format";
+		case REQ_STATUS:    return "status";
+		case REQ_FDC:       return "fdc";
+		case REQ_CONDITION: return "condition";
+		case REQ_RENAME:    return "rename";
+		case REQ_VERSION:   return "version";
+		case REQ_CACHE:     return "cache";
+		case REQ_MEM_WRITE: return "mem_write";
+		case REQ_MEM_READ:  return "mem_read";
+		case REQ_SYSINFO:   return "sysinfo";
+		case REQ_EXEC:      return "exec";
+	}
+	snprintf(b,l,"opr 0x%02X",i);
+	return b;
+}
+
+// upper bound of the bucket holding the p'th percentile, in us
+static unsigned long pct(const STATS_OP* o, unsigned p) {
+	uint64_t c = 0, want = (o->n*p+99)/100;
+	unsigned b;
+	for (b=0;b<STATS_BUCKETS-1;b++) if ((c += o->hist[b])>=want) break;
+	return 1ul<<b;
+}
+
+// Line model, per kind of request: mean wire, dl, and client time, and
+// the line's share of their sum.
+static void stats_dump_line(FILE* f) {
+	uint64_t tw = 0, th = 0, tc = 0;
+	char b[16];
+	fprintf(f,"Line model, %u baud 8N1:\n",stats->baud);
+	fprintf(f,"%-12s %8s %9s %9s %9s %6s\n","request","count","wire_us","dl_us","client_us","line%");
+	for (unsigned i=0;i<STATS_OPS;i++) {
+		const STATS_OP* o = stats->op+i;
+		if (!o->n) continue;
+		uint64_t w = wire_ns(o->rx_bytes+o->tx_bytes)/o->n,
+			h = (o->ns[STATS_FS]+o->ns[STATS_IMG]+o->ns[STATS_SERIAL])/o->n,
+			c = o->gaps ? o->client_ns/o->gaps : 0;
+		tw += w*o->n; th += h*o->n; tc += c*o->n;
+		fprintf(f,"%-12s %8llu %9llu %9llu %9llu %5.1f%%\n",op_name(i,b,sizeof(b)),(unsigned long long)o->n,
+			(unsigned long long)w/1000,(unsigned long long)h/1000,(unsigned long long)c/1000,w+h+c?100.0*w/(w+h+c):0.0);
+	}
+	if (tw+th+tc) fprintf(f,"All requests: line %.1f%%, dl %.1f%%, client %.1f%% of the time\n",
+		100.0*tw/(tw+th+tc),100.0*th/(tw+th+tc),100.0*tc/(tw+th+tc));
+}
+
+void stats_dump(FILE* f) {
+	char b[16];
+	fprintf(f,"%-12s %8s %9s %9s %9s %9s %9s %7s %7s %7s\n",
+		"request","count","mean_us","max_us","fs_us","image_us","serial_us","p50<","p90<","p99<");
+	for (unsigned i=0;i<STATS_OPS;i++) {
+		const STATS_OP* o = stats->op+i;
+		if (!o->n) continue;
+		fprintf(f,"%-12s %8llu %9llu %9llu %9llu %9llu %9llu %7lu %7lu %7lu\n",
+			op_name(i,b,sizeof(b)),
+			(unsigned long long)o->n,
+			(unsigned long long)((o->ns[STATS_FS]+o->ns[STATS_IMG]+o->ns[STATS_SERIAL])/o->n/1000),
+			(unsigned long long)(o->max_ns/1000),
+			(unsigned long long)(o->ns[STATS_FS]/1000),
+			(unsigned long long)(o->ns[STATS_IMG]/1000),
+			(unsigned long long)(o->ns[STATS_SERIAL]/1000),
+			pct(o,50),pct(o,90),pct(o,99));
+	}
+	if (stats->baud) stats_dump_line(f);
+	if (stats->cache_hits+stats->cache_misses)
+		fprintf(f,"Sector cache: %llu loads, %llu prefetched, %llu not\n",
+			(unsigned long long)(stats->cache_hits+stats->cache_misses),
+			(unsigned long long)stats->cache_hits,(unsigned long long)stats->cache_misses);
+	fflush(f);
+}
@@ -0,0 +1,97 @@
+#ifndef PDD_STATS_H
+#define PDD_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per-request counters and latency histograms.
+//
+// A request is timed from when its last byte has been received to when
+// its last response byte has been handed to the tty, and the time is split
+// three ways: serial (the write() to the tty), image (in the disk image
+// code), and filesystem (everything else).
+//
+// Line model: with the baud rate known, the bytes each request took on the
+// wire, both ways, give the time the line must have been busy for it. The
+// gap between the end of one response and the end of the next request,
+// less the wire time of both, is time the client spent. So for each kind of
+// request, the time per request splits into line, dl (host), and client,
+// and the line share of that is how close to line rate it ran. The client
+// time assumes one client, and gaps over STATS_IDLE_MS are not counted
+// (someone looking at a menu).
+//
+// The counters live in STATS, which can be a POSIX shared memory segment
+// (STATS_SHM), so another process can read them while dl runs. There's
+// one writer, and seq is odd while it's in the middle of an update, so a
+// reader copies the whole thing and tries again if seq was odd or changed.
+
+#define STATS_MAGIC   "DL2STATS"
+#define STATS_VERSION 2
+
+#define STATS_OPR     0   // + Operation-mode request format byte 0x00-0x3F
+#define STATS_FDC     64  // + FDC-mode command letter - 'A'
+#define STATS_FDC2    90  // + FDC-mode command letter - 'A', the data stage
+#define STATS_OPS     116
+
+// bucket i counts latencies under 2^i microseconds, the last one the rest
+#define STATS_BUCKETS 24
+
+#define STATS_FRAME_BITS 10 // bits on the wire per byte, 8N1 = start + 8 + stop
+#ifndef STATS_IDLE_MS
+#define STATS_IDLE_MS 1000
+#endif
+
+enum { STATS_FS, STATS_IMG, STATS_SERIAL, STATS_PHASES };
+
+typedef struct {
+	uint64_t n;
+	uint64_t ns[STATS_PHASES]; // total time in each phase
+	uint64_t max_ns;
+	uint64_t hist[STATS_BUCKETS];
+	uint64_t rx_bytes;   // request bytes, from the client
+	uint64_t tx_bytes;   // response bytes
+	uint64_t gaps;       // requests that had a client time, see above
+	uint64_t client_ns;  // total client time of those
+} STATS_OP;
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t ops;
+	uint32_t buckets;
+	uint32_t pid;
+	volatile uint32_t seq;
+	uint32_t baud;         // for the line model, 0 = unknown
+	uint64_t cache_hits;   // TPDD2 cache loads that were prefetched
+	uint64_t cache_misses; // and that weren't
+	STATS_OP op[STATS_OPS];
+} STATS;
+
+extern STATS* stats;
+
+// Put the counters in shared memory object name, else they stay private.
+int      stats_init (const char* name);
+void     stats_close (void);
+
+uint64_t stats_now (void); // ns, monotonic
+
+void     stats_baud (uint32_t baud);
+
+// Around one request. op is one of the STATS_* slots.
+// rx is how many bytes the request took from the client.
+void     stats_begin (unsigned op);
+void     stats_end (unsigned rx);
+
+// During a request: the disk image since stats_now() was since, ns on the
+// tty, n bytes sent.
+void     stats_image (uint64_t since);
+void     stats_serial (uint64_t ns);
+void     stats_sent (unsigned n);
+
+// a TPDD2 cache load, prefetched or not
+void     stats_cache (bool hit);
+
+void     stats_dump (FILE* f);
+
+#endif // PDD_STATS_H
@@ -14,6 +14,10 @@
 #include <sys/xattr.h>
 #endif
 
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "xattr.h"
 
 #ifndef XATTR_NAME
@@ -40,6 +44,22 @@ void dl_getxattr(const char* path, uint8_t* value) {
 #endif
 }
 
+// like dl_getxattr() but name is relative to the directory dirfd
+// There is no portable getxattrat(). Linux can reach the file through the
+// directory fd in /proc without opening it. Elsewhere, open it.
+void dl_getxattrat(int dirfd, const char* name, uint8_t* value) {
+#if defined(__linux__)
+	char p[64+256];
+	snprintf(p,sizeof(p),"/proc/self/fd/%d/%s",dirfd,name);
+	getxattr(p, xattr_name, value, 1);
+#else
+	int fd = openat(dirfd, name, O_RDONLY|O_NONBLOCK);
+	if (fd<0) return;
+	dl_fgetxattr(fd, value);
+	close(fd);
+#endif
+}
+
 void dl_fgetxattr(int fd, uint8_t* value) {
 #if defined(__linux__)
 	fgetxattr(fd, xattr_name, value, 1);
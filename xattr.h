@@ -10,12 +10,14 @@
 extern const char* xattr_name;
 
 void dl_getxattr (const char* path, uint8_t* value);
+void dl_getxattrat (int dirfd, const char* name, uint8_t* value);
 void dl_fgetxattr (int fd, uint8_t* value);
 void dl_fsetxattr (int fd, const uint8_t* value);
 
 #else // USE_XATTR
 
 #define dl_getxattr(x,y)
+#define dl_getxattrat(x,y,z)
 #define dl_fgetxattr(x,y)
 #define dl_fsetxattr(x,y)
 